@@ -0,0 +1,149 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2025 Korzeterm Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Headless throughput benchmark for the parser and screen model.
+//
+// Usage: korzeterm-bench [--mb N] [recording...]
+//
+// Runs a set of generated workloads through TerminalScreen, followed by any
+// recorded byte streams given on the command line (for example captured with
+// `script -q -c htop htop.log`), and reports MB/s, ns/byte and heap
+// allocations per MB for each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "terminal.h"
+#include "workloads.h"
+
+// Count every heap allocation made by the process
+static size_t g_allocations = 0;
+
+void *operator new(size_t size) {
+    g_allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+// Feed the stream through a fresh screen in PTY-sized chunks, dropping the
+// damage after each one as a presented frame would
+static void feedStream(TerminalScreen &screen, const std::string &data) {
+    for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+        size_t length = std::min(kChunkSize, data.size() - offset);
+        screen.feed(data.data() + offset, int(length));
+        screen.clearDamage();
+    }
+}
+
+static void runBenchmark(const char *name, const std::string &data) {
+    if (data.empty()) {
+        printf("%-24s (empty)\n", name);
+        return;
+    }
+    
+    TerminalScreen screen(24, 80);
+    
+    // One warm-up pass fills the scrollback and the color table, then repeat
+    // until enough time has passed for a stable figure
+    feedStream(screen, data);
+    
+    size_t allocationsBefore = g_allocations;
+    size_t bytes = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    do {
+        feedStream(screen, data);
+        bytes += data.size();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (seconds < 0.5);
+    size_t allocations = g_allocations - allocationsBefore;
+    
+    double megabytes = bytes / (1024.0 * 1024.0);
+    printf("%-24s %10.1f MB/s %10.2f ns/byte %12.1f allocs/MB\n",
+           name, megabytes / seconds, seconds * 1e9 / bytes, allocations / megabytes);
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = 8 * 1024 * 1024;
+    std::vector<const char *> recordings;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mb") == 0 && i + 1 < argc) {
+            size = size_t(std::max(1, atoi(argv[++i]))) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            printf("Usage: %s [--mb N] [recording...]\n", argv[0]);
+            return 0;
+        } else {
+            recordings.push_back(argv[i]);
+        }
+    }
+    
+    for (const Workload &workload : kWorkloads) {
+        runBenchmark(workload.name, workload.make(size));
+    }
+    
+    int result = 0;
+    for (size_t i = 0; i < recordings.size(); i++) {
+        std::string data;
+        if (!readFile(recordings[i], &data)) {
+            fprintf(stderr, "Failed to read %s: %s\n", recordings[i], strerror(errno));
+            result = 1;
+            continue;
+        }
+        runBenchmark(recordings[i], data);
+    }
+    
+    return result;
+}
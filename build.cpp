@@ -1,26 +1,133 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <initializer_list>
 #include <string>
 
-int main() {
+#include <sys/stat.h>
+
+#include "build.h"
+
+// The precompiled header is only used when it was built with the same flags
+// as main.cpp, so both take them from here
+static const char* kQtCflags = "$(pkg-config --cflags Qt5Widgets Qt5Core Qt5Gui)";
+static const char* kQtLibs = "$(pkg-config --libs Qt5Widgets Qt5Core Qt5Gui)";
+static const char* kCxxFlags = "-std=c++17 -O2 -Wall -Wextra";
+
+// The training run of a profile-guided build: the benchmark workloads,
+// parsed and painted offscreen
+static const char* kTrainingCommand = "./korzeterm --replay";
+
+// Last modified time of a file, 0 if it does not exist
+static time_t modifiedTime(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_mtime : 0;
+}
+
+// Whether target is missing or older than any of its inputs
+static bool outOfDate(const char* target, std::initializer_list<const char*> inputs) {
+    time_t targetTime = modifiedTime(target);
+    if (targetTime == 0) {
+        return true;
+    }
+    for (const char* input : inputs) {
+        if (modifiedTime(input) > targetTime) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    // "bench" builds and runs the headless parser benchmark instead; any
+    // further arguments are passed on as recordings to replay
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        const char* benchCmd = "/usr/bin/g++ -std=c++17 -O2 -o korzeterm-bench bench.cpp -Wall -Wextra";
+        printf("Running: %s\n", benchCmd);
+        
+        if (system(benchCmd) != 0) {
+            printf("Benchmark build failed!\n");
+            return 1;
+        }
+        
+        std::string run = "./korzeterm-bench";
+        for (int i = 2; i < argc; i++) {
+            run += " '";
+            run += argv[i];
+            run += "'";
+        }
+        return system(run.c_str()) == 0 ? 0 : 1;
+    }
+    
+    // "release", "lto" and "pgo" choose an optimized build; without one
+    // the compile flags are used as they are
+    ib_build_mode mode = IB_BUILD_DEFAULT;
+    if (argc > 1) {
+        if (strcmp(argv[1], "release") == 0) {
+            mode = IB_BUILD_RELEASE;
+        } else if (strcmp(argv[1], "lto") == 0) {
+            mode = IB_BUILD_LTO;
+        } else if (strcmp(argv[1], "pgo") == 0) {
+            mode = IB_BUILD_PGO;
+        } else {
+            printf("Usage: %s [release|lto|pgo|bench [recording...]]\n", argv[0]);
+            return 1;
+        }
+    }
+    
     printf("Building KorzeTerm...\n");
     
-    // Generate the moc file (Qt Meta-Object Compiler)
-    printf("Generating Meta-Object file...\n");
-    int moc_result = system("moc main.cpp -o main.moc");
+    // Generate the moc file (Qt Meta-Object Compiler), which depends on
+    // nothing but main.cpp
+    if (outOfDate("main.moc", {"main.cpp"})) {
+        printf("Generating Meta-Object file...\n");
+        int moc_result = system("moc main.cpp -o main.moc");
+        
+        if (moc_result != 0) {
+            printf("Failed to generate Meta-Object file. Make sure Qt5 development tools are installed.\n");
+            printf("Try running: sudo pacman -S qt5-base qt5-tools\n");
+            return 1;
+        }
+    }
     
-    if (moc_result != 0) {
-        printf("Failed to generate Meta-Object file. Make sure Qt5 development tools are installed.\n");
-        printf("Try running: sudo pacman -S qt5-base qt5-tools\n");
-        return 1;
+    // Precompile the Qt headers. A header g++ cannot use (after a Qt or
+    // compiler upgrade, say) is parsed as usual, so a stale one only costs
+    // time. The optimized modes compile with flags of their own, which
+    // the header does not match.
+    if (outOfDate("pch.h.gch", {"pch.h", "build.cpp"})) {
+        std::string pchCmd = std::string("/usr/bin/g++ ") + kCxxFlags + " -x c++-header pch.h -o pch.h.gch " + kQtCflags;
+        printf("Running: %s\n", pchCmd.c_str());
+        
+        if (system(pchCmd.c_str()) != 0) {
+            printf("Precompiling the Qt headers failed, building without them\n");
+            remove("pch.h.gch");
+        }
     }
     
-    // Build the terminal emulator with PTY support
-    const char* cmd = "/usr/bin/g++ -std=c++11 -o korzeterm main.cpp $(pkg-config --cflags --libs Qt5Widgets Qt5Core Qt5Gui) -lutil -Wall -Wextra";
-    printf("Running: %s\n", cmd);
+    // Build the terminal emulator with PTY support. IncludeBuild tracks
+    // the headers main.cpp was built from and only relinks what changed.
+    ib_config config;
+    memset(&config, 0, sizeof(config));
+    strcpy(config.source_dir, ".");
+    strcpy(config.build_dir, ".");
+    strcpy(config.obj_dir, "buildobjects");
+    strcpy(config.compiler, "/usr/bin/g++");
+    snprintf(config.compiler_flags, sizeof(config.compiler_flags), "%s%s -include pch.h %s",
+             kCxxFlags, mode == IB_BUILD_DEFAULT ? " -Winvalid-pch" : "", kQtCflags);
+    snprintf(config.linker_flags, sizeof(config.linker_flags), "%s -lutil", kQtLibs);
+    strcpy(config.include_dirs[0], ".");
+    config.num_include_dirs = 1;
+    config.color_output = true;
+    config.log_level = IB_LOG_INFO;
+    config.build_mode = mode;
+    strcpy(config.pgo_training, kTrainingCommand);
+    ib_init_with_config(&config);
     
-    int result = system(cmd);
+    ib_exclude_file("build.cpp");
+    ib_exclude_file("bench.cpp");
+    ib_add_target("korzeterm", NULL);
+    int result = ib_build() ? 0 : 1;
     
     if (result == 0) {
         printf("Build successful!\n");
@@ -36,4 +143,4 @@ int main() {
     }
     
     return result;
-} 
\ No newline at end of file
+}
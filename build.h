@@ -44,6 +44,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <time.h>
 #include <sys/stat.h>
@@ -58,8 +59,21 @@
 #define pclose _pclose
 #define mkdir(path, mode) _mkdir(path)
 #else
+#include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <utime.h>
 #define PATH_SEPARATOR '/'
+// wait4() reports a child's peak memory, but strict ISO modes hide it
+#if !defined(__STRICT_ANSI__) || defined(_DEFAULT_SOURCE) || defined(_BSD_SOURCE) || defined(_GNU_SOURCE)
+#include <sys/resource.h>
+#define IB_HAVE_WAIT4
+#endif
+// Whether readdir() reports file types (d_type)
+#ifdef DT_REG
+#define IB_HAVE_D_TYPE
+#endif
 #endif
 
 // Version information
@@ -76,22 +90,10 @@
 #define IB_MAX_CMD 4096
 #endif
 
-#ifndef IB_MAX_FILES
-#define IB_MAX_FILES 1000
-#endif
-
-#ifndef IB_MAX_DEPS
-#define IB_MAX_DEPS 100
-#endif
-
 #ifndef IB_MAX_INCLUDE_DIRS
 #define IB_MAX_INCLUDE_DIRS 50
 #endif
 
-#ifndef IB_MAX_TARGETS
-#define IB_MAX_TARGETS 50
-#endif
-
 #ifndef IB_MAX_LIBRARIES
 #define IB_MAX_LIBRARIES 50
 #endif
@@ -100,6 +102,24 @@
 #define IB_MAX_LIBRARY_PATHS 50
 #endif
 
+// Dependency database kept in the object directory: every source path on a
+// line of its own, then a line with the hash of the flags its object was
+// compiled with, then the files it was built from, each on a line starting
+// with a tab
+#define IB_DEP_DB_NAME ".ib_deps"
+#define IB_DEP_DB_HEADER "# IncludeBuild dependencies v2"
+
+// Flags the targets were last linked with; when they change, every target
+// is relinked
+#define IB_FLAGS_NAME ".ib_flags"
+
+// Written to the profile directory once a training run has succeeded
+#define IB_PGO_TRAINED_NAME ".ib_trained"
+
+// Part of every compile cache key; change it to invalidate old entries
+#define IB_CACHE_VERSION "IncludeBuild cache v1"
+#define IB_CACHE_KEY_LEN 32
+
 // Whether to run the executable after building
 static bool g_run_after_build = false;
 static char g_executable_name[IB_MAX_PATH] = {0};
@@ -112,26 +132,51 @@ typedef enum {
     IB_LOG_DEBUG = 3
 } ib_log_level;
 
+// Optimization added to the compiler flags
+typedef enum {
+    IB_BUILD_DEFAULT = 0,               // The compiler flags as they are
+    IB_BUILD_RELEASE = 1,               // Optimized, assertions off
+    IB_BUILD_LTO = 2,                   // Release, optimized across objects when linking
+    IB_BUILD_PGO = 3                    // LTO, laid out by the profile of a training run
+} ib_build_mode;
+
+// Which build of IB_BUILD_PGO is running
+typedef enum {
+    IB_PGO_OFF = 0,
+    IB_PGO_GENERATE = 1,                // Instrumented, to record the profile
+    IB_PGO_USE = 2                      // Optimized with the profile
+} ib_pgo_stage;
+
 // Forward declarations
 typedef struct ib_file ib_file;
+typedef struct ib_dep ib_dep;
 typedef struct ib_target ib_target;
 typedef struct ib_config ib_config;
 
 struct ib_file {
-    char path[IB_MAX_PATH];             // Path to file
-    char obj_path[IB_MAX_PATH];         // Path to output object file
+    const char* path;                   // Path to file
+    const char* obj_path;               // Path to output object file
     time_t last_modified;               // Last modified timestamp
     int num_deps;                       // Number of dependencies
-    ib_file* deps[IB_MAX_DEPS];         // Dependencies
+    int deps_capacity;                  // Allocated length of deps
+    ib_dep** deps;                      // Files the object was built from, besides the source
+    bool deps_known;                    // Whether deps was recorded by a compile
+    uint64_t flags_hash;                // Hash of the flags the object was compiled with, 0 if unknown
     bool needs_rebuild;                 // Whether file needs rebuilding
 };
 
+// A file objects depend on, usually a header. Each path has one ib_dep,
+// shared by every object that includes it.
+struct ib_dep {
+    const char* path;
+    bool stat_done;                     // Whether mtime is current for this build
+    time_t mtime;                       // Last modified timestamp, 0 if missing
+};
+
 struct ib_target {
-    char name[IB_MAX_PATH];             // Target name
-    char output_path[IB_MAX_PATH];      // Output path
-    char main_source[IB_MAX_PATH];      // Main source file
-    int num_files;                      // Number of files in this target
-    ib_file* files[IB_MAX_FILES];       // Files that make up this target
+    const char* name;                   // Target name
+    const char* output_path;            // Output path
+    const char* main_source;            // Main source file, "" for none
     bool is_library;                    // Whether this is a library
 };
 
@@ -144,8 +189,9 @@ struct ib_config {
     char linker_flags[IB_MAX_CMD];      // Linker flags
     char include_dirs[IB_MAX_INCLUDE_DIRS][IB_MAX_PATH]; // Include directories
     int num_include_dirs;               // Number of include directories
-    char exclude_files[IB_MAX_FILES][IB_MAX_PATH]; // Files to exclude from build
+    char** exclude_files;               // Files to exclude from build, each malloc()ed
     int num_exclude_files;              // Number of excluded files
+    int exclude_files_capacity;         // Allocated length of exclude_files
     char libraries[IB_MAX_LIBRARIES][64];  // Libraries to link with
     int num_libraries;                  // Number of libraries
     char library_paths[IB_MAX_LIBRARY_PATHS][IB_MAX_PATH]; // Library paths
@@ -153,16 +199,85 @@ struct ib_config {
     bool verbose;                       // Verbose output
     bool color_output;                  // Colorize output
     ib_log_level log_level;             // Current logging level
+    int jobs;                           // Maximum compiler processes running at once
+    char cache_dir[IB_MAX_PATH];        // Compile cache shared between builds, empty for none
+    int profile_slowest;                // Slowest jobs listed after a build, 0 for no profile
+    char trace_path[IB_MAX_PATH];       // Chrome trace_event JSON written after a build, empty for none
+    ib_build_mode build_mode;           // Optimization added to compiler_flags
+    char pgo_training[IB_MAX_CMD];      // Command run on the instrumented build of IB_BUILD_PGO
+    char pgo_dir[IB_MAX_PATH];          // Where its profile goes, empty for <obj_dir>/pgo
+};
+
+// One timed step of a build, for the profile and the trace file
+typedef struct {
+    char* name;                         // What ran, malloc()ed
+    const char* category;               // "phase", "preprocess", "compile" or "link"
+    double start_us;                    // Monotonic clock, microseconds
+    double duration_us;
+    long peak_rss_kb;                   // Of the process, 0 for phases or when unknown
+    int lane;                           // 0 for phases, the job slot + 1 for processes
+} ib_trace_event;
+
+// Bump allocator. Everything allocated from an arena lives until the
+// arena is freed, all at once.
+typedef struct ib_arena_block ib_arena_block;
+struct ib_arena_block {
+    ib_arena_block* next;
+    size_t used;
+    size_t size;
 };
 
+typedef struct {
+    ib_arena_block* head;
+} ib_arena;
+
+#define IB_ARENA_BLOCK_SIZE (64 * 1024)
+
+// Growable string, for command lines
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} ib_strbuf;
+
 // Global state
 static ib_config g_config;
-static ib_file g_files[IB_MAX_FILES];
+static ib_arena g_file_arena;           // Files, dependencies and their paths
+static ib_file** g_files = NULL;
 static int g_num_files = 0;
-static ib_target g_targets[IB_MAX_TARGETS];
+static int g_files_capacity = 0;
+static ib_arena g_target_arena;         // Targets and their strings
+static ib_target** g_targets = NULL;
 static int g_num_targets = 0;
+static int g_targets_capacity = 0;
 static bool g_initialized = false;
 
+// Open-addressing hash table from a path to a pointer. Keys are not copied
+// and must outlive their entries.
+typedef struct {
+    const char** keys;
+    void** values;
+    size_t capacity;                    // Zero or a power of two
+    size_t count;
+} ib_path_map;
+
+static ib_path_map g_path_strings;      // Interned path -> itself, in g_file_arena
+static ib_path_map g_file_map;          // Source path -> ib_file
+static ib_path_map g_dep_map;           // Dependency path -> ib_dep
+static ib_dep** g_deps = NULL;          // Every ib_dep
+static int g_num_deps = 0;
+static int g_deps_capacity = 0;
+static bool g_dep_db_dirty = false;     // Dependencies changed since the database was read
+static int g_cache_hits = 0;            // Objects taken from the compile cache this pass
+static int g_cache_misses = 0;
+static ib_trace_event* g_trace_events = NULL;  // Steps of the current build
+static int g_num_trace_events = 0;
+static int g_trace_events_capacity = 0;
+static double g_trace_epoch_us = 0;     // When the current build started
+static ib_pgo_stage g_pgo_stage = IB_PGO_OFF;
+static uint64_t g_compile_flags_hash = 0; // Hash of the flags objects are compiled with now
+static bool g_relink_all = false;       // The link flags have changed since the targets were linked
+
 // ANSI color codes
 #define IB_COLOR_RESET   "\x1b[0m"
 #define IB_COLOR_RED     "\x1b[31m"
@@ -183,11 +298,59 @@ static bool ib_file_exists(const char* path);
 static time_t ib_get_file_mtime(const char* path);
 static void ib_ensure_dir_exists(const char* path);
 static char* ib_join_path(char* dest, const char* path1, const char* path2);
+static void* ib_grow(void* array, int* capacity, size_t elem_size);
+static void* ib_arena_alloc(ib_arena* arena, size_t size);
+static char* ib_arena_strdup(ib_arena* arena, const char* str);
+static void ib_arena_free(ib_arena* arena);
+static void ib_strbuf_appendf(ib_strbuf* buf, const char* fmt, ...);
+static char* ib_format(const char* fmt, ...);
+static const char* ib_intern_path(const char* path);
+static void ib_append_exclude(const char* file);
+static void ib_clear_excludes(void);
+static ib_target* ib_new_target(void);
+static void* ib_map_get(const ib_path_map* map, const char* path);
+static void ib_map_put(ib_path_map* map, const char* path, void* value);
+static void ib_map_clear(ib_path_map* map);
+static ib_dep* ib_intern_dep(const char* path);
+static void ib_add_dep(ib_file* file, ib_dep* dep);
+static bool ib_is_source_file(const char* name);
 static void ib_find_source_files(const char* dir);
+static void ib_load_dependencies(void);
+static void ib_save_dependencies(void);
+#ifdef _WIN32
 static void ib_parse_dependencies(ib_file* file);
+#else
+static void ib_object_sibling_path(const ib_file* file, const char* ext, char* path);
+static void ib_depfile_path(const ib_file* file, char* path);
+static void ib_add_depfile_entry(ib_file* file, const char* path);
+static void ib_read_depfile(ib_file* file);
+static const char* ib_compiler_identity(void);
+#endif
+static time_t ib_dep_mtime(ib_dep* dep);
 static bool ib_needs_rebuild(ib_file* file);
+static ib_file** ib_find_stale_files(int* num_stale);
+static double ib_now_us(void);
+static void ib_trace_begin(void);
+static void ib_trace_add(const char* name, const char* category, double start_us, int lane, long peak_rss_kb);
+static void ib_trace_phase(const char* name, double start_us);
+static void ib_profile_report(void);
+static void ib_include_flags(ib_strbuf* buf);
+static void ib_pgo_dir(char* path);
+static void ib_mode_flags(ib_strbuf* buf);
+static uint64_t ib_compile_flags_hash(void);
+static void ib_check_flags(void);
+static void ib_save_flags(void);
+static ib_file** ib_prepare_pass(int* num_stale);
+static bool ib_build_pass(void);
+static bool ib_build_pgo(void);
+static char* ib_compile_command(ib_file* file);
+#ifdef _WIN32
 static void ib_compile_file(ib_file* file);
-static void ib_link_target(ib_target* target);
+#endif
+static bool ib_compile_files(ib_file** files, int num_files);
+static bool ib_run_compile_jobs(ib_file** files, int num_files);
+static int ib_online_cpus(void);
+static bool ib_link_target(ib_target* target, bool compiled);
 static void ib_add_default_target(void);
 static void ib_reset_targets(void);
 static void ib_reset_files(void);
@@ -205,6 +368,11 @@ void ib_add_library(const char* library);
 void ib_add_libraries(const char* first, ...);
 void ib_add_library_path(const char* path);
 void ib_exclude_file(const char* file);
+void ib_set_jobs(int jobs);
+void ib_set_cache_dir(const char* dir);
+void ib_set_profile(int slowest, const char* trace_path);
+void ib_set_build_mode(ib_build_mode mode);
+void ib_set_pgo_training(const char* command, const char* profile_dir);
 bool ib_build_static_library(const char* name, const char* main_source, const char* exclude_file);
 bool ib_build_dynamic_library(const char* name, const char* main_source, const char* exclude_file);
 const char* ib_version(void);
@@ -257,14 +425,15 @@ bool ib_run_executable(const char* executable_name) {
     
     // Construct the command to run the executable
     // On Unix systems, include the current directory in the library path
-    char cmd[IB_MAX_CMD];
     #ifdef _WIN32
-    snprintf(cmd, IB_MAX_CMD, "%s", executable_name);
+    char* cmd = ib_format("%s", executable_name);
     #else
-    snprintf(cmd, IB_MAX_CMD, "LD_LIBRARY_PATH=\"$(pwd)/lib:$LD_LIBRARY_PATH\" ./%s", executable_name);
+    char* cmd = ib_format("LD_LIBRARY_PATH=\"$(pwd)/lib:$LD_LIBRARY_PATH\" ./%s", executable_name);
     #endif
     
-    return ib_execute_command(cmd);
+    bool success = ib_execute_command(cmd);
+    free(cmd);
+    return success;
 }
 
 /**
@@ -336,9 +505,9 @@ bool ib_build_library(const char* library_name, int argc, char** argv) {
         ib_clean();
         
         // Also clean library files and test programs
-        char cmd[IB_MAX_CMD] = {0};
-        sprintf(cmd, "rm -rf %s run_*.sh test_* %s_test*", lib_dir, library_name);
+        char* cmd = ib_format("rm -rf %s run_*.sh test_* %s_test*", lib_dir, library_name);
         system(cmd);
+        free(cmd);
         
         ib_log_message(IB_LOG_INFO, "All build artifacts removed");
         return true;
@@ -355,7 +524,7 @@ bool ib_build_library(const char* library_name, int argc, char** argv) {
         
         // Make a clean start for the static library
         ib_reset_targets();
-        g_config.num_exclude_files = 0;
+        ib_clear_excludes();
         
         // Automatically exclude test files (assumed to start with "test_")
         ib_exclude_file("test_*.c");
@@ -417,7 +586,7 @@ bool ib_build_library(const char* library_name, int argc, char** argv) {
         
         // Make a clean start for the dynamic library
         ib_reset_targets();
-        g_config.num_exclude_files = 0;
+        ib_clear_excludes();
         
         // Automatically exclude test files (assumed to start with "test_")
         ib_exclude_file("test_*.c");
@@ -540,10 +709,18 @@ bool ib_build_library(const char* library_name, int argc, char** argv) {
     
     // Provide a summary if we built multiple things
     if ((build_static || build_dynamic) && build_test) {
-        // Find which test files we built
-        char test_files[IB_MAX_FILES][IB_MAX_PATH] = {0};
-        int num_test_files = 0;
+        printf("\n=== Build Summary ===\n");
+        
+        if (build_static) {
+            printf("- Static library:  %s/lib%s.a\n", lib_dir, library_name);
+        }
+        
+        if (build_dynamic) {
+            printf("- Dynamic library: %s/lib%s.so\n", lib_dir, library_name);
+        }
         
+        // List the test programs that were built
+        int num_test_files = 0;
         DIR* d = opendir(".");
         if (d) {
             struct dirent* entry;
@@ -556,7 +733,10 @@ bool ib_build_library(const char* library_name, int argc, char** argv) {
                         
                         // Check if the executable exists
                         if (ib_file_exists(test_name)) {
-                            strcpy(test_files[num_test_files++], test_name);
+                            if (num_test_files++ == 0) {
+                                printf("- Test program(s):\n");
+                            }
+                            printf("  * %s (run with: ./run_%s.sh)\n", test_name, test_name);
                         }
                     }
                 }
@@ -564,29 +744,35 @@ bool ib_build_library(const char* library_name, int argc, char** argv) {
             closedir(d);
         }
         
-        printf("\n=== Build Summary ===\n");
-        
-        if (build_static) {
-            printf("- Static library:  %s/lib%s.a\n", lib_dir, library_name);
-        }
-        
-        if (build_dynamic) {
-            printf("- Dynamic library: %s/lib%s.so\n", lib_dir, library_name);
-        }
-        
-        if (num_test_files > 0) {
-            printf("- Test program(s):\n");
-            for (int i = 0; i < num_test_files; i++) {
-                printf("  * %s (run with: ./run_%s.sh)\n", test_files[i], test_files[i]);
-            }
-        }
-        
         printf("\nBuild completed successfully!\n");
     }
     
     return true;
 }
 
+/**
+ * IB_PROFILE, IB_TRACE and IB_CACHE_DIR override the configuration, however
+ * it was set up, so that a CI job can turn them on without editing the
+ * build program
+ */
+static void ib_apply_environment(void) {
+    const char* profile = getenv("IB_PROFILE");
+    if (profile) {
+        g_config.profile_slowest = atoi(profile);
+    }
+    const char* trace_path = getenv("IB_TRACE");
+    if (trace_path && strlen(trace_path) < IB_MAX_PATH) {
+        strcpy(g_config.trace_path, trace_path);
+    }
+    
+#ifndef _WIN32
+    const char* cache_dir = getenv("IB_CACHE_DIR");
+    if (cache_dir && strlen(cache_dir) < IB_MAX_PATH) {
+        strcpy(g_config.cache_dir, cache_dir);
+    }
+#endif
+}
+
 /**
  * Initialize IncludeBuild with default configuration
  */
@@ -614,6 +800,10 @@ void ib_init(void) {
     g_config.color_output = true;
     g_config.num_exclude_files = 0;
     g_config.log_level = IB_LOG_INFO;
+    g_config.jobs = ib_online_cpus();
+    
+    // Profiling and the compile cache are off unless asked for
+    ib_apply_environment();
     
     // Add current directory to include dirs
     strcpy(g_config.include_dirs[0], ".");
@@ -634,8 +824,19 @@ void ib_init_with_config(const ib_config* config) {
         return;
     }
     
-    // Copy config
+    // Copy config; the exclude list is copied too, so that it is ours to
+    // grow and free
     memcpy(&g_config, config, sizeof(ib_config));
+    if (g_config.jobs <= 0) {
+        g_config.jobs = ib_online_cpus();
+    }
+    g_config.exclude_files = NULL;
+    g_config.num_exclude_files = 0;
+    g_config.exclude_files_capacity = 0;
+    for (int i = 0; i < config->num_exclude_files; i++) {
+        ib_append_exclude(config->exclude_files[i]);
+    }
+    ib_apply_environment();
     
     g_initialized = true;
     
@@ -675,12 +876,7 @@ void ib_add_include_dir(const char* dir) {
  * Add a build target
  */
 void ib_add_target(const char* name, const char* main_source) {
-    if (g_num_targets >= IB_MAX_TARGETS) {
-        ib_error("Too many targets (max: %d)", IB_MAX_TARGETS);
-        return;
-    }
-    
-    ib_target* target = &g_targets[g_num_targets++];
+    ib_target* target = ib_new_target();
     
     // Use source filename as target name if provided
     if (main_source && strlen(main_source) > 0) {
@@ -693,24 +889,26 @@ void ib_add_target(const char* name, const char* main_source) {
         }
         
         // Copy and remove extension
-        strcpy(target->name, filename);
-        char* dot = strrchr(target->name, '.');
+        char* target_name = ib_arena_strdup(&g_target_arena, filename);
+        char* dot = strrchr(target_name, '.');
         if (dot) {
             *dot = '\0';
         }
+        target->name = target_name;
     } else {
-        strcpy(target->name, name);
+        target->name = ib_arena_strdup(&g_target_arena, name);
     }
     
     // Set output path
-    ib_join_path(target->output_path, g_config.build_dir, target->name);
+    char output_path[IB_MAX_PATH];
+    ib_join_path(output_path, g_config.build_dir, target->name);
     
     #ifdef _WIN32
-    strcat(target->output_path, ".exe");
+    strcat(output_path, ".exe");
     #endif
     
-    strcpy(target->main_source, main_source);
-    target->num_files = 0;
+    target->output_path = ib_arena_strdup(&g_target_arena, output_path);
+    target->main_source = ib_arena_strdup(&g_target_arena, main_source ? main_source : "");
     target->is_library = false;
 }
 
@@ -724,6 +922,7 @@ bool ib_build(void) {
     }
     
     ib_log_message(IB_LOG_INFO, "Building project...");
+    ib_trace_begin();
     
     // Create build directory if it doesn't exist
     ib_ensure_dir_exists(g_config.build_dir);
@@ -731,51 +930,183 @@ bool ib_build(void) {
     // Create object files directory if it doesn't exist
     ib_ensure_dir_exists(g_config.obj_dir);
     
+    bool success = g_config.build_mode == IB_BUILD_PGO ? ib_build_pgo() : ib_build_pass();
+    ib_profile_report();
+    if (!success) {
+        return false;
+    }
+    
+    // Run the executable if requested
+    if (g_run_after_build) {
+        const char* executable = g_executable_name;
+        
+        // If no specific executable was specified, use the first target
+        if (executable[0] == '\0' && g_num_targets > 0) {
+            executable = g_targets[0]->name;
+        }
+        
+        if (executable && executable[0] != '\0') {
+            ib_log_message(IB_LOG_INFO, "Running executable after build: %s", executable);
+            ib_run_executable(executable);
+        }
+    }
+    
+    return true;
+}
+
+/**
+ * Find the sources, what their objects were built from and which of them
+ * need rebuilding
+ * @return The stale files, a malloc()ed array for the caller to free
+ */
+static ib_file** ib_prepare_pass(int* num_stale) {
     // Find all source files
+    double phase_start = ib_now_us();
     ib_find_source_files(g_config.source_dir);
+    ib_trace_phase("scan", phase_start);
     
     // If no targets defined, create a default one
     if (g_num_targets == 0) {
         ib_add_default_target();
     }
     
-    // Parse dependencies for all files
-    for (int i = 0; i < g_num_files; i++) {
-        ib_parse_dependencies(&g_files[i]);
-    }
+    // Find out what each object was built from
+    phase_start = ib_now_us();
+    ib_load_dependencies();
+    ib_trace_phase("dependencies", phase_start);
     
-    // Compile all files that need rebuilding
+    phase_start = ib_now_us();
+    ib_check_flags();
+    ib_file** stale = ib_find_stale_files(num_stale);
+    ib_trace_phase("staleness", phase_start);
+    return stale;
+}
+
+/**
+ * Compile what needs rebuilding and link every target
+ */
+static bool ib_build_pass(void) {
     int num_compiled = 0;
-    for (int i = 0; i < g_num_files; i++) {
-        if (ib_needs_rebuild(&g_files[i])) {
-            ib_compile_file(&g_files[i]);
-            num_compiled++;
-        }
+    ib_file** stale = ib_prepare_pass(&num_compiled);
+    
+    double phase_start = ib_now_us();
+    bool compiled = ib_compile_files(stale, num_compiled);
+    free(stale);
+    ib_trace_phase("compile", phase_start);
+    
+    // Linking needs every object, so a failed compile stops the build here
+    if (!compiled) {
+        ib_error("Build failed, not linking");
+        return false;
     }
     
     // Link all targets
+    phase_start = ib_now_us();
+    bool linked = true;
     for (int i = 0; i < g_num_targets; i++) {
-        ib_link_target(&g_targets[i]);
+        linked = ib_link_target(g_targets[i], num_compiled > 0) && linked;
     }
+    ib_trace_phase("link", phase_start);
+    if (!linked) {
+        ib_error("Build failed, not every target was linked");
+        return false;
+    }
+    ib_save_flags();
     
-    ib_log_message(IB_LOG_INFO, "Build complete. Compiled %d files.", num_compiled);
+    ib_log_message(IB_LOG_INFO, "Build complete. Compiled %d files.", num_compiled - g_cache_hits);
+    return true;
+}
+
+#ifndef _WIN32
+/**
+ * Remove the profile of an earlier training run
+ */
+static void ib_remove_profile(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return;
+    }
     
-    // Run the executable if requested
-    if (g_run_after_build) {
-        const char* executable = g_executable_name;
-        
-        // If no specific executable was specified, use the first target
-        if (executable[0] == '\0' && g_num_targets > 0) {
-            executable = g_targets[0].name;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char* ext = strrchr(entry->d_name, '.');
+        if (strcmp(entry->d_name, IB_PGO_TRAINED_NAME) == 0 || (ext && (strcmp(ext, ".gcda") == 0 ||
+            strcmp(ext, ".profraw") == 0 || strcmp(ext, ".profdata") == 0))) {
+            char path[IB_MAX_PATH];
+            ib_join_path(path, dir, entry->d_name);
+            remove(path);
+        }
+    }
+    closedir(d);
+}
+#endif
+
+/**
+ * Build with profile-guided optimization: an instrumented build, a training
+ * run of it, then the optimized build using the profile it recorded. The
+ * profile is kept, so while nothing has changed the optimized build is up
+ * to date without training again.
+ */
+static bool ib_build_pgo(void) {
+    if (!g_config.pgo_training[0]) {
+        ib_error("Profile-guided builds need a training command, see ib_set_pgo_training()");
+        return false;
+    }
+    
+#ifdef _WIN32
+    ib_warning("Profile-guided optimization is not supported with %s, building with LTO only", g_config.compiler);
+    return ib_build_pass();
+#else
+    char dir[IB_MAX_PATH];
+    char trained[IB_MAX_PATH];
+    ib_pgo_dir(dir);
+    ib_join_path(trained, dir, IB_PGO_TRAINED_NAME);
+    
+    g_pgo_stage = IB_PGO_USE;
+    if (ib_file_exists(trained)) {
+        int num_stale = 0;
+        free(ib_prepare_pass(&num_stale));
+        if (num_stale == 0) {
+            bool success = ib_build_pass();
+            g_pgo_stage = IB_PGO_OFF;
+            return success;
         }
+    }
+    
+    ib_log_message(IB_LOG_INFO, "Profile-guided build 1/3: instrumented build");
+    ib_ensure_dir_exists(dir);
+    ib_remove_profile(dir);
+    g_pgo_stage = IB_PGO_GENERATE;
+    bool success = ib_build_pass();
+    
+    if (success) {
+        ib_log_message(IB_LOG_INFO, "Profile-guided build 2/3: training");
+        double phase_start = ib_now_us();
+        success = ib_execute_command(g_config.pgo_training);
         
-        if (executable && executable[0] != '\0') {
-            ib_log_message(IB_LOG_INFO, "Running executable after build: %s", executable);
-            ib_run_executable(executable);
+        // Clang leaves a raw profile per process, to be merged before use
+        if (success && strstr(ib_compiler_identity(), "clang")) {
+            char* cmd = ib_format("llvm-profdata merge -output=\"%s/default.profdata\" \"%s\"/*.profraw", dir, dir);
+            success = ib_execute_command(cmd);
+            free(cmd);
         }
+        ib_trace_phase("training", phase_start);
     }
     
-    return true;
+    if (success) {
+        FILE* fp = fopen(trained, "w");
+        if (fp) {
+            fclose(fp);
+        }
+        
+        ib_log_message(IB_LOG_INFO, "Profile-guided build 3/3: optimized build");
+        g_pgo_stage = IB_PGO_USE;
+        success = ib_build_pass();
+    }
+    
+    g_pgo_stage = IB_PGO_OFF;
+    return success;
+#endif
 }
 
 /**
@@ -805,14 +1136,14 @@ void ib_clean(void) {
             continue;
         }
         
-        // Check file extension
+        // Check file extension; depfiles and the dependency database go too
         const char* ext = strrchr(entry->d_name, '.');
-        bool is_obj = false;
-        if (ext) {
+        bool is_obj = strcmp(entry->d_name, IB_DEP_DB_NAME) == 0 || strcmp(entry->d_name, IB_FLAGS_NAME) == 0;
+        if (ext && !is_obj) {
             #ifdef _WIN32
             is_obj = (strcmp(ext, ".obj") == 0);
             #else
-            is_obj = (strcmp(ext, ".o") == 0);
+            is_obj = (strcmp(ext, ".o") == 0 || strcmp(ext, ".d") == 0);
             #endif
         }
         
@@ -998,6 +1329,256 @@ static char* ib_join_path(char* dest, const char* path1, const char* path2) {
     return dest;
 }
 
+/**
+ * Double the capacity of a malloc()ed array, starting at 16 elements
+ * @return The reallocated array; running out of memory ends the program
+ */
+static void* ib_grow(void* array, int* capacity, size_t elem_size) {
+    int new_capacity = *capacity ? *capacity * 2 : 16;
+    void* grown = realloc(array, (size_t)new_capacity * elem_size);
+    if (!grown) {
+        ib_error("Out of memory");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+// Block headers are padded so that allocations stay 16-byte aligned
+#define IB_ARENA_HEADER ((sizeof(ib_arena_block) + 15) & ~(size_t)15)
+
+/**
+ * Allocate zeroed memory from an arena
+ */
+static void* ib_arena_alloc(ib_arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    
+    ib_arena_block* block = arena->head;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > IB_ARENA_BLOCK_SIZE ? size : IB_ARENA_BLOCK_SIZE;
+        block = (ib_arena_block*)malloc(IB_ARENA_HEADER + block_size);
+        if (!block) {
+            ib_error("Out of memory");
+            exit(1);
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+    }
+    
+    void* ptr = (char*)block + IB_ARENA_HEADER + block->used;
+    block->used += size;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+/**
+ * Copy a string into an arena
+ */
+static char* ib_arena_strdup(ib_arena* arena, const char* str) {
+    size_t len = strlen(str);
+    char* copy = (char*)ib_arena_alloc(arena, len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+/**
+ * Free everything allocated from an arena
+ */
+static void ib_arena_free(ib_arena* arena) {
+    while (arena->head) {
+        ib_arena_block* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+/**
+ * Append printf-style formatted text to a string buffer
+ */
+static void ib_strbuf_vappendf(ib_strbuf* buf, const char* fmt, va_list args) {
+    va_list measure;
+    va_copy(measure, args);
+    int len = vsnprintf(NULL, 0, fmt, measure);
+    va_end(measure);
+    if (len < 0) {
+        return;
+    }
+    
+    if (buf->len + len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + len + 1) {
+            cap *= 2;
+        }
+        char* data = (char*)realloc(buf->data, cap);
+        if (!data) {
+            ib_error("Out of memory");
+            exit(1);
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    
+    vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+    buf->len += len;
+}
+
+static void ib_strbuf_appendf(ib_strbuf* buf, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    ib_strbuf_vappendf(buf, fmt, args);
+    va_end(args);
+}
+
+/**
+ * printf into a new string
+ * @return A malloc()ed string for the caller to free
+ */
+static char* ib_format(const char* fmt, ...) {
+    ib_strbuf buf = {NULL, 0, 0};
+    va_list args;
+    va_start(args, fmt);
+    ib_strbuf_vappendf(&buf, fmt, args);
+    va_end(args);
+    
+    // Only a format error leaves it without a string
+    if (!buf.data && !(buf.data = (char*)calloc(1, 1))) {
+        ib_error("Out of memory");
+        exit(1);
+    }
+    return buf.data;
+}
+
+/**
+ * Hash a path (FNV-1a)
+ */
+static uint64_t ib_hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Look a path up in a map
+ * @return The value stored for it, or NULL
+ */
+static void* ib_map_get(const ib_path_map* map, const char* path) {
+    if (map->capacity == 0) {
+        return NULL;
+    }
+    
+    size_t mask = map->capacity - 1;
+    for (size_t i = ib_hash_path(path) & mask; map->keys[i]; i = (i + 1) & mask) {
+        if (strcmp(map->keys[i], path) == 0) {
+            return map->values[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Store a value for a path, replacing any stored before
+ */
+static void ib_map_put(ib_path_map* map, const char* path, void* value) {
+    // Keep the table at most half full
+    if ((map->count + 1) * 2 > map->capacity) {
+        ib_path_map grown;
+        grown.capacity = map->capacity ? map->capacity * 2 : 64;
+        grown.count = 0;
+        grown.keys = (const char**)calloc(grown.capacity, sizeof(const char*));
+        grown.values = (void**)calloc(grown.capacity, sizeof(void*));
+        if (!grown.keys || !grown.values) {
+            ib_error("Out of memory");
+            exit(1);
+        }
+        
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i]) {
+                ib_map_put(&grown, map->keys[i], map->values[i]);
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+    
+    size_t mask = map->capacity - 1;
+    size_t i = ib_hash_path(path) & mask;
+    while (map->keys[i] && strcmp(map->keys[i], path) != 0) {
+        i = (i + 1) & mask;
+    }
+    if (!map->keys[i]) {
+        map->count++;
+    }
+    map->keys[i] = path;
+    map->values[i] = value;
+}
+
+/**
+ * Remove every entry from a map
+ */
+static void ib_map_clear(ib_path_map* map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(*map));
+}
+
+/**
+ * The one copy of a path kept for the build graph; equal paths intern to
+ * the same pointer
+ */
+static const char* ib_intern_path(const char* path) {
+    const char* interned = (const char*)ib_map_get(&g_path_strings, path);
+    if (!interned) {
+        interned = ib_arena_strdup(&g_file_arena, path);
+        ib_map_put(&g_path_strings, interned, (void*)interned);
+    }
+    return interned;
+}
+
+/**
+ * The ib_dep for a path, created on first use
+ */
+static ib_dep* ib_intern_dep(const char* path) {
+    ib_dep* dep = (ib_dep*)ib_map_get(&g_dep_map, path);
+    if (dep) {
+        return dep;
+    }
+    
+    if (g_num_deps == g_deps_capacity) {
+        g_deps = (ib_dep**)ib_grow(g_deps, &g_deps_capacity, sizeof(ib_dep*));
+    }
+    
+    dep = (ib_dep*)ib_arena_alloc(&g_file_arena, sizeof(ib_dep));
+    dep->path = ib_intern_path(path);
+    g_deps[g_num_deps++] = dep;
+    ib_map_put(&g_dep_map, dep->path, dep);
+    return dep;
+}
+
+/**
+ * Record that a file's object depends on dep
+ */
+static void ib_add_dep(ib_file* file, ib_dep* dep) {
+    if (file->num_deps == file->deps_capacity) {
+        file->deps = (ib_dep**)ib_grow(file->deps, &file->deps_capacity, sizeof(ib_dep*));
+    }
+    file->deps[file->num_deps++] = dep;
+}
+
+/**
+ * Whether a file name has a C/C++ source extension
+ */
+static bool ib_is_source_file(const char* name) {
+    const char* ext = strrchr(name, '.');
+    return ext && (strcmp(ext, ".c") == 0 || strcmp(ext, ".cpp") == 0 || 
+                   strcmp(ext, ".cc") == 0 || strcmp(ext, ".cxx") == 0);
+}
+
 /**
  * Find all source files in a directory
  */
@@ -1018,16 +1599,26 @@ static void ib_find_source_files(const char* dir) {
         char path[IB_MAX_PATH];
         ib_join_path(path, dir, entry->d_name);
         
-        struct stat st;
+#ifdef IB_HAVE_D_TYPE
+        // Most entries are neither directories nor sources, and readdir()
+        // usually says which without a stat()
+        if (entry->d_type == DT_REG && !ib_is_source_file(entry->d_name)) {
+            continue;
+        }
+#endif
+        
+        struct stat st;
+#ifdef _WIN32
         if (stat(path, &st) == 0) {
+#else
+        if (fstatat(dirfd(d), entry->d_name, &st, 0) == 0) {
+#endif
             if (S_ISDIR(st.st_mode)) {
                 // Recursively scan subdirectory
                 ib_find_source_files(path);
             } else if (S_ISREG(st.st_mode)) {
                 // Check if it's a C/C++ source file
-                const char* ext = strrchr(entry->d_name, '.');
-                if (ext && (strcmp(ext, ".c") == 0 || strcmp(ext, ".cpp") == 0 || 
-                           strcmp(ext, ".cc") == 0 || strcmp(ext, ".cxx") == 0)) {
+                if (ib_is_source_file(entry->d_name)) {
                     
                     // Auto-exclude common build script files
                     if (strcmp(entry->d_name, "build.c") == 0 ||
@@ -1058,14 +1649,20 @@ static void ib_find_source_files(const char* dir) {
                         continue;
                     }
                     
-                    if (g_num_files >= IB_MAX_FILES) {
-                        ib_error("Too many source files (max: %d)", IB_MAX_FILES);
-                        break;
+                    // Already found by an earlier scan
+                    ib_file* known = (ib_file*)ib_map_get(&g_file_map, path);
+                    if (known) {
+                        known->last_modified = st.st_mtime;
+                        continue;
                     }
                     
                     // Add file to the list
-                    ib_file* file = &g_files[g_num_files++];
-                    strcpy(file->path, path);
+                    if (g_num_files == g_files_capacity) {
+                        g_files = (ib_file**)ib_grow(g_files, &g_files_capacity, sizeof(ib_file*));
+                    }
+                    ib_file* file = (ib_file*)ib_arena_alloc(&g_file_arena, sizeof(ib_file));
+                    g_files[g_num_files++] = file;
+                    file->path = ib_intern_path(path);
                     
                     // Set object file path
                     char rel_path[IB_MAX_PATH];
@@ -1096,11 +1693,16 @@ static void ib_find_source_files(const char* dir) {
                         }
                     }
                     
-                    ib_join_path(file->obj_path, g_config.obj_dir, obj_name);
+                    char obj_path[IB_MAX_PATH];
+                    ib_join_path(obj_path, g_config.obj_dir, obj_name);
+                    file->obj_path = ib_intern_path(obj_path);
                     
                     file->last_modified = st.st_mtime;
                     file->num_deps = 0;
+                    file->deps_known = false;
+                    file->flags_hash = 0;
                     file->needs_rebuild = true;
+                    ib_map_put(&g_file_map, file->path, file);
                     
                     if (g_config.verbose) {
                         ib_log_message(IB_LOG_INFO, "Found source file: %s", file->path);
@@ -1110,232 +1712,1596 @@ static void ib_find_source_files(const char* dir) {
         }
     }
     
-    closedir(d);
+    closedir(d);
+}
+
+/**
+ * Find out what each object was built from, and with which flags: the
+ * database written by earlier builds, and where the compiler does not
+ * report dependencies a scan of the includes instead
+ */
+static void ib_load_dependencies(void) {
+#ifdef _WIN32
+    for (int i = 0; i < g_num_files; i++) {
+        ib_parse_dependencies(g_files[i]);
+    }
+#endif
+    char db_path[IB_MAX_PATH];
+    ib_join_path(db_path, g_config.obj_dir, IB_DEP_DB_NAME);
+    
+    // Without it every object is rebuilt, which records its dependencies
+    FILE* fp = fopen(db_path, "r");
+    if (!fp) {
+        return;
+    }
+    
+    char line[IB_MAX_PATH + 2];
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, IB_DEP_DB_HEADER, strlen(IB_DEP_DB_HEADER)) != 0) {
+        ib_warning("Ignoring dependency database of another version: %s", db_path);
+        fclose(fp);
+        return;
+    }
+    
+    ib_file* file = NULL;
+    bool flags_next = false;
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        
+        if (flags_next) {
+            if (file) {
+                file->flags_hash = (uint64_t)strtoull(line, NULL, 16);
+            }
+            flags_next = false;
+        } else if (line[0] == '\t') {
+#ifndef _WIN32
+            if (file) {
+                ib_add_dep(file, ib_intern_dep(line + 1));
+            }
+#endif
+        } else {
+            // Records of sources no longer in the build are dropped
+            file = (ib_file*)ib_map_get(&g_file_map, line);
+#ifndef _WIN32
+            if (file) {
+                file->num_deps = 0;
+                file->deps_known = true;
+            }
+#endif
+            flags_next = true;
+        }
+    }
+    
+    fclose(fp);
+}
+
+/**
+ * Write the dependency database back if a compile has changed it
+ */
+static void ib_save_dependencies(void) {
+    if (!g_dep_db_dirty) {
+        return;
+    }
+    
+    char db_path[IB_MAX_PATH];
+    char tmp_path[IB_MAX_PATH + 8];
+    ib_join_path(db_path, g_config.obj_dir, IB_DEP_DB_NAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", db_path);
+    
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        ib_warning("Could not write dependency database: %s (%s)", tmp_path, strerror(errno));
+        return;
+    }
+    
+    fprintf(fp, "%s\n", IB_DEP_DB_HEADER);
+    for (int i = 0; i < g_num_files; i++) {
+        ib_file* file = g_files[i];
+        if (!file->deps_known) {
+            continue;
+        }
+        fprintf(fp, "%s\n%016llx\n", file->path, (unsigned long long)file->flags_hash);
+        for (int j = 0; j < file->num_deps; j++) {
+            fprintf(fp, "\t%s\n", file->deps[j]->path);
+        }
+    }
+    
+    // Replace the old database in one step, so it is never seen half written
+    if (fclose(fp) != 0 || rename(tmp_path, db_path) != 0) {
+        ib_warning("Could not write dependency database: %s (%s)", db_path, strerror(errno));
+        remove(tmp_path);
+        return;
+    }
+    g_dep_db_dirty = false;
+}
+
+#ifdef _WIN32
+/**
+ * Scan a source for #include "..." of files in the include directories
+ */
+static void ib_parse_dependencies(ib_file* file) {
+    // Open the file
+    FILE* fp = fopen(file->path, "r");
+    if (!fp) {
+        ib_error("Failed to open file: %s", file->path);
+        return;
+    }
+    
+    file->num_deps = 0;
+    
+    // Buffer for reading lines
+    char line[IB_MAX_PATH];
+    
+    // Check each line for includes
+    while (fgets(line, sizeof(line), fp)) {
+        // Look for #include "..."
+        char* include_start = strstr(line, "#include \"");
+        if (include_start) {
+            include_start += 10; // Skip "#include \""
+            char* include_end = strchr(include_start, '"');
+            if (include_end) {
+                *include_end = '\0';
+                
+                // Search for the included file in include dirs
+                for (int i = 0; i < g_config.num_include_dirs; i++) {
+                    char include_path[IB_MAX_PATH];
+                    ib_join_path(include_path, g_config.include_dirs[i], include_start);
+                    
+                    // Check if this file exists
+                    if (ib_file_exists(include_path)) {
+                        // Add as dependency if not already added
+                        ib_dep* dep = ib_intern_dep(include_path);
+                        bool already_dep = false;
+                        for (int k = 0; k < file->num_deps; k++) {
+                            if (file->deps[k] == dep) {
+                                already_dep = true;
+                                break;
+                            }
+                        }
+                        
+                        if (!already_dep) {
+                            ib_add_dep(file, dep);
+                            if (g_config.verbose) {
+                                ib_log_message(IB_LOG_INFO, "  Dependency: %s -> %s", file->path, include_path);
+                            }
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    
+    fclose(fp);
+    file->deps_known = true;
+}
+#else
+/**
+ * Path next to a file's object with the extension replaced
+ * @param path Buffer of IB_MAX_PATH bytes
+ */
+static void ib_object_sibling_path(const ib_file* file, const char* ext, char* path) {
+    strcpy(path, file->obj_path);
+    char* dot = strrchr(path, '.');
+    char* sep = strrchr(path, PATH_SEPARATOR);
+    if (dot && (!sep || dot > sep)) {
+        *dot = '\0';
+    }
+    strcat(path, ext);
+}
+
+/**
+ * Path of the depfile the compiler writes next to a file's object
+ * @param path Buffer of IB_MAX_PATH bytes
+ */
+static void ib_depfile_path(const ib_file* file, char* path) {
+    ib_object_sibling_path(file, ".d", path);
+}
+
+/**
+ * Record a prerequisite from a depfile, other than the source itself (which
+ * the compiler may spell without a leading "./")
+ */
+static void ib_add_depfile_entry(ib_file* file, const char* path) {
+    const char* source = file->path;
+    while (source[0] == '.' && source[1] == PATH_SEPARATOR) {
+        source += 2;
+    }
+    while (path[0] == '.' && path[1] == PATH_SEPARATOR) {
+        path += 2;
+    }
+    if (strcmp(path, source) != 0) {
+        ib_add_dep(file, ib_intern_dep(path));
+    }
+}
+
+/**
+ * Take the dependencies of a freshly compiled file from the depfile the
+ * compiler wrote (a make rule, "obj: source header..."), then remove it;
+ * they live on in the dependency database
+ */
+static void ib_read_depfile(ib_file* file) {
+    char dep_path[IB_MAX_PATH];
+    ib_depfile_path(file, dep_path);
+    
+    file->num_deps = 0;
+    file->deps_known = false;
+    g_dep_db_dirty = true;
+    
+    FILE* fp = fopen(dep_path, "r");
+    if (!fp) {
+        ib_warning("No dependency file for %s, it will be rebuilt next time", file->path);
+        return;
+    }
+    
+    char token[IB_MAX_PATH];
+    size_t len = 0;
+    bool in_target = true;
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        if (c == '\\') {
+            // Escaped space or '#', or a line continuation
+            int next = fgetc(fp);
+            if (next == ' ' || next == '#') {
+                if (len < sizeof(token) - 1) {
+                    token[len++] = (char)next;
+                }
+                continue;
+            }
+            if (next == '\n' || next == '\r') {
+                if (next == '\r' && (next = fgetc(fp)) != '\n') {
+                    ungetc(next, fp);
+                }
+                c = ' ';
+            } else {
+                ungetc(next, fp);
+            }
+        } else if (c == '$') {
+            int next = fgetc(fp);
+            if (next != '$') {
+                ungetc(next, fp);
+            }
+        }
+        
+        if (in_target && c == ':') {
+            in_target = false;
+            len = 0;
+            continue;
+        }
+        
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (len > 0 && !in_target) {
+                token[len] = '\0';
+                ib_add_depfile_entry(file, token);
+            }
+            len = 0;
+            
+            // Only the first rule lists the object's prerequisites
+            if (c == '\n' && !in_target) {
+                break;
+            }
+            continue;
+        }
+        
+        if (len < sizeof(token) - 1) {
+            token[len++] = (char)c;
+        }
+    }
+    if (len > 0 && !in_target) {
+        token[len] = '\0';
+        ib_add_depfile_entry(file, token);
+    }
+    
+    fclose(fp);
+    remove(dep_path);
+    file->deps_known = !in_target;
+}
+#endif
+
+/**
+ * Last modified time of a dependency, 0 if it is missing. Each path is
+ * stat()ed once per build, however many objects include it.
+ */
+static time_t ib_dep_mtime(ib_dep* dep) {
+    if (!dep->stat_done) {
+        dep->mtime = ib_get_file_mtime(dep->path);
+        dep->stat_done = true;
+    }
+    return dep->mtime;
+}
+
+/**
+ * Check if a file needs to be rebuilt
+ */
+static bool ib_needs_rebuild(ib_file* file) {
+    // If object file doesn't exist, rebuild
+    time_t obj_mtime = ib_get_file_mtime(file->obj_path);
+    if (obj_mtime == 0) {
+        return true;
+    }
+    
+    // If source file is newer than object file, rebuild
+    if (file->last_modified > obj_mtime) {
+        return true;
+    }
+    
+    // Nor can an object be trusted without a record of what it was built
+    // from, or one built with other flags
+    if (!file->deps_known || file->flags_hash != g_compile_flags_hash) {
+        return true;
+    }
+    
+    // Check if any dependencies are newer, or gone. The recorded list is
+    // already everything the object was built from, nested includes too, so
+    // there is nothing to recurse into.
+    for (int i = 0; i < file->num_deps; i++) {
+        time_t dep_mtime = ib_dep_mtime(file->deps[i]);
+        if (dep_mtime == 0 || dep_mtime > obj_mtime) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/**
+ * Decide which files need compiling, statting every object and dependency
+ * once with fresh results
+ * @param num_stale Receives the number of files to compile
+ * @return The files to compile, a malloc()ed array for the caller to free
+ */
+static ib_file** ib_find_stale_files(int* num_stale) {
+    g_compile_flags_hash = ib_compile_flags_hash();
+    for (int i = 0; i < g_num_deps; i++) {
+        g_deps[i]->stat_done = false;
+    }
+    
+    ib_file** stale = (ib_file**)malloc(((size_t)g_num_files + 1) * sizeof(ib_file*));
+    if (!stale) {
+        ib_error("Out of memory");
+        exit(1);
+    }
+    
+    *num_stale = 0;
+    for (int i = 0; i < g_num_files; i++) {
+        if (ib_needs_rebuild(g_files[i])) {
+            stale[(*num_stale)++] = g_files[i];
+        }
+    }
+    return stale;
+}
+
+/**
+ * Append an include flag for every include directory
+ */
+static void ib_include_flags(ib_strbuf* buf) {
+    for (int i = 0; i < g_config.num_include_dirs; i++) {
+#ifdef _WIN32
+        ib_strbuf_appendf(buf, " /I\"%s\"", g_config.include_dirs[i]);
+#else
+        ib_strbuf_appendf(buf, " -I\"%s\"", g_config.include_dirs[i]);
+#endif
+    }
+}
+
+/**
+ * Directory of the profile of IB_BUILD_PGO, made absolute, as the
+ * instrumented program resolves it against wherever it runs
+ * @param path Buffer of IB_MAX_PATH bytes
+ */
+static void ib_pgo_dir(char* path) {
+    char dir[IB_MAX_PATH];
+    if (g_config.pgo_dir[0]) {
+        strcpy(dir, g_config.pgo_dir);
+    } else {
+        ib_join_path(dir, g_config.obj_dir, "pgo");
+    }
+    
+#ifndef _WIN32
+    char cwd[IB_MAX_PATH];
+    if (dir[0] != PATH_SEPARATOR && getcwd(cwd, sizeof(cwd)) && strlen(cwd) + strlen(dir) + 2 <= IB_MAX_PATH) {
+        ib_join_path(path, cwd, dir);
+        return;
+    }
+#endif
+    strcpy(path, dir);
+}
+
+/**
+ * Append the flags of the build mode, as they are for the current build of
+ * a profile-guided one
+ */
+static void ib_mode_flags(ib_strbuf* buf) {
+    ib_build_mode mode = g_config.build_mode;
+    if (mode == IB_BUILD_DEFAULT) {
+        return;
+    }
+    
+#ifdef _WIN32
+    ib_strbuf_appendf(buf, " /O2 /DNDEBUG");
+    if (mode >= IB_BUILD_LTO) {
+        ib_strbuf_appendf(buf, " /GL");
+    }
+#else
+    bool clang = strstr(ib_compiler_identity(), "clang") != NULL;
+    ib_strbuf_appendf(buf, " -O2 -DNDEBUG");
+    
+    // The instrumented build runs once, it is not worth optimizing at link
+    // time
+    if (mode == IB_BUILD_LTO || (mode == IB_BUILD_PGO && g_pgo_stage != IB_PGO_GENERATE)) {
+        ib_strbuf_appendf(buf, clang ? " -flto=thin" : " -flto=auto");
+    }
+    
+    if (mode == IB_BUILD_PGO && g_pgo_stage != IB_PGO_OFF) {
+        char dir[IB_MAX_PATH];
+        ib_pgo_dir(dir);
+        if (g_pgo_stage == IB_PGO_GENERATE) {
+            ib_strbuf_appendf(buf, " -fprofile-generate=\"%s\"", dir);
+        } else if (clang) {
+            ib_strbuf_appendf(buf, " -fprofile-use=\"%s/default.profdata\"", dir);
+        } else {
+            // Sources the training never reached have no profile, which is fine
+            ib_strbuf_appendf(buf, " -fprofile-use=\"%s\" -fprofile-correction -Wno-missing-profile", dir);
+        }
+    }
+#endif
+}
+
+/**
+ * Hash of everything on a compile command line besides the files, recorded
+ * with each object: a changed build mode, stage of a profile-guided build
+ * or include directory rebuilds the objects it applies to, and only those
+ * @return The hash, never 0, which stands for an object of unknown flags
+ */
+static uint64_t ib_compile_flags_hash(void) {
+    ib_strbuf buf = {NULL, 0, 0};
+    ib_strbuf_appendf(&buf, "%s %s", g_config.compiler, g_config.compiler_flags);
+    ib_mode_flags(&buf);
+    ib_include_flags(&buf);
+    uint64_t hash = ib_hash_path(buf.data);
+    free(buf.data);
+    return hash ? hash : 1;
+}
+
+/**
+ * Everything on the link command line besides the files
+ * @return A malloc()ed string for the caller to free
+ */
+static char* ib_link_signature(void) {
+    ib_strbuf buf = {NULL, 0, 0};
+    ib_strbuf_appendf(&buf, "%s %s", g_config.compiler, g_config.compiler_flags);
+    ib_mode_flags(&buf);
+    ib_strbuf_appendf(&buf, " %s", g_config.linker_flags);
+    return buf.data;
+}
+
+/**
+ * Relink every target if the link flags are not the ones they were linked
+ * with; the objects are unaffected
+ */
+static void ib_check_flags(void) {
+    char path[IB_MAX_PATH];
+    ib_join_path(path, g_config.obj_dir, IB_FLAGS_NAME);
+    
+    char* flags = ib_link_signature();
+    size_t len = strlen(flags);
+    char* stored = (char*)malloc(len + 1);
+    if (!stored) {
+        ib_error("Out of memory");
+        exit(1);
+    }
+    
+    g_relink_all = true;
+    FILE* fp = fopen(path, "rb");
+    if (fp) {
+        size_t stored_len = fread(stored, 1, len + 1, fp);
+        g_relink_all = stored_len != len || memcmp(stored, flags, len) != 0;
+        fclose(fp);
+    }
+    if (g_relink_all) {
+        ib_log_message(IB_LOG_DEBUG, "Link flags changed, relinking everything");
+    }
+    
+    free(stored);
+    free(flags);
+}
+
+/**
+ * Record the flags every target has now been linked with
+ */
+static void ib_save_flags(void) {
+    if (!g_relink_all) {
+        return;
+    }
+    
+    char path[IB_MAX_PATH];
+    ib_join_path(path, g_config.obj_dir, IB_FLAGS_NAME);
+    char* flags = ib_link_signature();
+    
+    // Half written, it only costs another relink
+    FILE* fp = fopen(path, "wb");
+    if (!fp || fputs(flags, fp) == EOF || fclose(fp) != 0) {
+        ib_warning("Could not write %s (%s)", path, strerror(errno));
+    }
+    free(flags);
+    g_relink_all = false;
+}
+
+/**
+ * Build the compiler command line for a source file, creating the
+ * directory of its object file on the way
+ * @return A malloc()ed command for the caller to free
+ */
+static char* ib_compile_command(ib_file* file) {
+    // Ensure build directory exists
+    char obj_dir[IB_MAX_PATH] = {0};
+    strcpy(obj_dir, file->obj_path);
+    
+    // Get directory part
+    char* last_sep = strrchr(obj_dir, PATH_SEPARATOR);
+    if (last_sep) {
+        *last_sep = '\0';
+        ib_ensure_dir_exists(obj_dir);
+    }
+    
+    // Build command
+    ib_strbuf cmd = {NULL, 0, 0};
+    ib_strbuf_appendf(&cmd, "%s %s", g_config.compiler, g_config.compiler_flags);
+    ib_mode_flags(&cmd);
+    ib_include_flags(&cmd);
+#ifdef _WIN32
+    ib_strbuf_appendf(&cmd, " -c %s -o %s", file->path, file->obj_path);
+#else
+    // The compiler lists the headers it read in a depfile as it goes
+    char dep_path[IB_MAX_PATH];
+    ib_depfile_path(file, dep_path);
+    ib_strbuf_appendf(&cmd, " -MMD -MF %s -c %s -o %s", dep_path, file->path, file->obj_path);
+    
+    // The old object may be a hard link into the compile cache, which the
+    // compiler must not overwrite in place
+    remove(file->obj_path);
+#endif
+    return cmd.data;
+}
+
+#ifdef _WIN32
+/**
+ * Compile a source file, waiting for the compiler to finish
+ */
+static void ib_compile_file(ib_file* file) {
+    ib_log_message(IB_LOG_INFO, "Compiling %s", file->path);
+    double start_us = ib_now_us();
+    
+    char* cmd = ib_compile_command(file);
+    
+    if (g_config.verbose) {
+        ib_log_message(IB_LOG_INFO, "  Command: %s", cmd);
+    }
+    
+    // Execute the command
+    FILE* proc = popen(cmd, "r");
+    if (!proc) {
+        ib_error("Failed to execute command: %s", cmd);
+        free(cmd);
+        return;
+    }
+    free(cmd);
+    
+    // Read output
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), proc)) {
+        if (g_config.verbose) {
+            printf("%s", buffer);
+        }
+    }
+    
+    // Check result
+    int result = pclose(proc);
+    ib_trace_add(file->path, "compile", start_us, 1, 0);
+    if (result != 0) {
+        ib_error("Compilation failed with code %d", result);
+    } else {
+        file->needs_rebuild = false;
+        file->flags_hash = g_compile_flags_hash;
+        g_dep_db_dirty = true;
+    }
+}
+#else
+// A compiler process started by ib_compile_files(). Its stdout and stderr
+// share one pipe and are collected here, to be printed in one piece when it
+// exits so that the output of concurrent jobs never interleaves.
+// With a compile cache a job first preprocesses its file to compute the
+// cache key, and only compiles it when the cache has no object for that key.
+// Links run through the same machinery, one at a time, for their timing.
+typedef enum {
+    IB_JOB_PREPROCESS,
+    IB_JOB_COMPILE,
+    IB_JOB_LINK
+} ib_job_phase;
+
+typedef struct {
+    pid_t pid;                          // 0 once the job is over
+    int output_fd;                      // Read end of the job's output pipe
+    ib_file* file;                      // NULL for a link
+    const char* name;                   // What is being built, for messages and the profile
+    ib_job_phase phase;
+    int lane;                           // Profile lane, kept when the job is restarted
+    double start_us;
+    char key[IB_CACHE_KEY_LEN + 1];     // Cache key of a compile, empty if it is not to be cached
+    char* output;
+    size_t output_len;
+    size_t output_cap;
+} ib_job;
+
+// 128-bit FNV-1a, for compile cache keys
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} ib_hash128;
+
+static void ib_hash128_init(ib_hash128* hash) {
+    hash->hi = 0x6c62272e07bb0142ULL;
+    hash->lo = 0x62b821756295c58dULL;
+}
+
+static void ib_hash128_update(ib_hash128* hash, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hi = hash->hi;
+    uint64_t lo = hash->lo;
+    for (size_t i = 0; i < len; i++) {
+        lo ^= bytes[i];
+        
+        // Multiply by the prime 2^88 + 0x13B
+        uint64_t carry = ((lo >> 32) * 0x13B + (((lo & 0xFFFFFFFFULL) * 0x13B) >> 32)) >> 32;
+        hi = hi * 0x13B + carry + (lo << 24);
+        lo *= 0x13B;
+    }
+    hash->hi = hi;
+    hash->lo = lo;
+}
+
+/**
+ * Hash a string and its terminator, so consecutive strings cannot run together
+ */
+static void ib_hash128_string(ib_hash128* hash, const char* str) {
+    ib_hash128_update(hash, str, strlen(str) + 1);
+}
+
+/**
+ * Identify the compiler by its --version banner, so that upgrading it
+ * invalidates the cache even when its name stays the same
+ */
+static const char* ib_compiler_identity(void) {
+    static char compiler[sizeof(g_config.compiler)] = "";
+    static char identity[1024] = "";
+    if (strcmp(compiler, g_config.compiler) == 0) {
+        return identity;
+    }
+    strcpy(compiler, g_config.compiler);
+    identity[0] = '\0';
+    
+    char* cmd = ib_format("%s --version 2>/dev/null", g_config.compiler);
+    FILE* proc = popen(cmd, "r");
+    free(cmd);
+    if (proc) {
+        size_t len = fread(identity, 1, sizeof(identity) - 1, proc);
+        identity[len] = '\0';
+        pclose(proc);
+    }
+    return identity;
+}
+
+/**
+ * Path of the cache entry for a key, creating its directory on the way
+ * @param path Buffer of IB_MAX_PATH bytes
+ */
+static void ib_cache_entry_path(const char* key, char* path) {
+    char dir[IB_MAX_PATH];
+    char name[IB_CACHE_KEY_LEN + 3];
+    
+    // Fan out on the first two digits to keep directories small. They are
+    // created quietly; a failure shows when the entry cannot be written.
+    snprintf(name, sizeof(name), "%.2s", key);
+    ib_join_path(dir, g_config.cache_dir, name);
+    mkdir(g_config.cache_dir, 0755);
+    mkdir(dir, 0755);
+    
+    snprintf(name, sizeof(name), "%s.o", key + 2);
+    ib_join_path(path, dir, name);
+}
+
+/**
+ * Copy a file, for when it cannot be hard linked
+ */
+static bool ib_copy_file(const char* from, const char* to) {
+    FILE* in = fopen(from, "rb");
+    if (!in) {
+        return false;
+    }
+    FILE* out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+    
+    char buffer[65536];
+    size_t len;
+    bool ok = true;
+    while ((len = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, len, out) != len) {
+            ok = false;
+            break;
+        }
+    }
+    ok = !ferror(in) && ok;
+    fclose(in);
+    if (fclose(out) != 0 || !ok) {
+        remove(to);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Command line that preprocesses a source into the file next to its object
+ * with the extension .i, writing its depfile as a compile would
+ * @return A malloc()ed command for the caller to free
+ */
+static char* ib_preprocess_command(ib_file* file) {
+    char dep_path[IB_MAX_PATH];
+    char i_path[IB_MAX_PATH];
+    ib_depfile_path(file, dep_path);
+    ib_object_sibling_path(file, ".i", i_path);
+    
+    ib_strbuf cmd = {NULL, 0, 0};
+    ib_strbuf_appendf(&cmd, "%s %s", g_config.compiler, g_config.compiler_flags);
+    ib_mode_flags(&cmd);
+    ib_include_flags(&cmd);
+    ib_strbuf_appendf(&cmd, " -E -MMD -MF %s %s -o %s", dep_path, file->path, i_path);
+    return cmd.data;
+}
+
+/**
+ * Compute the cache key of a preprocessed file: the compiler, its flags and
+ * the preprocessed source, which covers every header the source reads.
+ * The preprocessed file is removed.
+ * @param key Buffer of IB_CACHE_KEY_LEN + 1 bytes
+ * @return false if the preprocessed file could not be read
+ */
+static bool ib_cache_key(ib_file* file, char* key) {
+    char i_path[IB_MAX_PATH];
+    ib_object_sibling_path(file, ".i", i_path);
+    
+    FILE* fp = fopen(i_path, "rb");
+    if (!fp) {
+        ib_warning("Could not read preprocessed %s, compiling it without the cache", file->path);
+        return false;
+    }
+    
+    ib_hash128 hash;
+    ib_hash128_init(&hash);
+    ib_hash128_string(&hash, IB_CACHE_VERSION);
+    ib_hash128_string(&hash, ib_compiler_identity());
+    ib_hash128_string(&hash, g_config.compiler);
+    ib_hash128_string(&hash, g_config.compiler_flags);
+    ib_strbuf mode_flags = {NULL, 0, 0};
+    ib_mode_flags(&mode_flags);
+    ib_hash128_string(&hash, mode_flags.data ? mode_flags.data : "");
+    free(mode_flags.data);
+    for (int i = 0; i < g_config.num_include_dirs; i++) {
+        ib_hash128_string(&hash, g_config.include_dirs[i]);
+    }
+    
+    char buffer[65536];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        ib_hash128_update(&hash, buffer, len);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    remove(i_path);
+    if (!ok) {
+        ib_warning("Could not read preprocessed %s, compiling it without the cache", file->path);
+        return false;
+    }
+    
+    snprintf(key, IB_CACHE_KEY_LEN + 1, "%016llx%016llx", 
+        (unsigned long long)hash.hi, (unsigned long long)hash.lo);
+    return true;
+}
+
+/**
+ * Put the cached object for a key in place of a file's object
+ * @return false if the cache has none
+ */
+static bool ib_cache_fetch(const char* key, ib_file* file) {
+    char entry[IB_MAX_PATH];
+    ib_cache_entry_path(key, entry);
+    if (!ib_file_exists(entry)) {
+        return false;
+    }
+    
+    remove(file->obj_path);
+    if (link(entry, file->obj_path) != 0 && !ib_copy_file(entry, file->obj_path)) {
+        ib_warning("Could not take %s from the compile cache (%s)", file->obj_path, strerror(errno));
+        return false;
+    }
+    
+    // The object is as new as this build, not as old as the cache entry
+    utime(file->obj_path, NULL);
+    return true;
+}
+
+/**
+ * Add a freshly compiled object to the cache
+ */
+static void ib_cache_store(const char* key, const ib_file* file) {
+    char entry[IB_MAX_PATH];
+    char tmp_path[IB_MAX_PATH + 32];
+    ib_cache_entry_path(key, entry);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", entry, (long)getpid());
+    
+    // Entries appear whole, even to builds running at the same time
+    remove(tmp_path);
+    if ((link(file->obj_path, tmp_path) != 0 && !ib_copy_file(file->obj_path, tmp_path)) ||
+        rename(tmp_path, entry) != 0) {
+        ib_warning("Could not add %s to the compile cache (%s)", file->obj_path, strerror(errno));
+        remove(tmp_path);
+    }
+}
+
+/**
+ * Start a command for a file without waiting for it
+ * @return true if the process was started
+ */
+static bool ib_spawn_job(ib_job* job, ib_file* file, const char* name, const char* cmd, ib_job_phase phase) {
+    if (g_config.verbose) {
+        ib_log_message(IB_LOG_INFO, "  Command: %s", cmd);
+    }
+    
+    int fds[2];
+    if (pipe(fds) != 0) {
+        ib_error("Failed to create pipe for %s (%s)", name, strerror(errno));
+        return false;
+    }
+    
+    // Later jobs must not inherit this job's end of the pipe
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    
+    // Nothing buffered may be written twice by the child
+    fflush(stdout);
+    fflush(stderr);
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        ib_error("Failed to start compiler for %s (%s)", name, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    
+    if (pid == 0) {
+        // Child: run the command through the shell as popen() would
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
+    }
+    
+    close(fds[1]);
+    int lane = job->lane;
+    memset(job, 0, sizeof(*job));
+    job->pid = pid;
+    job->output_fd = fds[0];
+    job->file = file;
+    job->name = name;
+    job->phase = phase;
+    job->lane = lane;
+    job->start_us = ib_now_us();
+    return true;
+}
+
+/**
+ * Start on a file: preprocess it for its cache key when there is a compile
+ * cache, otherwise go straight to compiling
+ * @return true if the process was started
+ */
+static bool ib_start_compile_job(ib_job* job, ib_file* file) {
+    char* cmd;
+    ib_job_phase phase;
+    
+    // An object built with a profile depends on the profile as well, which
+    // the cache key does not cover
+    if (g_config.cache_dir[0] && g_pgo_stage == IB_PGO_OFF) {
+        cmd = ib_preprocess_command(file);
+        phase = IB_JOB_PREPROCESS;
+    } else {
+        ib_log_message(IB_LOG_INFO, "Compiling %s", file->path);
+        cmd = ib_compile_command(file);
+        phase = IB_JOB_COMPILE;
+    }
+    
+    bool started = ib_spawn_job(job, file, file->path, cmd, phase);
+    free(cmd);
+    return started;
+}
+
+/**
+ * Collect what a job has written so far
+ * @return false once the job has closed its output
+ */
+static bool ib_read_job_output(ib_job* job) {
+    char buffer[4096];
+    ssize_t bytes_read;
+    while ((bytes_read = read(job->output_fd, buffer, sizeof(buffer))) < 0 && errno == EINTR) {
+    }
+    if (bytes_read <= 0) {
+        return false;
+    }
+    
+    if (job->output_len + bytes_read > job->output_cap) {
+        size_t cap = job->output_cap ? job->output_cap * 2 : sizeof(buffer);
+        while (cap < job->output_len + bytes_read) {
+            cap *= 2;
+        }
+        char* output = (char*)realloc(job->output, cap);
+        if (!output) {
+            return true;                // Keep draining, drop the text
+        }
+        job->output = output;
+        job->output_cap = cap;
+    }
+    memcpy(job->output + job->output_len, buffer, bytes_read);
+    job->output_len += bytes_read;
+    return true;
+}
+
+/**
+ * Wait for a job whose output has closed, record its time and peak memory,
+ * and print what it wrote
+ * @param status Receives the wait status
+ * @return true if the process exited with status 0
+ */
+static bool ib_reap_job(ib_job* job, int* status) {
+    close(job->output_fd);
+    
+    long peak_rss_kb = 0;
+    *status = 0;
+#ifdef IB_HAVE_WAIT4
+    struct rusage usage;
+    while (wait4(job->pid, status, 0, &usage) < 0 && errno == EINTR) {
+    }
+    peak_rss_kb = usage.ru_maxrss;
+#ifdef __APPLE__
+    peak_rss_kb /= 1024;                // Bytes there, kilobytes elsewhere
+#endif
+#else
+    while (waitpid(job->pid, status, 0) < 0 && errno == EINTR) {
+    }
+#endif
+    bool success = WIFEXITED(*status) && WEXITSTATUS(*status) == 0;
+    job->pid = 0;
+    
+    static const char* categories[] = {"preprocess", "compile", "link"};
+    ib_trace_add(job->name, categories[job->phase], job->start_us, job->lane, peak_rss_kb);
+    
+    if (job->output_len > 0) {
+        FILE* out = success ? stdout : stderr;
+        fwrite(job->output, 1, job->output_len, out);
+        fflush(out);
+    }
+    free(job->output);
+    job->output = NULL;
+    return success;
+}
+
+/**
+ * Reap a job whose output has closed and print what it wrote. A preprocess
+ * job either takes its object from the cache or, if may_compile, goes on to
+ * compile it in the same slot, leaving job->pid set.
+ * @return false if the job failed
+ */
+static bool ib_finish_compile_job(ib_job* job, bool may_compile) {
+    int status = 0;
+    bool success = ib_reap_job(job, &status);
+    
+    ib_file* file = job->file;
+    const char* what = job->phase == IB_JOB_PREPROCESS ? "Preprocessing" : "Compilation";
+    if (!success) {
+        if (WIFEXITED(status)) {
+            ib_error("%s of %s failed with code %d", what, file->path, WEXITSTATUS(status));
+        } else {
+            ib_error("%s of %s was killed by signal %d", what, file->path, WTERMSIG(status));
+        }
+        return false;
+    }
+    
+    if (job->phase == IB_JOB_PREPROCESS) {
+        char key[IB_CACHE_KEY_LEN + 1];
+        bool have_key = ib_cache_key(file, key);
+        if (have_key && ib_cache_fetch(key, file)) {
+            ib_log_message(IB_LOG_INFO, "Reused cached object for %s", file->path);
+            g_cache_hits++;
+            file->needs_rebuild = false;
+            file->flags_hash = g_compile_flags_hash;
+            ib_read_depfile(file);
+            return true;
+        }
+        
+        g_cache_misses++;
+        if (!may_compile) {
+            return true;
+        }
+        
+        ib_log_message(IB_LOG_INFO, "Compiling %s", file->path);
+        char* cmd = ib_compile_command(file);
+        bool started = ib_spawn_job(job, file, file->path, cmd, IB_JOB_COMPILE);
+        free(cmd);
+        if (!started) {
+            return false;
+        }
+        strcpy(job->key, have_key ? key : "");
+        return true;
+    }
+    
+    file->needs_rebuild = false;
+    file->flags_hash = g_compile_flags_hash;
+    ib_read_depfile(file);
+    if (job->key[0]) {
+        ib_cache_store(job->key, file);
+    }
+    return true;
+}
+#endif
+
+/**
+ * Compile files concurrently, at most g_config.jobs at a time. After the
+ * first failure no new jobs are started, but those running are waited for.
+ * The dependencies of the objects built are saved either way.
+ * @return true if every file compiled
+ */
+static bool ib_compile_files(ib_file** files, int num_files) {
+    g_cache_hits = 0;
+    g_cache_misses = 0;
+    bool ok = ib_run_compile_jobs(files, num_files);
+    ib_save_dependencies();
+    
+    if (g_cache_hits + g_cache_misses > 0) {
+        ib_log_message(IB_LOG_INFO, "Compile cache: %d hits, %d misses", g_cache_hits, g_cache_misses);
+    }
+    return ok;
+}
+
+/**
+ * The job pool behind ib_compile_files()
+ */
+static bool ib_run_compile_jobs(ib_file** files, int num_files) {
+    if (num_files == 0) {
+        return true;
+    }
+    
+    int max_jobs = g_config.jobs > 0 ? g_config.jobs : 1;
+    if (max_jobs > num_files) {
+        max_jobs = num_files;
+    }
+    
+#ifdef _WIN32
+    // One file after another; Windows has neither the job pool nor the
+    // compile cache
+    bool ok = true;
+    for (int i = 0; i < num_files && ok; i++) {
+        ib_compile_file(files[i]);
+        ok = !files[i]->needs_rebuild;
+    }
+    return ok;
+#else
+    ib_log_message(IB_LOG_DEBUG, "Compiling %d files with %d jobs", num_files, max_jobs);
+    
+    ib_job* jobs = (ib_job*)calloc(max_jobs, sizeof(ib_job));
+    struct pollfd* fds = (struct pollfd*)calloc(max_jobs, sizeof(struct pollfd));
+    bool* lane_busy = (bool*)calloc(max_jobs, sizeof(bool));
+    if (!jobs || !fds || !lane_busy) {
+        ib_error("Out of memory starting compile jobs");
+        free(jobs);
+        free(fds);
+        free(lane_busy);
+        return false;
+    }
+    
+    int next = 0;
+    int running = 0;
+    bool ok = true;
+    while (running > 0 || (ok && next < num_files)) {
+        // Fill the free slots
+        while (ok && next < num_files && running < max_jobs) {
+            // Each job keeps one profile lane for as long as it runs
+            int lane = 0;
+            while (lane_busy[lane]) {
+                lane++;
+            }
+            jobs[running].lane = lane + 1;
+            
+            if (!ib_start_compile_job(&jobs[running], files[next])) {
+                ok = false;
+                break;
+            }
+            lane_busy[lane] = true;
+            running++;
+            next++;
+        }
+        if (running == 0) {
+            break;
+        }
+        
+        // Wait for any job to write or exit
+        for (int i = 0; i < running; i++) {
+            fds[i].fd = jobs[i].output_fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, running, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            // Cannot wait on all of them; drain them in turn instead
+            ib_error("Failed to wait for compile jobs (%s)", strerror(errno));
+            for (int i = 0; i < running; i++) {
+                while (ib_read_job_output(&jobs[i])) {
+                }
+                ib_finish_compile_job(&jobs[i], false);
+            }
+            ok = false;
+            break;
+        }
+        
+        // Backwards, so a finished job can take the last slot's place
+        for (int i = running - 1; i >= 0; i--) {
+            if (fds[i].revents && !ib_read_job_output(&jobs[i])) {
+                if (!ib_finish_compile_job(&jobs[i], ok)) {
+                    ok = false;
+                }
+                
+                // Still going if it moved on from preprocessing to compiling
+                if (jobs[i].pid == 0) {
+                    lane_busy[jobs[i].lane - 1] = false;
+                    jobs[i] = jobs[--running];
+                }
+            }
+        }
+    }
+    
+    free(jobs);
+    free(fds);
+    free(lane_busy);
+    return ok;
+#endif
+}
+
+/**
+ * Number of CPUs online, the default job count
+ */
+static int ib_online_cpus(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#endif
+}
+
+/**
+ * Set how many compiler processes may run at once
+ * @param jobs Job count; 0 or less uses the number of CPUs online
+ */
+void ib_set_jobs(int jobs) {
+    if (!g_initialized) {
+        ib_error("IncludeBuild not initialized. Call ib_init() first.");
+        return;
+    }
+    
+    g_config.jobs = jobs > 0 ? jobs : ib_online_cpus();
+    ib_log_message(IB_LOG_DEBUG, "Compile jobs: %d", g_config.jobs);
 }
 
 /**
- * Parse dependencies for a file
+ * Monotonic clock in microseconds
  */
-static void ib_parse_dependencies(ib_file* file) {
-    // Open the file
-    FILE* fp = fopen(file->path, "r");
+static double ib_now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e6 / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1e6 + (double)now.tv_nsec / 1e3;
+#endif
+}
+
+/**
+ * Forget the steps of the previous build and start timing a new one
+ */
+static void ib_trace_begin(void) {
+    for (int i = 0; i < g_num_trace_events; i++) {
+        free(g_trace_events[i].name);
+    }
+    g_num_trace_events = 0;
+    g_trace_epoch_us = ib_now_us();
+}
+
+/**
+ * Record a step of the build that started at start_us and ends now
+ */
+static void ib_trace_add(const char* name, const char* category, double start_us, int lane, long peak_rss_kb) {
+    if (g_num_trace_events == g_trace_events_capacity) {
+        g_trace_events = (ib_trace_event*)ib_grow(g_trace_events, &g_trace_events_capacity, 
+            sizeof(ib_trace_event));
+    }
+    
+    ib_trace_event* event = &g_trace_events[g_num_trace_events++];
+    event->name = ib_format("%s", name ? name : "");
+    event->category = category;
+    event->start_us = start_us;
+    event->duration_us = ib_now_us() - start_us;
+    event->peak_rss_kb = peak_rss_kb;
+    event->lane = lane;
+}
+
+/**
+ * Record a phase of the build run by IncludeBuild itself
+ */
+static void ib_trace_phase(const char* name, double start_us) {
+    ib_trace_add(name, "phase", start_us, 0, 0);
+}
+
+/**
+ * Format a duration for the profile
+ * @param buffer At least 32 bytes
+ */
+static const char* ib_format_duration(double us, char* buffer) {
+    if (us >= 1e6) {
+        snprintf(buffer, 32, "%.2f s", us / 1e6);
+    } else {
+        snprintf(buffer, 32, "%.1f ms", us / 1e3);
+    }
+    return buffer;
+}
+
+/**
+ * Longest first, for qsort()
+ */
+static int ib_compare_event_duration(const void* a, const void* b) {
+    const ib_trace_event* first = *(const ib_trace_event* const*)a;
+    const ib_trace_event* second = *(const ib_trace_event* const*)b;
+    if (first->duration_us != second->duration_us) {
+        return first->duration_us < second->duration_us ? 1 : -1;
+    }
+    return 0;
+}
+
+/**
+ * Write a string as a JSON string literal
+ */
+static void ib_write_json_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/**
+ * Write the steps of the build in Chrome's trace_event format, for
+ * chrome://tracing or Perfetto: one row for the phases and one for each job
+ * slot, so waits between jobs show as gaps
+ */
+static void ib_write_trace(const char* path) {
+    FILE* fp = fopen(path, "w");
     if (!fp) {
-        ib_error("Failed to open file: %s", file->path);
+        ib_warning("Could not write build trace: %s (%s)", path, strerror(errno));
         return;
     }
     
-    // Buffer for reading lines
-    char line[IB_MAX_PATH];
-    
-    // Check each line for includes
-    while (fgets(line, sizeof(line), fp)) {
-        // Look for #include "..."
-        char* include_start = strstr(line, "#include \"");
-        if (include_start) {
-            include_start += 10; // Skip "#include \""
-            char* include_end = strchr(include_start, '"');
-            if (include_end) {
-                *include_end = '\0';
-                
-                // Search for the included file in include dirs
-                for (int i = 0; i < g_config.num_include_dirs; i++) {
-                    char include_path[IB_MAX_PATH];
-                    ib_join_path(include_path, g_config.include_dirs[i], include_start);
-                    
-                    // Check if this file exists
-                    if (ib_file_exists(include_path)) {
-                        // Look for this file in our file list
-                        bool found = false;
-                        for (int j = 0; j < g_num_files; j++) {
-                            if (strcmp(g_files[j].path, include_path) == 0) {
-                                // Add as dependency if not already added
-                                bool already_dep = false;
-                                for (int k = 0; k < file->num_deps; k++) {
-                                    if (file->deps[k] == &g_files[j]) {
-                                        already_dep = true;
-                                        break;
-                                    }
-                                }
-                                
-                                if (!already_dep && file->num_deps < IB_MAX_DEPS) {
-                                    file->deps[file->num_deps++] = &g_files[j];
-                                    if (g_config.verbose) {
-                                        ib_log_message(IB_LOG_INFO, "  Dependency: %s -> %s", file->path, include_path);
-                                    }
-                                }
-                                
-                                found = true;
-                                break;
-                            }
-                        }
-                        
-                        if (found) {
-                            break;
-                        }
-                    }
-                }
-            }
+    int num_lanes = 1;
+    for (int i = 0; i < g_num_trace_events; i++) {
+        if (g_trace_events[i].lane + 1 > num_lanes) {
+            num_lanes = g_trace_events[i].lane + 1;
         }
     }
     
-    fclose(fp);
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (int lane = 0; lane < num_lanes; lane++) {
+        char lane_name[32];
+        if (lane == 0) {
+            snprintf(lane_name, sizeof(lane_name), "IncludeBuild");
+        } else {
+            snprintf(lane_name, sizeof(lane_name), "Job %d", lane);
+        }
+        fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"%s\"}},\n", lane, lane_name);
+    }
+    for (int i = 0; i < g_num_trace_events; i++) {
+        const ib_trace_event* event = &g_trace_events[i];
+        fprintf(fp, "  {\"name\": ");
+        ib_write_json_string(fp, event->name);
+        fprintf(fp, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+            "\"ts\": %.0f, \"dur\": %.0f, \"args\": {\"peak_rss_kb\": %ld}}%s\n", 
+            event->category, event->lane, event->start_us - g_trace_epoch_us, event->duration_us, 
+            event->peak_rss_kb, i + 1 < g_num_trace_events ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    
+    if (fclose(fp) != 0) {
+        ib_warning("Could not write build trace: %s (%s)", path, strerror(errno));
+        return;
+    }
+    ib_log_message(IB_LOG_INFO, "Build trace written to %s", path);
 }
 
 /**
- * Check if a file needs to be rebuilt
+ * Print the slowest jobs and the phase times of the build just finished,
+ * and write its trace file, as configured
  */
-static bool ib_needs_rebuild(ib_file* file) {
-    // If object file doesn't exist, rebuild
-    if (!ib_file_exists(file->obj_path)) {
-        return true;
+static void ib_profile_report(void) {
+    if (g_config.trace_path[0]) {
+        ib_write_trace(g_config.trace_path);
+    }
+    if (g_config.profile_slowest <= 0 || g_num_trace_events == 0) {
+        return;
     }
     
-    // Get object file's modification time
-    time_t obj_mtime = ib_get_file_mtime(file->obj_path);
-    
-    // If source file is newer than object file, rebuild
-    if (file->last_modified > obj_mtime) {
-        return true;
+    ib_trace_event** jobs = (ib_trace_event**)malloc((size_t)g_num_trace_events * sizeof(ib_trace_event*));
+    if (!jobs) {
+        return;
     }
     
-    // Check if any dependencies are newer
-    for (int i = 0; i < file->num_deps; i++) {
-        if (ib_needs_rebuild(file->deps[i]) || file->deps[i]->last_modified > obj_mtime) {
-            return true;
+    int num_jobs = 0;
+    double job_us = 0;
+    double compile_wall_us = 0;
+    int max_lane = 0;
+    char duration[32];
+    
+    printf("\nBuild profile\n");
+    printf("  Phases:");
+    for (int i = 0; i < g_num_trace_events; i++) {
+        ib_trace_event* event = &g_trace_events[i];
+        if (event->lane == 0) {
+            printf(" %s %s", event->name, ib_format_duration(event->duration_us, duration));
+            if (strcmp(event->name, "compile") == 0) {
+                compile_wall_us += event->duration_us;
+            }
+        } else {
+            jobs[num_jobs++] = event;
+            if (strcmp(event->category, "link") != 0) {
+                job_us += event->duration_us;
+                if (event->lane > max_lane) {
+                    max_lane = event->lane;
+                }
+            }
         }
     }
+    printf("\n");
     
-    return false;
+    // How well the pool was kept busy: the ideal is as many times the wall
+    // time as there were slots
+    if (compile_wall_us > 0 && job_us > 0) {
+        char wall[32];
+        printf("  Compile jobs: %s of work in %s on up to %d slots (%.1fx)\n", 
+            ib_format_duration(job_us, duration), ib_format_duration(compile_wall_us, wall), 
+            max_lane, job_us / compile_wall_us);
+    }
+    
+    qsort(jobs, num_jobs, sizeof(ib_trace_event*), ib_compare_event_duration);
+    int shown = num_jobs < g_config.profile_slowest ? num_jobs : g_config.profile_slowest;
+    if (shown > 0) {
+        printf("  Slowest %d of %d jobs:\n", shown, num_jobs);
+    }
+    for (int i = 0; i < shown; i++) {
+        printf("    %10s  %8.1f MB  %-10s  %s\n", ib_format_duration(jobs[i]->duration_us, duration), 
+            jobs[i]->peak_rss_kb / 1024.0, jobs[i]->category, jobs[i]->name);
+    }
+    
+    free(jobs);
 }
 
 /**
- * Compile a source file
+ * Profile builds: list the slowest compile and link jobs with their peak
+ * memory and the time spent in each phase, and write a Chrome trace_event
+ * JSON file of every step. IB_PROFILE and IB_TRACE set the same.
+ * @param slowest Number of jobs to list, 0 for no listing
+ * @param trace_path Trace file to write after each build, or NULL or "" for none
  */
-static void ib_compile_file(ib_file* file) {
-    ib_log_message(IB_LOG_INFO, "Compiling %s", file->path);
-    
-    char cmd[IB_MAX_CMD];
-    int include_flags_len = 0;
-    char include_flags[IB_MAX_CMD] = "";
+void ib_set_profile(int slowest, const char* trace_path) {
+    if (!g_initialized) {
+        ib_error("IncludeBuild not initialized. Call ib_init() first.");
+        return;
+    }
     
-    // Build include flags
-    for (int i = 0; i < g_config.num_include_dirs; i++) {
-        int dir_len = strlen(g_config.include_dirs[i]);
-        
-        // Check if we would exceed the buffer
-        if (include_flags_len + dir_len + 3 >= IB_MAX_CMD) {
-            ib_warning("Include flags too long, some directories will be omitted");
-            break;
-        }
-        
-#ifdef _WIN32
-        include_flags_len += snprintf(include_flags + include_flags_len, IB_MAX_CMD - include_flags_len,
-                                     "/I\"%s\" ", g_config.include_dirs[i]);
-#else
-        include_flags_len += snprintf(include_flags + include_flags_len, IB_MAX_CMD - include_flags_len,
-                                     "-I\"%s\" ", g_config.include_dirs[i]);
-#endif
+    if (trace_path && strlen(trace_path) >= IB_MAX_PATH) {
+        ib_error("Trace file path too long: %s", trace_path);
+        return;
     }
     
-    // Ensure build directory exists
-    char obj_dir[IB_MAX_PATH] = {0};
-    strcpy(obj_dir, file->obj_path);
+    g_config.profile_slowest = slowest > 0 ? slowest : 0;
+    strcpy(g_config.trace_path, trace_path ? trace_path : "");
+}
+
+/**
+ * Choose the optimization added to the compiler flags. IB_BUILD_RELEASE
+ * turns optimization on and assertions off, IB_BUILD_LTO also optimizes
+ * across objects when linking, and IB_BUILD_PGO also lays the code out by
+ * a profile of the program running the command given to
+ * ib_set_pgo_training(). Changing the mode rebuilds every object.
+ */
+void ib_set_build_mode(ib_build_mode mode) {
+    if (!g_initialized) {
+        ib_error("IncludeBuild not initialized. Call ib_init() first.");
+        return;
+    }
     
-    // Get directory part
-    char* last_sep = strrchr(obj_dir, PATH_SEPARATOR);
-    if (last_sep) {
-        *last_sep = '\0';
-        ib_ensure_dir_exists(obj_dir);
+    if (mode < IB_BUILD_DEFAULT || mode > IB_BUILD_PGO) {
+        ib_error("Invalid build mode: %d", (int)mode);
+        return;
     }
     
-    // Build command
-    sprintf(cmd, "%s %s -c %s -o %s", 
-        g_config.compiler, g_config.compiler_flags, file->path, file->obj_path);
+    g_config.build_mode = mode;
+}
+
+/**
+ * Set the training run of IB_BUILD_PGO, which should put the instrumented
+ * program through the code paths that need to be fast
+ * @param command Shell command to run the instrumented program, from the current directory
+ * @param profile_dir Where the profile goes, NULL or "" for <obj_dir>/pgo
+ */
+void ib_set_pgo_training(const char* command, const char* profile_dir) {
+    if (!g_initialized) {
+        ib_error("IncludeBuild not initialized. Call ib_init() first.");
+        return;
+    }
     
-    if (g_config.verbose) {
-        ib_log_message(IB_LOG_INFO, "  Command: %s", cmd);
+    if (!command || strlen(command) >= IB_MAX_CMD) {
+        ib_error("Invalid training command");
+        return;
+    }
+    if (profile_dir && strlen(profile_dir) >= IB_MAX_PATH) {
+        ib_error("Profile directory path too long: %s", profile_dir);
+        return;
     }
     
-    // Execute the command
-    FILE* proc = popen(cmd, "r");
-    if (!proc) {
-        ib_error("Failed to execute command: %s", cmd);
+    strcpy(g_config.pgo_training, command);
+    strcpy(g_config.pgo_dir, profile_dir ? profile_dir : "");
+}
+
+/**
+ * Keep compiled objects in a cache directory, shared by every build that
+ * uses it, and take them from there when the same compiler, flags and
+ * preprocessed source come up again. Not available on Windows.
+ * @param dir Cache directory, or NULL or "" to turn the cache off
+ */
+void ib_set_cache_dir(const char* dir) {
+    if (!g_initialized) {
+        ib_error("IncludeBuild not initialized. Call ib_init() first.");
         return;
     }
     
-    // Read output
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), proc)) {
-        if (g_config.verbose) {
-            printf("%s", buffer);
-        }
+    if (dir && strlen(dir) >= IB_MAX_PATH) {
+        ib_error("Cache directory path too long: %s", dir);
+        return;
     }
     
-    // Check result
-    int result = pclose(proc);
-    if (result != 0) {
-        ib_error("Compilation failed with code %d", result);
-    } else {
-        file->needs_rebuild = false;
+#ifdef _WIN32
+    if (dir && dir[0]) {
+        ib_warning("The compile cache is not supported on Windows");
+        return;
     }
+#endif
+    
+    strcpy(g_config.cache_dir, dir ? dir : "");
+    ib_log_message(IB_LOG_DEBUG, "Compile cache: %s", g_config.cache_dir[0] ? g_config.cache_dir : "off");
 }
 
 /**
  * Link a build target
+ * @param compiled Whether any object has been compiled in this build
  */
-static void ib_link_target(ib_target* target) {
+static bool ib_link_target(ib_target* target, bool compiled) {
+    // Nothing to do while no object has changed, the link flags are the
+    // same and the output is newer than all of them
+    time_t output_mtime = ib_get_file_mtime(target->output_path);
+    bool up_to_date = !compiled && !g_relink_all && output_mtime != 0;
+    for (int i = 0; i < g_num_files && up_to_date; i++) {
+        time_t obj_mtime = ib_get_file_mtime(g_files[i]->obj_path);
+        up_to_date = obj_mtime != 0 && obj_mtime <= output_mtime;
+    }
+    if (up_to_date) {
+        ib_log_message(IB_LOG_INFO, "%s is up to date", target->output_path);
+        return true;
+    }
+    
     ib_log_message(IB_LOG_INFO, "Linking %s", target->name);
     
-    // Find all files that belong to this target
-    char obj_files[IB_MAX_CMD] = "";
+    // Build command
+    ib_strbuf cmd = {NULL, 0, 0};
     
-    // Create a list of object files (avoiding duplicates)
-    bool obj_included[IB_MAX_FILES] = {false};
+    #ifdef _WIN32
+    // MSVC command
+    ib_strbuf_appendf(&cmd, "%s %s", g_config.compiler, g_config.compiler_flags);
+    ib_mode_flags(&cmd);
+    ib_strbuf_appendf(&cmd, " /Fe%s", target->output_path);
+    #else
+    // GCC/Clang command; LTO and profiling need the mode's flags here too
+    ib_strbuf_appendf(&cmd, "%s %s", g_config.compiler, g_config.compiler_flags);
+    ib_mode_flags(&cmd);
+    ib_strbuf_appendf(&cmd, " -o %s", target->output_path);
+    #endif
     
-    // Start with the main source file if specified
-    if (target->main_source[0]) {
-        // Find the corresponding object file
-        for (int i = 0; i < g_num_files; i++) {
-            if (strcmp(g_files[i].path, target->main_source) == 0) {
-                strcat(obj_files, " ");
-                strcat(obj_files, g_files[i].obj_path);
-                obj_included[i] = true;
-                break;
-            }
-        }
+    // Start with the main source file's object if specified, then all the
+    // others
+    ib_file* main_file = (ib_file*)ib_map_get(&g_file_map, target->main_source);
+    if (main_file) {
+        ib_strbuf_appendf(&cmd, " %s", main_file->obj_path);
     }
-    
-    // Add all other object files (avoiding duplicates)
     for (int i = 0; i < g_num_files; i++) {
-        if (!obj_included[i] && g_files[i].path[0]) {
-            strcat(obj_files, " ");
-            strcat(obj_files, g_files[i].obj_path);
+        if (g_files[i] != main_file) {
+            ib_strbuf_appendf(&cmd, " %s", g_files[i]->obj_path);
         }
     }
     
-    // Build command
-    char cmd[IB_MAX_CMD];
+    ib_strbuf_appendf(&cmd, " %s", g_config.linker_flags);
     
-    #ifdef _WIN32
-    // MSVC command
-    sprintf(cmd, "%s %s /Fe%s %s %s", 
-        g_config.compiler, g_config.compiler_flags, target->output_path, obj_files, g_config.linker_flags);
-    #else
-    // GCC/Clang command
-    sprintf(cmd, "%s %s -o %s %s %s", 
-        g_config.compiler, g_config.compiler_flags, target->output_path, obj_files, g_config.linker_flags);
-    #endif
+#ifndef _WIN32
+    // Run it as a job, for its time and peak memory in the profile
+    ib_job job;
+    memset(&job, 0, sizeof(job));
+    job.lane = 1;
+    bool started = ib_spawn_job(&job, NULL, target->name, cmd.data, IB_JOB_LINK);
+    free(cmd.data);
+    if (!started) {
+        return false;
+    }
     
+    while (ib_read_job_output(&job)) {
+    }
+    int status = 0;
+    if (ib_reap_job(&job, &status)) {
+        ib_log_message(IB_LOG_INFO, "Created %s", target->output_path);
+        return true;
+    }
+    if (WIFEXITED(status)) {
+        ib_error("Linking %s failed with code %d", target->name, WEXITSTATUS(status));
+    } else {
+        ib_error("Linking %s was killed by signal %d", target->name, WTERMSIG(status));
+    }
+    return false;
+#else
     if (g_config.verbose) {
-        ib_log_message(IB_LOG_INFO, "  Command: %s", cmd);
+        ib_log_message(IB_LOG_INFO, "  Command: %s", cmd.data);
     }
     
     // Execute the command
-    FILE* proc = popen(cmd, "r");
+    double start_us = ib_now_us();
+    FILE* proc = popen(cmd.data, "r");
     if (!proc) {
-        ib_error("Failed to execute command: %s", cmd);
-        return;
+        ib_error("Failed to execute command: %s", cmd.data);
+        free(cmd.data);
+        return false;
     }
+    free(cmd.data);
     
     // Read output
     char buffer[1024];
@@ -1347,11 +3313,14 @@ static void ib_link_target(ib_target* target) {
     
     // Check result
     int result = pclose(proc);
+    ib_trace_add(target->name, "link", start_us, 1, 0);
     if (result != 0) {
         ib_error("Linking failed with code %d", result);
-    } else {
-        ib_log_message(IB_LOG_INFO, "Created %s", target->output_path);
+        return false;
     }
+    ib_log_message(IB_LOG_INFO, "Created %s", target->output_path);
+    return true;
+#endif
 }
 
 /**
@@ -1371,10 +3340,10 @@ static void ib_add_default_target(void) {
     };
     
     const char* main_file = NULL;
+    char path[IB_MAX_PATH];
     
     // First try to find any of the candidates in the root directory
     for (const char** candidate = main_candidates; *candidate; candidate++) {
-        char path[IB_MAX_PATH];
         ib_join_path(path, g_config.source_dir, *candidate);
         
         if (ib_file_exists(path)) {
@@ -1386,16 +3355,16 @@ static void ib_add_default_target(void) {
     // If not found, look through all files
     if (!main_file) {
         for (int i = 0; i < g_num_files; i++) {
-            const char* filename = strrchr(g_files[i].path, PATH_SEPARATOR);
+            const char* filename = strrchr(g_files[i]->path, PATH_SEPARATOR);
             if (filename) {
                 filename++; // Skip the separator
             } else {
-                filename = g_files[i].path;
+                filename = g_files[i]->path;
             }
             
             for (const char** candidate = main_candidates; *candidate; candidate++) {
                 if (strcmp(filename, *candidate) == 0) {
-                    main_file = g_files[i].path;
+                    main_file = g_files[i]->path;
                     break;
                 }
             }
@@ -1445,6 +3414,12 @@ void ib_set_verbose(bool verbose) {
  */
 void ib_reset_config(void) {
     // Reset all internal state
+    ib_trace_begin();
+    free(g_trace_events);
+    g_trace_events = NULL;
+    g_trace_events_capacity = 0;
+    ib_clear_excludes();
+    free(g_config.exclude_files);
     memset(&g_config, 0, sizeof(g_config));
     ib_reset_targets();
     ib_reset_files();
@@ -1455,16 +3430,49 @@ void ib_reset_config(void) {
  * Reset the target list
  */
 static void ib_reset_targets(void) {
+    free(g_targets);
+    g_targets = NULL;
     g_num_targets = 0;
-    memset(g_targets, 0, sizeof(g_targets));
+    g_targets_capacity = 0;
+    ib_arena_free(&g_target_arena);
+}
+
+/**
+ * Add an empty target to the target list
+ */
+static ib_target* ib_new_target(void) {
+    if (g_num_targets == g_targets_capacity) {
+        g_targets = (ib_target**)ib_grow(g_targets, &g_targets_capacity, sizeof(ib_target*));
+    }
+    ib_target* target = (ib_target*)ib_arena_alloc(&g_target_arena, sizeof(ib_target));
+    target->main_source = "";
+    g_targets[g_num_targets++] = target;
+    return target;
 }
 
 /**
  * Reset the files list
  */
 static void ib_reset_files(void) {
+    for (int i = 0; i < g_num_files; i++) {
+        free(g_files[i]->deps);
+    }
+    free(g_files);
+    g_files = NULL;
     g_num_files = 0;
-    memset(g_files, 0, sizeof(g_files));
+    g_files_capacity = 0;
+    ib_map_clear(&g_file_map);
+    ib_map_clear(&g_path_strings);
+    
+    free(g_deps);
+    g_deps = NULL;
+    g_num_deps = 0;
+    g_deps_capacity = 0;
+    ib_map_clear(&g_dep_map);
+    g_dep_db_dirty = false;
+    
+    // Files, dependencies and every path they point to
+    ib_arena_free(&g_file_arena);
 }
 
 /**
@@ -1500,19 +3508,17 @@ void ib_add_library(const char* library) {
     ib_log_message(IB_LOG_DEBUG, "Added library: %s", library);
     
     // Update linker flags
-    char new_flags[IB_MAX_CMD] = "";
-    strcpy(new_flags, g_config.linker_flags);
-    
+    size_t len = strlen(g_config.linker_flags);
     #ifdef _WIN32
-    strcat(new_flags, " ");
-    strcat(new_flags, library);
-    strcat(new_flags, ".lib");
+    int added = snprintf(g_config.linker_flags + len, sizeof(g_config.linker_flags) - len, " %s.lib", library);
     #else
-    strcat(new_flags, " -l");
-    strcat(new_flags, library);
+    int added = snprintf(g_config.linker_flags + len, sizeof(g_config.linker_flags) - len, " -l%s", library);
     #endif
     
-    strcpy(g_config.linker_flags, new_flags);
+    if (added < 0 || (size_t)added >= sizeof(g_config.linker_flags) - len) {
+        g_config.linker_flags[len] = '\0';
+        ib_error("Linker flags too long to add library: %s", library);
+    }
 }
 
 /**
@@ -1564,18 +3570,17 @@ void ib_add_library_path(const char* path) {
     ib_log_message(IB_LOG_DEBUG, "Added library path: %s", path);
     
     // Update linker flags
-    char new_flags[IB_MAX_CMD] = "";
-    strcpy(new_flags, g_config.linker_flags);
-    
+    size_t len = strlen(g_config.linker_flags);
     #ifdef _WIN32
-    strcat(new_flags, " /LIBPATH:");
-    strcat(new_flags, path);
+    int added = snprintf(g_config.linker_flags + len, sizeof(g_config.linker_flags) - len, " /LIBPATH:%s", path);
     #else
-    strcat(new_flags, " -L");
-    strcat(new_flags, path);
+    int added = snprintf(g_config.linker_flags + len, sizeof(g_config.linker_flags) - len, " -L%s", path);
     #endif
     
-    strcpy(g_config.linker_flags, new_flags);
+    if (added < 0 || (size_t)added >= sizeof(g_config.linker_flags) - len) {
+        g_config.linker_flags[len] = '\0';
+        ib_error("Linker flags too long to add library path: %s", path);
+    }
 }
 
 /**
@@ -1587,13 +3592,37 @@ void ib_exclude_file(const char* file) {
         return;
     }
     
-    if (g_config.num_exclude_files >= IB_MAX_FILES) {
-        ib_error("Too many excluded files (max: %d)", IB_MAX_FILES);
-        return;
+    ib_append_exclude(file);
+    ib_log_message(IB_LOG_DEBUG, "Excluded file: %s", file);
+}
+
+/**
+ * Add a pattern to the exclude list
+ */
+static void ib_append_exclude(const char* file) {
+    if (g_config.num_exclude_files == g_config.exclude_files_capacity) {
+        g_config.exclude_files = (char**)ib_grow(g_config.exclude_files, 
+            &g_config.exclude_files_capacity, sizeof(char*));
     }
     
-    strcpy(g_config.exclude_files[g_config.num_exclude_files++], file);
-    ib_log_message(IB_LOG_DEBUG, "Excluded file: %s", file);
+    size_t len = strlen(file);
+    char* copy = (char*)malloc(len + 1);
+    if (!copy) {
+        ib_error("Out of memory");
+        exit(1);
+    }
+    memcpy(copy, file, len + 1);
+    g_config.exclude_files[g_config.num_exclude_files++] = copy;
+}
+
+/**
+ * Empty the exclude list
+ */
+static void ib_clear_excludes(void) {
+    for (int i = 0; i < g_config.num_exclude_files; i++) {
+        free(g_config.exclude_files[i]);
+    }
+    g_config.num_exclude_files = 0;
 }
 
 /**
@@ -1610,7 +3639,7 @@ bool ib_build_static_library(const char* name, const char* main_source, const ch
     
     // Reset internal state
     ib_reset_targets();
-    g_config.num_exclude_files = 0;
+    ib_clear_excludes();
     
     // Exclude build.c and any other specified files
     ib_exclude_file("build.c");
@@ -1619,38 +3648,56 @@ bool ib_build_static_library(const char* name, const char* main_source, const ch
     }
     
     // Create a target for the library
-    ib_target* target = &g_targets[g_num_targets++];
-    strcpy(target->name, name);
+    ib_target* target = ib_new_target();
+    target->name = ib_arena_strdup(&g_target_arena, name);
     if (main_source && strlen(main_source) > 0) {
-        strcpy(target->main_source, main_source);
+        target->main_source = ib_arena_strdup(&g_target_arena, main_source);
     }
     target->is_library = true;
     
-    // Use appropriate compiler flags
+    // Use appropriate compiler flags; the objects go into the library as
+    // they are, so there is no optimizing them at link time
     char old_flags[IB_MAX_CMD];
     strcpy(old_flags, g_config.compiler_flags);
     strcpy(g_config.compiler_flags, "-Wall -Wextra -O2 -c -fPIC");
+    ib_build_mode old_mode = g_config.build_mode;
+    if (g_config.build_mode > IB_BUILD_RELEASE) {
+        g_config.build_mode = IB_BUILD_RELEASE;
+    }
     
     // Compile all source files
+    ib_trace_begin();
     ib_reset_files();
     ib_find_source_files(g_config.source_dir);
+    ib_load_dependencies();
     
     // Compile all files that need rebuilding
-    for (int i = 0; i < g_num_files; i++) {
-        if (ib_needs_rebuild(&g_files[i])) {
-            ib_compile_file(&g_files[i]);
-        }
+    int num_stale = 0;
+    ib_file** stale = ib_find_stale_files(&num_stale);
+    bool compiled = ib_compile_files(stale, num_stale);
+    free(stale);
+    
+    if (!compiled) {
+        ib_error("Build failed, not creating lib%s", name);
+        ib_profile_report();
+        strcpy(g_config.compiler_flags, old_flags);
+        g_config.build_mode = old_mode;
+        return false;
     }
     
     // Build the static library using ar with proper lib prefix
-    char cmd[IB_MAX_CMD];
-    sprintf(cmd, "ar rcs lib/lib%s.a %s/*.o", name, g_config.obj_dir);
+    char* cmd = ib_format("ar rcs lib/lib%s.a %s/*.o", name, g_config.obj_dir);
     ib_log_message(IB_LOG_INFO, "Executing: %s", cmd);
     
+    double start_us = ib_now_us();
     bool success = ib_execute_command(cmd);
+    free(cmd);
+    ib_trace_add(name, "link", start_us, 1, 0);
+    ib_profile_report();
     
     // Restore compiler flags
     strcpy(g_config.compiler_flags, old_flags);
+    g_config.build_mode = old_mode;
     
     return success;
 }
@@ -1669,7 +3716,7 @@ bool ib_build_dynamic_library(const char* name, const char* main_source, const c
     
     // Reset internal state
     ib_reset_targets();
-    g_config.num_exclude_files = 0;
+    ib_clear_excludes();
     
     // Exclude build.c and any other specified files
     ib_exclude_file("build.c");
@@ -1678,38 +3725,56 @@ bool ib_build_dynamic_library(const char* name, const char* main_source, const c
     }
     
     // Create a target for the library
-    ib_target* target = &g_targets[g_num_targets++];
-    strcpy(target->name, name);
+    ib_target* target = ib_new_target();
+    target->name = ib_arena_strdup(&g_target_arena, name);
     if (main_source && strlen(main_source) > 0) {
-        strcpy(target->main_source, main_source);
+        target->main_source = ib_arena_strdup(&g_target_arena, main_source);
     }
     target->is_library = true;
     
-    // Use appropriate compiler flags
+    // Use appropriate compiler flags; the objects go into the library as
+    // they are, so there is no optimizing them at link time
     char old_flags[IB_MAX_CMD];
     strcpy(old_flags, g_config.compiler_flags);
     strcpy(g_config.compiler_flags, "-Wall -Wextra -O2 -c -fPIC");
+    ib_build_mode old_mode = g_config.build_mode;
+    if (g_config.build_mode > IB_BUILD_RELEASE) {
+        g_config.build_mode = IB_BUILD_RELEASE;
+    }
     
     // Compile all source files
+    ib_trace_begin();
     ib_reset_files();
     ib_find_source_files(g_config.source_dir);
+    ib_load_dependencies();
     
     // Compile all files that need rebuilding
-    for (int i = 0; i < g_num_files; i++) {
-        if (ib_needs_rebuild(&g_files[i])) {
-            ib_compile_file(&g_files[i]);
-        }
+    int num_stale = 0;
+    ib_file** stale = ib_find_stale_files(&num_stale);
+    bool compiled = ib_compile_files(stale, num_stale);
+    free(stale);
+    
+    if (!compiled) {
+        ib_error("Build failed, not creating lib%s", name);
+        ib_profile_report();
+        strcpy(g_config.compiler_flags, old_flags);
+        g_config.build_mode = old_mode;
+        return false;
     }
     
     // Build the shared library with proper lib prefix
-    char cmd[IB_MAX_CMD];
-    sprintf(cmd, "gcc -shared -o lib/lib%s.so %s/*.o", name, g_config.obj_dir);
+    char* cmd = ib_format("gcc -shared -o lib/lib%s.so %s/*.o", name, g_config.obj_dir);
     ib_log_message(IB_LOG_INFO, "Executing: %s", cmd);
     
+    double start_us = ib_now_us();
     bool success = ib_execute_command(cmd);
+    free(cmd);
+    ib_trace_add(name, "link", start_us, 1, 0);
+    ib_profile_report();
     
     // Restore compiler flags
     strcpy(g_config.compiler_flags, old_flags);
+    g_config.build_mode = old_mode;
     
     return success;
 }
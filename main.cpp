@@ -25,1043 +25,3294 @@
 // Explicitly include required Qt headers
 #include <QApplication>
 #include <QMainWindow>
-#include <QVBoxLayout>
+#include <QTabWidget>
+#include <QTabBar>
+#include <QSplitter>
+#include <QShortcut>
 #include <QResizeEvent>
 #include <QKeyEvent>
+#include <QFocusEvent>
+#include <QWheelEvent>
 #include <QScrollBar>
 #include <QPainter>
 #include <QFontDatabase>
+#include <QRawFont>
+#include <QGlyphRun>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QScreen>
+#include <QWindow>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QLineEdit>
+#include <QSocketNotifier>
+#include <QClipboard>
+#include <QHash>
 #include <QDebug>
 #include <QRegularExpression>
 #include <QTextCodec>
+#include <QtMath>
+#include <QOpenGLWidget>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLBuffer>
+#include <QOpenGLVertexArrayObject>
+#include <QSurfaceFormat>
+#include <QImage>
+#include <QDir>
+#include <QPointer>
+#include <QFile>
+#include <QDateTime>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pty.h>  // For forkpty
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 
-// Terminal character struct to store character attributes
-struct TermChar {
-    QChar character;
-    QColor foreground;
-    QColor background;
-    bool bold;
-    bool italic;
-    bool underline;
-    
-    TermChar() : character(' '), 
-                foreground(QColor(235, 219, 178)), 
-                background(QColor(40, 40, 40)),
-                bold(false),
-                italic(false),
-                underline(false) {}
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "terminal.h"
+#include "workloads.h"
+
+
+// CLOCK_MONOTONIC in nanoseconds, comparable across threads
+static inline qint64 monotonicNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return qint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// Lock-free single-producer/single-consumer byte ring. The producer writes
+// straight into writeRegion() and publishes with commitWrite(); the consumer
+// reads from readRegion() and releases space with commitRead(). Indices grow
+// monotonically and are masked on access, so the capacity must be a power
+// of two. The buffer is left uninitialized, so its pages only become
+// resident once something has been written to them.
+class SpscByteRing {
+public:
+    explicit SpscByteRing(size_t capacity)
+        : m_buffer(new char[capacity]), m_capacity(capacity), m_mask(capacity - 1), m_head(0), m_tail(0) {}
+    
+    // Producer: contiguous free space at the write position
+    char *writeRegion(size_t *length) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t used = head - m_tail.load();
+        size_t offset = head & m_mask;
+        *length = std::min(m_capacity - used, m_capacity - offset);
+        return &m_buffer[offset];
+    }
+    
+    void commitWrite(size_t length) {
+        m_head.store(m_head.load(std::memory_order_relaxed) + length);
+    }
+    
+    // Consumer: contiguous data at the read position
+    const char *readRegion(size_t *length) const {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t offset = tail & m_mask;
+        *length = std::min(m_head.load() - tail, m_capacity - offset);
+        return &m_buffer[offset];
+    }
+    
+    void commitRead(size_t length) {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + length);
+    }
+    
+    bool isEmpty() const {
+        return m_head.load() == m_tail.load();
+    }
+    
+private:
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_capacity;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_head;     // Written by the producer only
+    alignas(64) std::atomic<size_t> m_tail;     // Written by the consumer only
 };
 
-// Terminal widget class
-class TerminalWidget : public QWidget {
+class PtyReactor;
+
+// PTY output of one session, as read by the PtyReactor. The reactor writes
+// into ring() and the GUI thread drains it.
+//
+// dataAvailable() is emitted once per batch: the consumer calls
+// acknowledge() before draining and consumed() afterwards. When the ring is
+// full the reactor stops reading this PTY until consumed() has freed space,
+// so the kernel's PTY buffer fills up and the child blocks in write() exactly
+// as it would with a slow terminal - no output is ever dropped.
+//
+// Deleting the channel takes it out of the reactor; close the fd afterwards.
+class PtyChannel : public QObject {
     Q_OBJECT
+    
+public:
+    ~PtyChannel();
+    
+    SpscByteRing &ring() {
+        return m_ring;
+    }
+    
+    // Consumer: call before draining, so data arriving meanwhile is signalled
+    // again. Returns when the oldest data not acknowledged before was read,
+    // on monotonicNs(), or 0 if nothing has been read since.
+    qint64 acknowledge() {
+        m_notifyPending = false;
+        return m_readTime.exchange(0);
+    }
+    
+    // Consumer: call after draining, resumes reading a PTY blocked on a full ring
+    void consumed();
+    
+    // The child has gone away; once the ring is empty nothing more will come
+    bool isClosed() const {
+        return m_closed;
+    }
+    
+signals:
+    void dataAvailable();
+    
+private:
+    friend class PtyReactor;
+    
+    static const size_t kRingSize = 4 * 1024 * 1024;
+    
+    PtyChannel(PtyReactor *reactor, int fd)
+        : m_reactor(reactor), m_fd(fd), m_ring(kRingSize), m_watched(false),
+          m_notifyPending(false), m_waitingForSpace(false), m_closed(false), m_readTime(0) {}
+    
+    void notify() {
+        if (!m_notifyPending.exchange(true)) {
+            emit dataAvailable();
+        }
+    }
+    
+    PtyReactor *m_reactor;
+    int m_fd;
+    SpscByteRing m_ring;
+    bool m_watched;                     // In the epoll set; reactor thread only once added
+    std::atomic<bool> m_notifyPending;
+    std::atomic<bool> m_waitingForSpace;
+    std::atomic<bool> m_closed;
+    std::atomic<qint64> m_readTime;     // Stamped by the reactor, cleared by acknowledge()
+};
 
+// One thread reads the PTY masters of every session in the process. All fds
+// sit in a single epoll set, so an idle session costs no thread and no
+// wakeups - only its entry in the set and its ring, whose pages are not
+// touched until output arrives.
+//
+// Each channel is read for at most kReadBudget bytes per pass, so a flood in
+// one session cannot hold up the others. Channels are added and removed from
+// the GUI thread: removal waits for the pass in progress to finish, after
+// which the reactor never touches the channel again.
+class PtyReactor : public QThread {
 public:
-    explicit TerminalWidget(QWidget *parent = nullptr) : QWidget(parent), m_childPid(-1), m_masterFd(-1) {
-        // Set up appearance
-        setAttribute(Qt::WA_OpaquePaintEvent);
-        setFocusPolicy(Qt::StrongFocus);
+    explicit PtyReactor(QObject *parent = nullptr)
+        : QThread(parent), m_stopping(false), m_running(true), m_pass(0) {
+        m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+        m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_epollFd < 0 || m_wakeFd < 0) {
+            qDebug() << "Failed to set up the PTY reactor: " << strerror(errno);
+        } else {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr;
+            epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &event);
+        }
+    }
+    
+    ~PtyReactor() {
+        stop();
+        if (m_wakeFd >= 0) {
+            ::close(m_wakeFd);
+        }
+        if (m_epollFd >= 0) {
+            ::close(m_epollFd);
+        }
+    }
+    
+    void stop() {
+        m_stopping = true;
+        wake();
+        wait();
+    }
+    
+    // Start reading a non-blocking PTY master. The channel belongs to the caller.
+    PtyChannel *open(int fd) {
+        PtyChannel *channel = new PtyChannel(this, fd);
+        watch(channel);
+        return channel;
+    }
+    
+protected:
+    void run() override {
+        struct epoll_event events[kMaxEvents];
+        while (!m_stopping) {
+            int count = epoll_wait(m_epollFd, events, kMaxEvents, -1);
+            if (count < 0 && errno != EINTR) {
+                qDebug() << "Error waiting for PTY output: " << strerror(errno);
+                break;
+            }
+            
+            for (int i = 0; i < count; i++) {
+                PtyChannel *channel = static_cast<PtyChannel *>(events[i].data.ptr);
+                if (channel) {
+                    readChannel(channel);
+                } else {
+                    uint64_t wakeups;
+                    ssize_t ignored = read(m_wakeFd, &wakeups, sizeof(wakeups));
+                    (void)ignored;
+                }
+            }
+            
+            // Watch the channels the consumer has made room in again, then let
+            // remove() know this pass is over
+            QMutexLocker locker(&m_mutex);
+            for (PtyChannel *channel : m_resumed) {
+                watch(channel);
+            }
+            m_resumed.clear();
+            m_pass++;
+            m_passDone.wakeAll();
+        }
+        
+        QMutexLocker locker(&m_mutex);
+        m_running = false;
+        m_passDone.wakeAll();
+    }
+    
+private:
+    friend class PtyChannel;
+    
+    static const int kMaxEvents = 64;
+    static const size_t kReadBudget = 256 * 1024;
+    
+    // Read until the PTY would block, the channel's ring fills up or the
+    // channel has had its share of this pass
+    void readChannel(PtyChannel *channel) {
+        SpscByteRing &ring = channel->m_ring;
+        size_t budget = kReadBudget;
+        size_t space;
+        char *region = ring.writeRegion(&space);
+        
+        while (budget > 0) {
+            if (space == 0) {
+                // Ring is full: wait for the consumer. Re-check after raising the
+                // flag in case it freed space in between.
+                channel->m_waitingForSpace = true;
+                region = ring.writeRegion(&space);
+                if (space == 0) {
+                    unwatch(channel);
+                    return;
+                }
+            }
+            
+            ssize_t bytesRead = read(channel->m_fd, region, std::min(space, budget));
+            if (bytesRead > 0) {
+                // Only the first read of a batch is timed, for the latency
+                // of its output
+                if (channel->m_readTime.load(std::memory_order_relaxed) == 0) {
+                    channel->m_readTime.store(monotonicNs(), std::memory_order_relaxed);
+                }
+                ring.commitWrite(bytesRead);
+                budget -= size_t(bytesRead);
+                channel->notify();
+                region = ring.writeRegion(&space);
+            } else if (bytesRead == -1 && errno == EINTR) {
+                continue;
+            } else if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            } else {
+                // EOF or EIO - the child has gone away
+                if (bytesRead == -1 && errno != EIO) {
+                    qDebug() << "Error reading from PTY: " << strerror(errno);
+                }
+                unwatch(channel);
+                channel->m_closed = true;
+                channel->notify();
+                return;
+            }
+        }
+    }
+    
+    // A channel waiting for space is taken out of the set rather than just
+    // masked, as a hung-up PTY would otherwise be reported on every pass
+    void watch(PtyChannel *channel) {
+        if (channel->m_watched || channel->m_closed) {
+            return;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = channel;
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, channel->m_fd, &event) != 0) {
+            qDebug() << "Failed to watch PTY: " << strerror(errno);
+            return;
+        }
+        channel->m_watched = true;
+    }
+    
+    void unwatch(PtyChannel *channel) {
+        if (channel->m_watched) {
+            epoll_ctl(m_epollFd, EPOLL_CTL_DEL, channel->m_fd, nullptr);
+            channel->m_watched = false;
+        }
+    }
+    
+    // Consumer side of PtyChannel::consumed()
+    void resume(PtyChannel *channel) {
+        QMutexLocker locker(&m_mutex);
+        m_resumed.push_back(channel);
+        wake();
+    }
+    
+    // From ~PtyChannel: after this the reactor holds no reference to it
+    void remove(PtyChannel *channel) {
+        QMutexLocker locker(&m_mutex);
+        m_resumed.erase(std::remove(m_resumed.begin(), m_resumed.end(), channel), m_resumed.end());
+        epoll_ctl(m_epollFd, EPOLL_CTL_DEL, channel->m_fd, nullptr);
+        
+        // The pass in progress may still be reading it
+        if (isRunning()) {
+            quint64 pass = m_pass;
+            wake();
+            while (m_running && m_pass == pass) {
+                m_passDone.wait(&m_mutex);
+            }
+        }
+    }
+    
+    void wake() {
+        if (m_wakeFd >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = write(m_wakeFd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    
+    int m_epollFd;
+    int m_wakeFd;                       // eventfd, the only entry with a null pointer
+    std::atomic<bool> m_stopping;
+    
+    QMutex m_mutex;                     // Guards everything below
+    QWaitCondition m_passDone;
+    std::vector<PtyChannel *> m_resumed;
+    bool m_running;
+    quint64 m_pass;                     // Passes over the ready fds completed
+};
+
+inline PtyChannel::~PtyChannel() {
+    m_reactor->remove(this);
+}
+
+inline void PtyChannel::consumed() {
+    if (m_waitingForSpace.exchange(false)) {
+        m_reactor->resume(this);
+    }
+}
+
+// Worker thread for scrollback searches. A query runs over a snapshot of the
+// history's blocks, newest first, and a new query replaces the one in
+// progress. Matches are handed back in batches: matchesAvailable() is
+// emitted once per batch, and takeMatches() collects everything found so far.
+class ScrollbackSearcher : public QThread {
+    Q_OBJECT
+    
+public:
+    explicit ScrollbackSearcher(QObject *parent = nullptr)
+        : QThread(parent), m_generation(0), m_stopping(false), m_hasQuery(false),
+          m_finished(true), m_notifyPending(false) {}
+    
+    ~ScrollbackSearcher() {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stopping = true;
+            m_generation++;
+        }
+        m_wake.wakeOne();
+        wait();
+    }
+    
+    // Start searching, abandoning any search still running
+    void search(const std::vector<uint32_t> &needle, std::vector<Scrollback::SearchBlock> blocks) {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        m_needle = needle;
+        m_blocks.swap(blocks);
+        m_hasQuery = true;
+        m_finished = false;
+        m_matches.clear();
+        m_wake.wakeOne();
+    }
+    
+    void cancel() {
+        QMutexLocker locker(&m_mutex);
+        m_generation++;
+        m_hasQuery = false;
+        m_blocks.clear();
+        m_finished = true;
+        m_matches.clear();
+    }
+    
+    // Consumer: append the matches found since the last call to out, newest
+    // first. Returns true once the search has finished.
+    bool takeMatches(std::vector<SearchMatch> *out) {
+        QMutexLocker locker(&m_mutex);
+        out->insert(out->end(), m_matches.begin(), m_matches.end());
+        m_matches.clear();
+        m_notifyPending = false;
+        return m_finished;
+    }
+    
+signals:
+    void matchesAvailable();
+    
+protected:
+    void run() override {
+        QMutexLocker locker(&m_mutex);
+        while (!m_stopping) {
+            if (!m_hasQuery) {
+                m_wake.wait(&m_mutex);
+                continue;
+            }
+            
+            m_hasQuery = false;
+            quint64 generation = m_generation;
+            SearchPattern pattern(m_needle);
+            std::vector<Scrollback::SearchBlock> blocks;
+            blocks.swap(m_blocks);
+            locker.unlock();
+            
+            std::vector<SearchMatch> found;
+            size_t total = 0;
+            for (const Scrollback::SearchBlock &block : blocks) {
+                if (m_generation != generation || total >= kMaxMatches) {
+                    break;
+                }
+                pattern.search(block, &found);
+                total += found.size();
+                if (!found.empty()) {
+                    publish(generation, &found, false);
+                }
+            }
+            publish(generation, &found, true);
+            
+            // Let go of the blocks so the history can recycle them
+            blocks.clear();
+            locker.relock();
+        }
+    }
+    
+private:
+    static const size_t kMaxMatches = 100000;
+    
+    void publish(quint64 generation, std::vector<SearchMatch> *found, bool finished) {
+        bool notify = false;
+        {
+            QMutexLocker locker(&m_mutex);
+            if (generation == m_generation) {
+                m_matches.insert(m_matches.end(), found->begin(), found->end());
+                m_finished = finished;
+                notify = !m_notifyPending;
+                m_notifyPending = true;
+            }
+        }
+        found->clear();
+        if (notify) {
+            emit matchesAvailable();
+        }
+    }
+    
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    std::atomic<quint64> m_generation;  // Bumped by every new query, so stale ones stop
+    bool m_stopping;
+    bool m_hasQuery;                    // m_needle and m_blocks hold a query to run
+    bool m_finished;
+    bool m_notifyPending;
+    std::vector<uint32_t> m_needle;
+    std::vector<Scrollback::SearchBlock> m_blocks;
+    std::vector<SearchMatch> m_matches; // Found but not taken yet
+};
+
+// Glyph lookup for the cell renderer. Each (codepoint, bold, italic) is
+// resolved once to a glyph index in a QRawFont for that style, so painting
+// never goes through font matching or text shaping. Runs of cells are then
+// drawn with drawGlyphRun(), which blits the glyphs from the paint engine's
+// cache of rasterized glyphs.
+class GlyphCache {
+public:
+    enum Style {
+        StyleBold = 1,
+        StyleItalic = 2,
+        StyleCount = 4
+    };
+    
+    explicit GlyphCache(const QFont &font) {
+        for (int style = 0; style < StyleCount; style++) {
+            m_fonts[style] = font;
+            m_fonts[style].setBold(style & StyleBold);
+            m_fonts[style].setItalic(style & StyleItalic);
+            m_rawFonts[style] = QRawFont::fromFont(m_fonts[style]);
+        }
+    }
+    
+    static int styleFor(const TermCell &cell) {
+        return ((cell.attrs & AttrBold) ? StyleBold : 0) | ((cell.attrs & AttrItalic) ? StyleItalic : 0);
+    }
+    
+    const QFont &font(int style) const {
+        return m_fonts[style];
+    }
+    
+    const QRawFont &rawFont(int style) const {
+        return m_rawFonts[style];
+    }
+    
+    // Glyph index of a codepoint in the given style, 0 if the font lacks it
+    quint32 glyphIndex(uint32_t codepoint, int style) {
+        quint32 key = (codepoint << 2) | style;
+        QHash<quint32, quint32>::const_iterator it = m_glyphs.constFind(key);
+        if (it != m_glyphs.constEnd()) {
+            return it.value();
+        }
+        
+        QChar chars[2];
+        int numChars = 1;
+        if (QChar::requiresSurrogates(codepoint)) {
+            chars[0] = QChar(QChar::highSurrogate(codepoint));
+            chars[1] = QChar(QChar::lowSurrogate(codepoint));
+            numChars = 2;
+        } else {
+            chars[0] = QChar(ushort(codepoint));
+        }
+        
+        quint32 indexes[2] = { 0, 0 };
+        int numGlyphs = 2;
+        quint32 index = 0;
+        if (m_rawFonts[style].isValid() &&
+            m_rawFonts[style].glyphIndexesForChars(chars, numChars, indexes, &numGlyphs) &&
+            numGlyphs == 1) {
+            index = indexes[0];
+        }
+        
+        m_glyphs.insert(key, index);
+        return index;
+    }
+    
+private:
+    QFont m_fonts[StyleCount];
+    QRawFont m_rawFonts[StyleCount];
+    QHash<quint32, quint32> m_glyphs;   // (codepoint << 2 | style) -> glyph index
+};
+
+// A search match in view: cells [firstCol, lastCol] of view row row
+struct CellHighlight {
+    int row;
+    int firstCol;
+    int lastCol;
+    bool current;                       // The match last moved to
+    
+    uint32_t color() const {
+        return current ? packRgb(254, 128, 25) : packRgb(250, 189, 47);
+    }
+};
+
+// Glyph atlas for the OpenGL renderer: a grid of equally sized slots in one
+// R8 texture, filled in first-use order and started over when it runs full.
+// Every GlTerminalView in the process draws from the same atlas, which relies
+// on their contexts sharing objects (Qt::AA_ShareOpenGLContexts), so a glyph
+// is rasterized and uploaded once however many sessions show it.
+//
+// All calls need a context of the share group to be current.
+class GlyphAtlas {
+public:
+    // The atlas in use, created on first use and freed with its last view
+    static std::shared_ptr<GlyphAtlas> acquire(GlyphCache *glyphCache) {
+        static std::weak_ptr<GlyphAtlas> current;
+        std::shared_ptr<GlyphAtlas> atlas = current.lock();
+        if (!atlas) {
+            atlas.reset(new GlyphAtlas(glyphCache));
+            current = atlas;
+        }
+        return atlas;
+    }
+    
+    ~GlyphAtlas() {
+        QOpenGLContext *context = QOpenGLContext::currentContext();
+        if (m_texture && context) {
+            context->functions()->glDeleteTextures(1, &m_texture);
+        }
+    }
+    
+    // Start over if the glyphs in the atlas were drawn for other metrics
+    void prepare(int charWidth, int charHeight, int ascent, qreal ratio) {
+        if (charWidth != m_charWidth || charHeight != m_charHeight || ascent != m_ascent || ratio != m_ratio) {
+            m_charWidth = charWidth;
+            m_charHeight = charHeight;
+            m_ascent = ascent;
+            reset(ratio);
+        }
+    }
+    
+    // Bumped by every reset, which invalidates all slots handed out before
+    quint64 generation() const {
+        return m_generation;
+    }
+    
+    GLuint texture() const {
+        return m_texture;
+    }
+    
+    int size() const {
+        return m_size;
+    }
+    
+    int slotWidth() const {
+        return m_slotWidth;
+    }
+    
+    int slotHeight() const {
+        return m_slotHeight;
+    }
+    
+    int slotsPerRow() const {
+        return m_slotsPerRow;
+    }
+    
+    uint16_t slot(uint32_t codepoint, int style, bool wide) {
+        if (codepoint <= ' ') {
+            return 0;
+        }
+        
+        quint32 key = (codepoint << 2) | style;
+        QHash<quint32, uint16_t>::const_iterator it = m_slots.constFind(key);
+        if (it != m_slots.constEnd()) {
+            return it.value();
+        }
+        
+        if (m_nextSlot >= m_slotCount) {
+            reset(m_ratio);
+        }
+        uint16_t slot = uint16_t(m_nextSlot++);
+        
+        // White text on transparent, of which only the coverage is kept
+        QImage image(m_slotWidth, m_slotHeight, QImage::Format_ARGB32_Premultiplied);
+        image.fill(0);
+        image.setDevicePixelRatio(m_ratio);
+        {
+            QPainter painter(&image);
+            painter.setFont(m_glyphCache->font(style));
+            painter.setPen(Qt::white);
+            painter.setClipRect(0, 0, (wide ? 2 : 1) * m_charWidth, m_charHeight);
+            uint ucs4 = codepoint;
+            painter.drawText(0, m_ascent, QString::fromUcs4(&ucs4, 1));
+        }
+        upload(slot, image.convertToFormat(QImage::Format_Alpha8));
+        
+        m_slots.insert(key, slot);
+        return slot;
+    }
+    
+private:
+    static constexpr int kMaxSize = 4096;
+    
+    explicit GlyphAtlas(GlyphCache *glyphCache)
+        : m_glyphCache(glyphCache), m_texture(0), m_size(0), m_charWidth(0), m_charHeight(0), m_ascent(0),
+          m_ratio(0), m_slotWidth(0), m_slotHeight(0), m_slotsPerRow(0), m_slotCount(0), m_nextSlot(1),
+          m_generation(0) {
+        QOpenGLFunctions *gl = QOpenGLContext::currentContext()->functions();
+        GLint maxTextureSize = 0;
+        gl->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+        m_size = qMin(int(maxTextureSize), kMaxSize);
+        gl->glGenTextures(1, &m_texture);
+        gl->glBindTexture(GL_TEXTURE_2D, m_texture);
+        gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, m_size, m_size, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    
+    // Drop every glyph and size the slots for the current cell metrics. Slots
+    // are two cells wide so that double-width glyphs fit.
+    void reset(qreal ratio) {
+        m_ratio = ratio;
+        m_slotWidth = qMax(1, qCeil(2 * m_charWidth * ratio));
+        m_slotHeight = qMax(1, qCeil(m_charHeight * ratio));
+        m_slotsPerRow = qMax(1, m_size / m_slotWidth);
+        m_slotCount = qMin(m_slotsPerRow * qMax(1, m_size / m_slotHeight), 0x10000);
+        m_slots.clear();
+        m_nextSlot = 1;
+        m_generation++;
+        
+        // Slot 0 stays empty for blank cells
+        QImage blank(m_slotWidth, m_slotHeight, QImage::Format_Alpha8);
+        blank.fill(0);
+        upload(0, blank);
+    }
+    
+    void upload(int slot, const QImage &image) {
+        QOpenGLFunctions *gl = QOpenGLContext::currentContext()->functions();
+        gl->glBindTexture(GL_TEXTURE_2D, m_texture);
+        gl->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        gl->glPixelStorei(GL_UNPACK_ROW_LENGTH, image.bytesPerLine());
+        gl->glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % m_slotsPerRow) * m_slotWidth, (slot / m_slotsPerRow) * m_slotHeight,
+                            m_slotWidth, m_slotHeight, GL_RED, GL_UNSIGNED_BYTE, image.constBits());
+        gl->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    
+    GlyphCache *m_glyphCache;
+    GLuint m_texture;
+    int m_size;
+    int m_charWidth;                    // Cell metrics the glyphs were drawn for
+    int m_charHeight;
+    int m_ascent;
+    qreal m_ratio;                      // Device pixel ratio of the glyphs in it
+    int m_slotWidth;                    // In texels
+    int m_slotHeight;
+    int m_slotsPerRow;
+    int m_slotCount;
+    int m_nextSlot;
+    quint64 m_generation;
+    QHash<quint32, uint16_t> m_slots;   // (codepoint << 2 | style) -> slot
+};
+
+// OpenGL renderer for a TerminalScreen. Every visible cell becomes one
+// instance of a unit quad carrying its position, glyph and colors, so the
+// whole grid is redrawn from a single per-frame instance buffer in one draw
+// call. Glyphs are rasterized once per (codepoint, style) into the shared
+// GlyphAtlas and the fragment shader blends the cell background into the foreground by
+// glyph coverage, which also covers the background pass.
+//
+// The view never takes input: it covers its TerminalWidget, which keeps the
+// focus and the events and tells it what to show through setView().
+class GlTerminalView : public QOpenGLWidget, protected QOpenGLExtraFunctions {
+public:
+    GlTerminalView(const TerminalScreen *screen, GlyphCache *glyphCache, QWidget *parent)
+        : QOpenGLWidget(parent), m_screen(screen), m_glyphCache(glyphCache),
+          m_charWidth(1), m_charHeight(1), m_ascent(0), m_cursorColor(0xFFFFFFFF),
+          m_scrollOffset(0), m_cursorShown(true), m_ready(false), m_paintTime(0),
+          m_cornerBuffer(QOpenGLBuffer::VertexBuffer), m_instanceBuffer(QOpenGLBuffer::VertexBuffer) {
+        setAttribute(Qt::WA_TransparentForMouseEvents);
+        setFocusPolicy(Qt::NoFocus);
+    }
+    
+    ~GlTerminalView() {
+        makeCurrent();
+        m_atlas.reset();
+        m_instanceBuffer.destroy();
+        m_cornerBuffer.destroy();
+        m_vao.destroy();
+        m_program.removeAllShaders();
+        doneCurrent();
+    }
+    
+    // Whether an OpenGL 3.3 or OpenGL ES 3.0 context can be created at all
+    static bool isSupported() {
+        QOpenGLContext context;
+        if (!context.create()) {
+            return false;
+        }
+        QSurfaceFormat format = context.format();
+        return format.majorVersion() > 3 || (format.majorVersion() == 3 &&
+               (context.isOpenGLES() || format.minorVersion() >= 3));
+    }
+    
+    void setCellMetrics(int charWidth, int charHeight, int ascent) {
+        m_charWidth = charWidth;
+        m_charHeight = charHeight;
+        m_ascent = ascent;
+    }
+    
+    void setCursorColor(const QColor &color) {
+        m_cursorColor = color.rgba();
+    }
+    
+    // What to present on the next frame
+    void setView(int scrollOffset, bool cursorShown) {
+        m_scrollOffset = scrollOffset;
+        m_cursorShown = cursorShown;
+    }
+    
+    void setHighlights(const std::vector<CellHighlight> &highlights) {
+        m_highlights = highlights;
+    }
+    
+    // CPU time of the last paintGL() in ns, and the cells it drew
+    qint64 lastPaintTime() const {
+        return m_paintTime;
+    }
+    
+    int lastPaintCells() const {
+        return int(m_instances.size());
+    }
+    
+protected:
+    void initializeGL() override {
+        initializeOpenGLFunctions();
+        
+        QByteArray header = context()->isOpenGLES()
+            ? "#version 300 es\nprecision highp float;\nprecision highp int;\n"
+            : "#version 330 core\n";
+        m_program.addShaderFromSourceCode(QOpenGLShader::Vertex, header + kVertexShader);
+        m_program.addShaderFromSourceCode(QOpenGLShader::Fragment, header + kFragmentShader);
+        m_program.bindAttributeLocation("corner", AttributeCorner);
+        m_program.bindAttributeLocation("cell", AttributeCell);
+        m_program.bindAttributeLocation("glyph", AttributeGlyph);
+        m_program.bindAttributeLocation("fg", AttributeFg);
+        m_program.bindAttributeLocation("bg", AttributeBg);
+        if (!m_program.link()) {
+            qDebug() << "Failed to build the terminal shaders: " << m_program.log();
+            return;
+        }
+        
+        m_vao.create();
+        m_vao.bind();
+        
+        static const GLfloat corners[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+        m_cornerBuffer.create();
+        m_cornerBuffer.bind();
+        m_cornerBuffer.allocate(corners, sizeof(corners));
+        glEnableVertexAttribArray(AttributeCorner);
+        glVertexAttribPointer(AttributeCorner, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+        
+        m_instanceBuffer.create();
+        m_instanceBuffer.setUsagePattern(QOpenGLBuffer::StreamDraw);
+        m_instanceBuffer.bind();
+        setInstanceAttribute(AttributeCell, 2, GL_UNSIGNED_SHORT, GL_FALSE, offsetof(CellInstance, col));
+        setInstanceAttribute(AttributeGlyph, 2, GL_UNSIGNED_SHORT, GL_FALSE, offsetof(CellInstance, glyph));
+        setInstanceAttribute(AttributeFg, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(CellInstance, fg));
+        setInstanceAttribute(AttributeBg, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(CellInstance, bg));
+        
+        m_vao.release();
+        
+        m_atlas = GlyphAtlas::acquire(m_glyphCache);
+        m_ready = true;
+    }
+    
+    void paintGL() override {
+        if (!m_ready) {
+            return;
+        }
+        qint64 paintStart = monotonicNs();
+        
+        // Glyphs are rasterized at the device pixel ratio, so a move to a
+        // screen with a different one starts the atlas over
+        qreal ratio = devicePixelRatioF();
+        m_atlas->prepare(m_charWidth, m_charHeight, m_ascent, ratio);
+        
+        // Should the atlas fill up while the frame is built, the glyphs placed
+        // before that point are gone and the frame is built once more
+        if (!buildInstances()) {
+            buildInstances();
+        }
+        
+        uint32_t background = m_screen->color(ColorDefaultBg);
+        glViewport(0, 0, qRound(width() * ratio), qRound(height() * ratio));
+        glClearColor(qRed(background) / 255.0f, qGreen(background) / 255.0f, qBlue(background) / 255.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        
+        if (m_instances.empty()) {
+            m_paintTime = monotonicNs() - paintStart;
+            return;
+        }
+        
+        m_instanceBuffer.bind();
+        m_instanceBuffer.allocate(m_instances.data(), int(m_instances.size() * sizeof(CellInstance)));
+        
+        m_program.bind();
+        m_program.setUniformValue("cellSize", GLfloat(m_charWidth * ratio), GLfloat(m_charHeight * ratio));
+        m_program.setUniformValue("viewSize", GLfloat(width() * ratio), GLfloat(height() * ratio));
+        m_program.setUniformValue("slotSize", GLfloat(m_atlas->slotWidth()), GLfloat(m_atlas->slotHeight()));
+        m_program.setUniformValue("slotsPerRow", GLint(m_atlas->slotsPerRow()));
+        m_program.setUniformValue("atlasSize", GLfloat(m_atlas->size()));
+        m_program.setUniformValue("underlineY", GLfloat((m_ascent + 2) * ratio));
+        m_program.setUniformValue("lineWidth", GLfloat(qMax(qreal(1), ratio)));
+        m_program.setUniformValue("atlas", 0);
+        
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_atlas->texture());
+        
+        m_vao.bind();
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(m_instances.size()));
+        m_vao.release();
+        m_program.release();
+        m_paintTime = monotonicNs() - paintStart;
+    }
+    
+private:
+    enum Attribute {
+        AttributeCorner,
+        AttributeCell,
+        AttributeGlyph,
+        AttributeFg,
+        AttributeBg
+    };
+    
+    enum InstanceFlag : uint16_t {
+        FlagRightHalf = 1,      // Second cell of a double-width glyph
+        FlagUnderline = 2
+    };
+    
+    // One cell as the vertex shader sees it. Colors are 0xAARRGGBB, so the
+    // bytes arrive in BGRA order.
+    struct CellInstance {
+        uint16_t col;
+        uint16_t row;
+        uint16_t glyph;         // Atlas slot, 0 is blank
+        uint16_t flags;
+        uint32_t fg;
+        uint32_t bg;
+    };
+    
+    static constexpr const char *kVertexShader =
+        "in vec2 corner;\n"
+        "in vec2 cell;\n"
+        "in vec2 glyph;\n"
+        "in vec4 fg;\n"
+        "in vec4 bg;\n"
+        "uniform vec2 cellSize;\n"
+        "uniform vec2 viewSize;\n"
+        "uniform vec2 slotSize;\n"
+        "uniform int slotsPerRow;\n"
+        "uniform float atlasSize;\n"
+        "out vec2 texCoord;\n"
+        "out vec2 cellPixel;\n"
+        "out vec4 fgColor;\n"
+        "out vec4 bgColor;\n"
+        "flat out int flags;\n"
+        "void main() {\n"
+        "    vec2 position = (cell + corner) * cellSize;\n"
+        "    gl_Position = vec4(position.x / viewSize.x * 2.0 - 1.0, 1.0 - position.y / viewSize.y * 2.0, 0.0, 1.0);\n"
+        "    flags = int(glyph.y);\n"
+        "    int slotIndex = int(glyph.x);\n"
+        "    vec2 slot = vec2(float(slotIndex % slotsPerRow), float(slotIndex / slotsPerRow)) * slotSize;\n"
+        "    float rightHalf = (flags & 1) != 0 ? cellSize.x : 0.0;\n"
+        "    cellPixel = corner * cellSize;\n"
+        "    texCoord = (slot + vec2(rightHalf, 0.0) + cellPixel) / atlasSize;\n"
+        "    fgColor = fg.zyxw;\n"
+        "    bgColor = bg.zyxw;\n"
+        "}\n";
+    
+    static constexpr const char *kFragmentShader =
+        "uniform sampler2D atlas;\n"
+        "uniform float underlineY;\n"
+        "uniform float lineWidth;\n"
+        "in vec2 texCoord;\n"
+        "in vec2 cellPixel;\n"
+        "in vec4 fgColor;\n"
+        "in vec4 bgColor;\n"
+        "flat in int flags;\n"
+        "out vec4 fragColor;\n"
+        "void main() {\n"
+        "    float coverage = texture(atlas, texCoord).r;\n"
+        "    if ((flags & 2) != 0 && cellPixel.y >= underlineY && cellPixel.y < underlineY + lineWidth) {\n"
+        "        coverage = 1.0;\n"
+        "    }\n"
+        "    fragColor = vec4(mix(bgColor.rgb, fgColor.rgb, coverage), 1.0);\n"
+        "}\n";
+    
+    void setInstanceAttribute(Attribute attribute, int size, GLenum type, GLboolean normalized, size_t offset) {
+        glEnableVertexAttribArray(attribute);
+        glVertexAttribPointer(attribute, size, type, normalized, sizeof(CellInstance),
+                              reinterpret_cast<const void *>(offset));
+        glVertexAttribDivisor(attribute, 1);
+    }
+    
+    // Lay the whole viewport out as instances. Returns false if the atlas was
+    // reset on the way, leaving the earlier instances with stale slots.
+    bool buildInstances() {
+        int rows = m_screen->rows();
+        int cols = m_screen->cols();
+        quint64 atlasGeneration = m_atlas->generation();
+        m_instances.resize(size_t(rows) * cols);
+        
+        CellInstance *instance = m_instances.data();
+        for (int y = 0; y < rows; y++) {
+            int length;
+            const TermCell *line = m_screen->visibleLine(y, m_scrollOffset, &length);
+            uint16_t wideGlyph = 0;
+            for (int x = 0; x < cols; x++, instance++) {
+                const TermCell &cell = x < length ? line[x] : kBlankCell;
+                instance->col = uint16_t(x);
+                instance->row = uint16_t(y);
+                instance->fg = m_screen->color(cell.fg);
+                instance->bg = m_screen->color(cell.bg);
+                instance->flags = (cell.attrs & AttrUnderline) ? FlagUnderline : 0;
+                
+                // The cell after a double-width character shows the right half
+                // of its glyph
+                if (wideGlyph != 0) {
+                    instance->glyph = wideGlyph;
+                    instance->flags |= FlagRightHalf;
+                    wideGlyph = 0;
+                    continue;
+                }
+                
+                bool wide = unicode::width(cell.codepoint) == 2;
+                instance->glyph = m_atlas->slot(cell.codepoint, GlyphCache::styleFor(cell), wide);
+                if (wide) {
+                    wideGlyph = instance->glyph;
+                }
+            }
+        }
+        
+        // Search matches are drawn on their highlight color
+        for (const CellHighlight &highlight : m_highlights) {
+            if (highlight.row >= rows) {
+                continue;
+            }
+            for (int x = highlight.firstCol; x <= std::min(highlight.lastCol, cols - 1); x++) {
+                CellInstance &cell = m_instances[size_t(highlight.row) * cols + x];
+                cell.bg = highlight.color();
+                cell.fg = m_screen->color(ColorDefaultBg);
+            }
+        }
+        
+        // Block cursor: the cell under it is drawn in inverted colors
+        int cursorY = m_screen->cursorY() + m_scrollOffset;
+        if (m_cursorShown && m_screen->cursorVisible() && cursorY < rows && m_screen->cursorX() < cols) {
+            CellInstance &cursor = m_instances[size_t(cursorY) * cols + m_screen->cursorX()];
+            cursor.bg = m_cursorColor;
+            cursor.fg = m_screen->color(ColorDefaultBg);
+            cursor.flags &= ~FlagUnderline;
+        }
+        
+        return m_atlas->generation() == atlasGeneration;
+    }
+    
+    const TerminalScreen *m_screen;
+    GlyphCache *m_glyphCache;
+    int m_charWidth;
+    int m_charHeight;
+    int m_ascent;
+    uint32_t m_cursorColor;
+    int m_scrollOffset;
+    bool m_cursorShown;
+    std::vector<CellHighlight> m_highlights;
+    bool m_ready;                       // GL objects created successfully
+    qint64 m_paintTime;
+    std::shared_ptr<GlyphAtlas> m_atlas;
+    
+    QOpenGLShaderProgram m_program;
+    QOpenGLVertexArrayObject m_vao;
+    QOpenGLBuffer m_cornerBuffer;       // The unit quad
+    QOpenGLBuffer m_instanceBuffer;     // One CellInstance per cell, rewritten every frame
+    std::vector<CellInstance> m_instances;
+};
+
+// Counters for the hot paths of one session, kept per second for the last
+// kSeconds seconds, so a slow spell can still be read off after it is over.
+// Times are in nanoseconds.
+class PerfCounters {
+public:
+    static const int kSeconds = 60;
+    
+    struct Second {
+        qint64 second;                  // monotonicNs() in whole seconds
+        qint64 bytesRead;
+        qint64 parseTime;               // In the parser, summed over GUI wakeups
+        qint64 maxParseTime;
+        int paints;
+        qint64 paintTime;
+        qint64 maxPaintTime;
+        qint64 cellsPainted;
+        int frames;                     // Presented by the frame pacing
+        int droppedFrames;              // Frame intervals missed while a frame was due
+        int latencySamples;
+        qint64 latency;                 // From the PTY read to the paint showing it
+        qint64 maxLatency;
+    };
+    
+    PerfCounters() {
+        for (Second &slot : m_seconds) {
+            clear(&slot, -1);
+        }
+    }
+    
+    static qint64 now() {
+        return monotonicNs() / 1000000000;
+    }
+    
+    void addParse(qint64 bytes, qint64 time) {
+        Second &slot = current();
+        slot.bytesRead += bytes;
+        slot.parseTime += time;
+        slot.maxParseTime = qMax(slot.maxParseTime, time);
+    }
+    
+    void addPaint(qint64 time, qint64 cells) {
+        Second &slot = current();
+        slot.paints++;
+        slot.paintTime += time;
+        slot.maxPaintTime = qMax(slot.maxPaintTime, time);
+        slot.cellsPainted += cells;
+    }
+    
+    void addFrame(int dropped) {
+        Second &slot = current();
+        slot.frames++;
+        slot.droppedFrames += dropped;
+    }
+    
+    void addLatency(qint64 latency) {
+        Second &slot = current();
+        slot.latencySamples++;
+        slot.latency += latency;
+        slot.maxLatency = qMax(slot.maxLatency, latency);
+    }
+    
+    // The counters of one second, all zero if nothing happened in it or it
+    // has gone out of the window
+    Second at(qint64 second) const {
+        const Second &slot = m_seconds[second % kSeconds];
+        if (slot.second == second) {
+            return slot;
+        }
+        Second empty;
+        clear(&empty, second);
+        return empty;
+    }
+    
+    // The whole window, oldest second first
+    QJsonArray toJson() const {
+        QJsonArray seconds;
+        qint64 latest = now();
+        for (qint64 second = latest - kSeconds + 1; second <= latest; second++) {
+            Second slot = at(second);
+            QJsonObject entry;
+            entry["secondsAgo"] = int(latest - second);
+            entry["bytesRead"] = slot.bytesRead;
+            entry["parseMs"] = slot.parseTime / 1e6;
+            entry["maxParseMs"] = slot.maxParseTime / 1e6;
+            entry["paints"] = slot.paints;
+            entry["paintMs"] = slot.paintTime / 1e6;
+            entry["maxPaintMs"] = slot.maxPaintTime / 1e6;
+            entry["cellsPainted"] = slot.cellsPainted;
+            entry["frames"] = slot.frames;
+            entry["droppedFrames"] = slot.droppedFrames;
+            entry["latencySamples"] = slot.latencySamples;
+            entry["latencyMs"] = slot.latencySamples ? slot.latency / 1e6 / slot.latencySamples : 0.0;
+            entry["maxLatencyMs"] = slot.maxLatency / 1e6;
+            seconds.append(entry);
+        }
+        return seconds;
+    }
+    
+private:
+    static void clear(Second *slot, qint64 second) {
+        memset(slot, 0, sizeof(*slot));
+        slot->second = second;
+    }
+    
+    // The slot of the current second, reused from kSeconds ago if need be
+    Second &current() {
+        qint64 second = now();
+        Second &slot = m_seconds[second % kSeconds];
+        if (slot.second != second) {
+            clear(&slot, second);
+        }
+        return slot;
+    }
+    
+    Second m_seconds[kSeconds];
+};
+
+// Overlay showing the last full second of a session's PerfCounters,
+// refreshed once a second. It paints every pixel it covers, so refreshing it
+// never repaints the terminal underneath.
+class PerfHud : public QWidget {
+public:
+    PerfHud(const PerfCounters *counters, const QFont &font, QWidget *parent)
+        : QWidget(parent), m_counters(counters) {
+        setAttribute(Qt::WA_OpaquePaintEvent);
+        setAttribute(Qt::WA_TransparentForMouseEvents);
+        setFocusPolicy(Qt::NoFocus);
+        setFont(font);
+        
+        QFontMetrics metrics(font);
+        m_lineHeight = metrics.height();
+        setFixedSize(metrics.horizontalAdvance('M') * kColumns + 2 * kMargin, m_lineHeight * kLines + 2 * kMargin);
+        
+        m_refreshTimer = new QTimer(this);
+        m_refreshTimer->setInterval(1000);
+        connect(m_refreshTimer, &QTimer::timeout, this, [this]() {
+            update();
+        });
+        m_refreshTimer->start();
+    }
+    
+    // Shown on the last line, in place of the key hint
+    void setNote(const QString &note) {
+        m_note = note;
+        update();
+    }
+    
+protected:
+    void paintEvent(QPaintEvent *) override {
+        PerfCounters::Second last = m_counters->at(PerfCounters::now() - 1);
+        QString lines[kLines];
+        lines[0] = QString("read     %1 MB/s").arg(last.bytesRead / 1e6, 0, 'f', 2);
+        lines[1] = QString("parse    %1 ms/s, longest %2 ms")
+            .arg(last.parseTime / 1e6, 0, 'f', 1).arg(last.maxParseTime / 1e6, 0, 'f', 1);
+        lines[2] = QString("paint    %1 x %2 ms, longest %3 ms").arg(last.paints)
+            .arg(last.paints ? last.paintTime / 1e6 / last.paints : 0.0, 0, 'f', 2).arg(last.maxPaintTime / 1e6, 0, 'f', 1);
+        lines[3] = QString("cells    %1 painted").arg(last.cellsPainted);
+        lines[4] = QString("frames   %1, %2 dropped").arg(last.frames).arg(last.droppedFrames);
+        if (last.latencySamples > 0) {
+            lines[5] = QString("latency  %1 ms, longest %2 ms")
+                .arg(last.latency / 1e6 / last.latencySamples, 0, 'f', 1).arg(last.maxLatency / 1e6, 0, 'f', 1);
+        } else {
+            lines[5] = "latency  -";
+        }
+        lines[6] = m_note.isEmpty() ? QString("Ctrl+Shift+J saves JSON") : m_note;
+        
+        QPainter painter(this);
+        painter.fillRect(rect(), QColor(29, 32, 33));
+        painter.setPen(QColor(235, 219, 178));
+        QFontMetrics metrics(font());
+        int textWidth = width() - 2 * kMargin;
+        for (int i = 0; i < kLines; i++) {
+            painter.drawText(kMargin, kMargin + i * m_lineHeight + metrics.ascent(),
+                             metrics.elidedText(lines[i], Qt::ElideLeft, textWidth));
+        }
+    }
+    
+private:
+    static const int kLines = 7;
+    static const int kColumns = 40;
+    static const int kMargin = 6;
+    
+    const PerfCounters *m_counters;
+    QTimer *m_refreshTimer;
+    QString m_note;
+    int m_lineHeight;
+};
+
+// Reaps the shells this process forks. A pid stays ours until it has been
+// waited for, so a child is only signalled before it is reaped, never after
+// the kernel could have given its pid to another process. A child that is
+// terminated before it exits is reaped on the SIGCHLD that follows: the
+// handler writes to a pipe the GUI thread watches.
+class ChildReaper : public QObject {
+    Q_OBJECT
+
+public:
+    ChildReaper() : m_notifier(nullptr) {
+        s_instance = this;
+        if (pipe2(s_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+            qDebug() << "Failed to create SIGCHLD pipe: " << strerror(errno);
+            s_pipe[0] = s_pipe[1] = -1;
+            return;
+        }
+        m_notifier = new QSocketNotifier(s_pipe[0], QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), this, SLOT(reapPending()));
+        
+        struct sigaction childAction;
+        memset(&childAction, 0, sizeof(childAction));
+        childAction.sa_handler = childExited;
+        childAction.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigemptyset(&childAction.sa_mask);
+        sigaction(SIGCHLD, &childAction, nullptr);
+    }
+    
+    ~ChildReaper() {
+        signal(SIGCHLD, SIG_DFL);
+        delete m_notifier;
+        if (s_pipe[0] >= 0) {
+            ::close(s_pipe[0]);
+            ::close(s_pipe[1]);
+        }
+        s_instance = nullptr;
+    }
+    
+    // Reap pid if it has exited. True once it is no longer ours.
+    static bool reap(pid_t pid) {
+        pid_t result;
+        do {
+            result = waitpid(pid, nullptr, WNOHANG);
+        } while (result < 0 && errno == EINTR);
+        return result == pid || (result < 0 && errno == ECHILD);
+    }
+    
+    // Ask pid to exit, and reap it now or once it has
+    static void terminate(pid_t pid) {
+        kill(pid, SIGTERM);
+        if (!reap(pid) && s_instance) {
+            s_instance->m_pending.push_back(pid);
+        }
+    }
+    
+private slots:
+    void reapPending() {
+        char buffer[64];
+        while (read(s_pipe[0], buffer, sizeof(buffer)) > 0) {
+        }
+        m_pending.erase(std::remove_if(m_pending.begin(), m_pending.end(), reap), m_pending.end());
+    }
+    
+private:
+    static void childExited(int) {
+        int savedErrno = errno;
+        ssize_t ignored = write(s_pipe[1], "", 1);
+        (void)ignored;
+        errno = savedErrno;
+    }
+    
+    static ChildReaper *s_instance;
+    static int s_pipe[2];
+    
+    QSocketNotifier *m_notifier;
+    std::vector<pid_t> m_pending;
+};
+
+ChildReaper *ChildReaper::s_instance = nullptr;
+int ChildReaper::s_pipe[2] = {-1, -1};
+
+// A shell on a pseudo-terminal, owned by the session that shows it. A pid
+// and fd of -1 stand for no child at all.
+struct ShellProcess {
+    pid_t pid;
+    int masterFd;
+};
+
+// Starts the shells of new sessions. A pool that keeps a spare forks the
+// next shell ahead of time, so a session opened in the same directory adopts
+// one that has already started up and printed its prompt. The prompt waits
+// in the PTY until then, and is drawn again once the session tells the shell
+// its size.
+class ShellPool {
+public:
+    ShellPool() : m_keepSpare(false) {
+        m_spare.pid = -1;
+        m_spare.masterFd = -1;
+        m_refillTimer.setSingleShot(true);
+        QObject::connect(&m_refillTimer, &QTimer::timeout, &m_refillTimer, [this]() {
+            if (m_keepSpare && m_spare.masterFd < 0) {
+                m_spare = spawn(m_spareDirectory);
+            }
+        });
+    }
+    
+    ~ShellPool() {
+        discardSpare();
+    }
+    
+    // Keep a shell forked in directory, or in the current directory if it
+    // is empty, until a session takes it
+    void setKeepSpare(bool keep, const QByteArray &directory = QByteArray()) {
+        discardSpare();
+        m_keepSpare = keep;
+        m_spareDirectory = directory;
+        if (keep) {
+            m_refillTimer.start(0);
+        }
+    }
+    
+    // A shell for a new session, started in directory
+    ShellProcess take(const QByteArray &directory) {
+        ShellProcess shell;
+        if (m_spare.masterFd >= 0 && directory == m_spareDirectory && spareAlive()) {
+            shell = m_spare;
+            m_spare.pid = -1;
+            m_spare.masterFd = -1;
+        } else {
+            discardSpare();
+            shell = spawn(directory);
+        }
+        
+        // The next one is likely opened in the same place. It is forked once
+        // the event loop is back, after this session has been shown.
+        if (m_keepSpare) {
+            m_spareDirectory = directory;
+            m_refillTimer.start(0);
+        }
+        return shell;
+    }
+
+private:
+    static ShellProcess spawn(const QByteArray &directory) {
+        // The reactor and search threads keep running while the child is
+        // forked, and any lock they held stays locked in it, so between fork
+        // and exec the child only makes async-signal-safe calls. Everything
+        // it needs - the arguments, the environment and its error messages -
+        // is made here, before forking.
+        const char *shell = getenv("SHELL");
+        if (!shell) shell = "/bin/bash";
+        const char *workingDirectory = directory.isEmpty() ? nullptr : directory.constData();
+        
+        // The environment with TERM set, and for ZSH a prompt that does not
+        // display % at the end
+        bool zsh = strstr(shell, "zsh") != nullptr;
+        std::vector<QByteArray> variables;
+        for (char **variable = environ; *variable; variable++) {
+            if (strncmp(*variable, "TERM=", 5) != 0 && !(zsh && strncmp(*variable, "PROMPT=", 7) == 0)) {
+                variables.push_back(QByteArray(*variable));
+            }
+        }
+        variables.push_back("TERM=xterm-256color");
+        if (zsh) {
+            variables.push_back("PROMPT=%~ $ ");
+        }
+        std::vector<char *> envp;
+        for (QByteArray &variable : variables) {
+            envp.push_back(variable.data());
+        }
+        envp.push_back(nullptr);
+        
+        QByteArray shellPath(shell);
+        char *argv[] = {shellPath.data(), const_cast<char *>("-l"), nullptr};
+        QByteArray chdirFailed = "korzeterm: cannot change to " + directory + "\r\n";
+        QByteArray execFailed = "korzeterm: cannot run " + shellPath + "\r\n";
+        
+        // Create a pseudo-terminal, 80x24 until the session sends its size
+        ShellProcess process;
+        struct winsize ws;
+        memset(&ws, 0, sizeof(ws));
+        ws.ws_col = 80;
+        ws.ws_row = 24;
+        process.pid = forkpty(&process.masterFd, nullptr, nullptr, &ws);
+        
+        if (process.pid == -1) {
+            // Fork failed
+            qDebug() << "Failed to fork PTY: " << strerror(errno);
+            process.masterFd = -1;
+            return process;
+        } else if (process.pid == 0) {
+            // Child process - execute the shell
+            if (workingDirectory && chdir(workingDirectory) != 0) {
+                ssize_t ignored = write(STDERR_FILENO, chdirFailed.constData(), chdirFailed.size());
+                (void)ignored;
+            }
+            execve(argv[0], argv, envp.data());
+            
+            // If execve returns, there was an error. _exit() skips the
+            // parent's atexit handlers and stdio buffers.
+            ssize_t ignored = write(STDERR_FILENO, execFailed.constData(), execFailed.size());
+            (void)ignored;
+            _exit(127);
+        }
+        
+        // Parent process continues here
+        // Set the PTY to non-blocking mode, and keep it out of the shells
+        // forked after it, which would otherwise hold it open
+        int flags = fcntl(process.masterFd, F_GETFL, 0);
+        fcntl(process.masterFd, F_SETFL, flags | O_NONBLOCK);
+        fcntl(process.masterFd, F_SETFD, FD_CLOEXEC);
+        return process;
+    }
+    
+    // Whether the spare is still running with its PTY open. waitpid() reaps
+    // one that has exited, which leaves nothing for discardSpare() to signal.
+    bool spareAlive() {
+        if (waitpid(m_spare.pid, nullptr, WNOHANG) != 0) {
+            m_spare.pid = -1;
+            return false;
+        }
+        struct pollfd hangup;
+        hangup.fd = m_spare.masterFd;
+        hangup.events = 0;
+        hangup.revents = 0;
+        return poll(&hangup, 1, 0) == 0;
+    }
+    
+    void discardSpare() {
+        if (m_spare.masterFd >= 0) {
+            ::close(m_spare.masterFd);
+        }
+        if (m_spare.pid > 0) {
+            ChildReaper::terminate(m_spare.pid);
+        }
+        m_spare.pid = -1;
+        m_spare.masterFd = -1;
+    }
+    
+    bool m_keepSpare;
+    ShellProcess m_spare;
+    QByteArray m_spareDirectory;
+    QTimer m_refillTimer;
+};
+
+// One terminal session: a child process on a PTY and its view. Sessions in
+// the same process share the glyph cache and the PTY reactor thread.
+class TerminalWidget : public QWidget {
+    Q_OBJECT
+
+public:
+    TerminalWidget(GlyphCache *glyphCache, PtyReactor *reactor, ShellProcess shell, QWidget *parent = nullptr)
+        : QWidget(parent), m_glyphCache(glyphCache), m_childPid(shell.pid), m_masterFd(shell.masterFd) {
+        // Set up appearance
+        setAttribute(Qt::WA_OpaquePaintEvent);
+        setFocusPolicy(Qt::StrongFocus);
+        
+        // Font metrics for character dimensions
+        m_font = m_glyphCache->font(0);
+        m_fontMetrics = new QFontMetrics(m_font);
+        m_charWidth = m_fontMetrics->horizontalAdvance('M');
+        m_charHeight = m_fontMetrics->height();
+        
+        // View state; the screen itself starts out 80x24
+        m_scrollOffset = 0;
+        m_fullRepaint = true;
+        m_paintedCursorX = 0;
+        m_paintedCursorY = 0;
+        m_cursorColor = QColor(235, 219, 178);
+        m_cursorBlinkOn = true;
+        m_glView = nullptr;
+        
+        // Performance counters are only kept while the HUD is shown
+        m_perf = nullptr;
+        m_perfHud = nullptr;
+        m_unpresentedReadTime = 0;
+        m_presentedReadTime = 0;
+        
+        // The reactor thread reads the PTY; the GUI thread is only woken when
+        // it has handed over new data, so idle sessions never wake up
+        m_ptyChannel = nullptr;
+        m_writeNotifier = nullptr;
+        m_writeOffset = 0;
+        m_finished = false;
+        if (m_masterFd >= 0) {
+            m_ptyChannel = reactor->open(m_masterFd);
+            connect(m_ptyChannel, &PtyChannel::dataAvailable, this, &TerminalWidget::readFromPty);
+            
+            // Input the PTY cannot take yet waits until it becomes writable
+            m_writeNotifier = new QSocketNotifier(m_masterFd, QSocketNotifier::Write, this);
+            m_writeNotifier->setEnabled(false);
+            connect(m_writeNotifier, SIGNAL(activated(int)), this, SLOT(flushWriteQueue()));
+        }
+        
+        // Scrollback search: the bar sits at the top right and queries run
+        // on a worker thread, started by the first search
+        m_currentMatch = -1;
+        m_searcher = nullptr;
+        m_searchBar = new QLineEdit(this);
+        m_searchBar->setPlaceholderText("Search scrollback");
+        m_searchBar->hide();
+        m_searchBar->installEventFilter(this);
+        connect(m_searchBar, &QLineEdit::textChanged, this, &TerminalWidget::startSearch);
+        
+        // Cursor blink timer, running only while the session has the focus
+        m_cursorBlinkTimer = new QTimer(this);
+        m_cursorBlinkTimer->setInterval(500);
+        connect(m_cursorBlinkTimer, &QTimer::timeout, this, [this]() {
+            setCursorShown(!m_cursorBlinkOn);
+        });
+        
+        // Frame pacing: parsing runs as fast as output arrives, presenting is
+        // capped to one frame per refresh interval
+        m_maxFrameRate = 0;
+        m_frameTimer = new QTimer(this);
+        m_frameTimer->setSingleShot(true);
+        m_frameTimer->setTimerType(Qt::PreciseTimer);
+        connect(m_frameTimer, &QTimer::timeout, this, &TerminalWidget::presentFrame);
+        m_frameClock.start();
+        m_lastFrameTime = -1000;
+        m_frameRequestTime = -1;
+        
+        // Synchronized output (mode 2026) that is never ended is shown anyway
+        // after a while
+        m_syncTimer = new QTimer(this);
+        m_syncTimer->setSingleShot(true);
+        m_syncTimer->setInterval(kSyncTimeout);
+        connect(m_syncTimer, &QTimer::timeout, this, [this]() {
+            m_screen.endSynchronizedUpdate();
+            requestFrame();
+        });
+        
+        // Window size updates to the child are coalesced while resizing
+        m_sentCols = 0;
+        m_sentRows = 0;
+        m_winsizeTimer = new QTimer(this);
+        m_winsizeTimer->setSingleShot(true);
+        m_winsizeTimer->setInterval(kWinsizeDelay);
+        connect(m_winsizeTimer, &QTimer::timeout, this, &TerminalWidget::sendWindowSize);
+    }
+    
+    ~TerminalWidget() {
+        // Stop reading and writing before the fd goes away
+        delete m_ptyChannel;
+        delete m_writeNotifier;
+        delete m_searcher;
+        delete m_glView;
+        delete m_perf;
+        
+        // A shell that has not exited yet is reaped once it does
+        if (m_childPid > 0) {
+            ChildReaper::terminate(m_childPid);
+            m_childPid = -1;
+        }
+        
+        if (m_masterFd >= 0) {
+            ::close(m_masterFd);  // Use global namespace for ::close to avoid QWidget::close
+        }
+        
+        delete m_fontMetrics;
+    }
+    
+    // Cap presentation at fps frames per second, 0 follows the display refresh rate
+    void setMaxFrameRate(int fps) {
+        m_maxFrameRate = qMax(0, fps);
+    }
+    
+    // Cap the scrollback history by line count and by memory
+    void setScrollbackLimits(int maxLines, int maxMegabytes) {
+        m_screen.scrollback().setLimits(maxLines, size_t(qMax(0, maxMegabytes)) * 1024 * 1024);
+        m_scrollOffset = qMin(m_scrollOffset, m_screen.scrollback().size());
+        m_fullRepaint = true;
+        flushDamage();
+    }
+    
+    // Present through OpenGL instead of QPainter. Returns false, leaving the
+    // software renderer in place, if no suitable context can be created.
+    bool setOpenGLRenderer(bool enabled) {
+        if (enabled == (m_glView != nullptr)) {
+            return true;
+        }
+        
+        if (!enabled) {
+            delete m_glView;
+            m_glView = nullptr;
+        } else {
+            if (!GlTerminalView::isSupported()) {
+                return false;
+            }
+            m_glView = new GlTerminalView(&m_screen, m_glyphCache, this);
+            m_glView->setCellMetrics(m_charWidth, m_charHeight, m_fontMetrics->ascent());
+            m_glView->setCursorColor(m_cursorColor);
+            m_glView->setGeometry(rect());
+            m_glView->show();
+            connect(m_glView, &QOpenGLWidget::frameSwapped, this, [this]() {
+                recordPaint(m_glView->lastPaintTime(), m_glView->lastPaintCells());
+            });
+            if (m_perfHud) {
+                m_perfHud->raise();
+            }
+        }
+        
+        m_fullRepaint = true;
+        flushDamage();
+        return true;
+    }
+    
+    // Parse output as if the child had written it and turn the damage into
+    // repaint requests, as presenting a frame would
+    void replay(const char *data, int length) {
+        m_screen.feed(data, length);
+        flushDamage();
+    }
+    
+    // Keep performance counters and show them over the terminal, for finding
+    // out where the time goes when it is slow. Hiding the HUD drops them.
+    void setPerfHudShown(bool shown) {
+        if (shown == (m_perf != nullptr)) {
+            return;
+        }
+        
+        if (!shown) {
+            delete m_perfHud;
+            m_perfHud = nullptr;
+            delete m_perf;
+            m_perf = nullptr;
+        } else {
+            m_perf = new PerfCounters();
+            m_unpresentedReadTime = 0;
+            m_presentedReadTime = 0;
+            m_perfHud = new PerfHud(m_perf, m_font, this);
+            positionPerfHud();
+            m_perfHud->show();
+            m_perfHud->raise();
+        }
+    }
+    
+signals:
+    // The child has exited and all of its output has been shown
+    void finished();
+    
+protected:
+    void paintEvent(QPaintEvent *event) override {
+        qint64 paintStart = m_perf ? monotonicNs() : 0;
+        qint64 cellsPainted = 0;
+        QPainter painter(this);
+        painter.setFont(m_font);
+        m_penColor = -1;
+        
+        // Repaint only the damaged rectangles, one cell range at a time
+        for (const QRect &rect : event->region()) {
+            painter.setClipRect(rect);
+            painter.fillRect(rect, color(ColorDefaultBg));
+            
+            int firstRow = qMax(0, rect.top() / m_charHeight);
+            int lastRow = qMin(m_screen.rows() - 1, rect.bottom() / m_charHeight);
+            int firstCol = qMax(0, rect.left() / m_charWidth);
+            int lastCol = qMin(m_screen.cols() - 1, rect.right() / m_charWidth);
+            paintCells(painter, firstRow, lastRow, firstCol, lastCol);
+            cellsPainted += qMax(0, lastRow - firstRow + 1) * qMax(0, lastCol - firstCol + 1);
+        }
+        
+        // Search matches in view, laid over the text
+        std::vector<CellHighlight> highlights = visibleHighlights();
+        if (!highlights.empty()) {
+            painter.setClipRegion(event->region());
+            for (const CellHighlight &highlight : highlights) {
+                QColor highlightColor = QColor::fromRgb(highlight.color());
+                highlightColor.setAlpha(120);
+                painter.fillRect(highlight.firstCol * m_charWidth, highlight.row * m_charHeight,
+                                 (highlight.lastCol - highlight.firstCol + 1) * m_charWidth, m_charHeight,
+                                 highlightColor);
+            }
+        }
+        painter.setClipping(false);
+        
+        // Draw cursor
+        int cursorX = m_screen.cursorX();
+        int cursorY = m_screen.cursorY();
+        if (m_cursorBlinkOn && m_screen.cursorVisible() &&
+            cursorY + m_scrollOffset < m_screen.rows() && cursorX < m_screen.cols()) {
+            painter.fillRect(cursorRect(), m_cursorColor);
+            
+            // Draw character under cursor with inverted colors
+            const TermCell &cursorChar = m_screen.line(cursorY)[cursorX];
+            QFont cursorFont = m_font;
+            
+            if (cursorChar.attrs & AttrBold) {
+                cursorFont.setBold(true);
+            }
+            if (cursorChar.attrs & AttrItalic) {
+                cursorFont.setItalic(true);
+            }
+            
+            painter.setFont(cursorFont);
+            painter.setPen(color(ColorDefaultBg));
+            painter.drawText(cursorX * m_charWidth, 
+                            (cursorY + m_scrollOffset) * m_charHeight + m_fontMetrics->ascent(), 
+                            cellText(cursorChar));
+        }
+        
+        if (m_perf && !m_glView) {
+            recordPaint(monotonicNs() - paintStart, cellsPainted);
+        }
+    }
+    
+    // Only the focused session blinks; the others show a steady cursor and
+    // keep no timer running
+    void focusInEvent(QFocusEvent *event) override {
+        QWidget::focusInEvent(event);
+        m_cursorBlinkTimer->start();
+        setCursorShown(true);
+    }
+    
+    void focusOutEvent(QFocusEvent *event) override {
+        QWidget::focusOutEvent(event);
+        m_cursorBlinkTimer->stop();
+        setCursorShown(true);
+    }
+    
+    void keyPressEvent(QKeyEvent *event) override {
+        // Only process if we have a valid master file descriptor
+        if (m_masterFd < 0) {
+            return;
+        }
+        
+        // Shift+PageUp/PageDown page through the scrollback
+        if (event->modifiers() & Qt::ShiftModifier) {
+            if (event->key() == Qt::Key_PageUp) {
+                scrollView(m_screen.rows() - 1);
+                return;
+            } else if (event->key() == Qt::Key_PageDown) {
+                scrollView(-(m_screen.rows() - 1));
+                return;
+            }
+        }
+        
+        // Ctrl+Shift+F searches the scrollback
+        Qt::KeyboardModifiers shortcutModifiers = Qt::ControlModifier | Qt::ShiftModifier;
+        if (event->key() == Qt::Key_F && (event->modifiers() & shortcutModifiers) == shortcutModifiers) {
+            openSearch();
+            return;
+        }
+        
+        // Ctrl+Shift+P toggles the performance HUD, Ctrl+Shift+J saves its
+        // counters
+        if (event->key() == Qt::Key_P && (event->modifiers() & shortcutModifiers) == shortcutModifiers) {
+            setPerfHudShown(!m_perf);
+            return;
+        }
+        if (event->key() == Qt::Key_J && (event->modifiers() & shortcutModifiers) == shortcutModifiers) {
+            savePerfCounters();
+            return;
+        }
+        
+        // Ctrl+Shift+V and Shift+Insert paste the clipboard
+        if ((event->key() == Qt::Key_V && (event->modifiers() & shortcutModifiers) == shortcutModifiers) ||
+            (event->key() == Qt::Key_Insert && (event->modifiers() & Qt::ShiftModifier))) {
+            pasteText(QGuiApplication::clipboard()->text());
+            return;
+        }
+        
+        QByteArray data;
+        
+        // Handle special keys
+        switch (event->key()) {
+            case Qt::Key_Return:
+            case Qt::Key_Enter:
+                data = "\r";
+                break;
+                
+            case Qt::Key_Backspace:
+                data = "\x7f"; // ASCII DEL
+                break;
+                
+            case Qt::Key_Tab:
+                data = "\t";
+                break;
+                
+            case Qt::Key_Up:
+                data = "\x1b[A"; // ANSI escape sequence for up arrow
+                break;
+                
+            case Qt::Key_Down:
+                data = "\x1b[B"; // ANSI escape sequence for down arrow
+                break;
+                
+            case Qt::Key_Right:
+                data = "\x1b[C"; // ANSI escape sequence for right arrow
+                break;
+                
+            case Qt::Key_Left:
+                data = "\x1b[D"; // ANSI escape sequence for left arrow
+                break;
+                
+            case Qt::Key_Home:
+                data = "\x1b[H"; // ANSI escape sequence for home
+                break;
+                
+            case Qt::Key_End:
+                data = "\x1b[F"; // ANSI escape sequence for end
+                break;
+                
+            case Qt::Key_PageUp:
+                data = "\x1b[5~"; // Page Up
+                break;
+                
+            case Qt::Key_PageDown:
+                data = "\x1b[6~"; // Page Down
+                break;
+                
+            case Qt::Key_Delete:
+                data = "\x1b[3~"; // Delete
+                break;
+
+            case Qt::Key_C:
+                if (event->modifiers() & Qt::ControlModifier) {
+                    // Ctrl+C - send SIGINT
+                    data = QByteArray(1, 3); // ASCII ETX (End of Text)
+                    m_screen.clearPendingNewline(); // Clear any pending newline to avoid issues
+                } else {
+                    data = event->text().toUtf8();
+                }
+                break;
+                
+            default:
+                if (event->modifiers() & Qt::ControlModifier) {
+                    if (event->key() >= Qt::Key_A && event->key() <= Qt::Key_Z) {
+                        // Control key combinations (Ctrl+A through Ctrl+Z)
+                        char ch = event->key() - Qt::Key_A + 1;
+                        data = QByteArray(1, ch);
+                    } else if (event->key() == Qt::Key_BracketLeft) {
+                        // Ctrl+[
+                        data = QByteArray(1, '\x1b');
+                    }
+                } else {
+                    // Normal text input
+                    data = event->text().toUtf8();
+                }
+        }
+        
+        // Send data to the PTY
+        if (!data.isEmpty()) {
+            // Typing jumps back to the live screen
+            if (m_scrollOffset > 0) {
+                scrollView(-m_scrollOffset);
+            }
+            sendToPty(data);
+        }
+    }
+    
+    // Keys for the search bar: Enter moves to the next older match,
+    // Shift+Enter to the next newer one and Escape closes the search
+    bool eventFilter(QObject *watched, QEvent *event) override {
+        if (watched == m_searchBar && event->type() == QEvent::KeyPress) {
+            QKeyEvent *keyEvent = static_cast<QKeyEvent *>(event);
+            if (keyEvent->key() == Qt::Key_Escape) {
+                closeSearch();
+                return true;
+            }
+            if (keyEvent->key() == Qt::Key_Return || keyEvent->key() == Qt::Key_Enter) {
+                moveToMatch((keyEvent->modifiers() & Qt::ShiftModifier) ? -1 : 1);
+                return true;
+            }
+        }
+        return QWidget::eventFilter(watched, event);
+    }
+    
+    void wheelEvent(QWheelEvent *event) override {
+        // Three lines per wheel notch, positive is back into the history
+        int lines = event->angleDelta().y() / 40;
+        if (lines != 0) {
+            scrollView(lines);
+        }
+        event->accept();
+    }
+    
+    void resizeEvent(QResizeEvent *event) override {
+        QWidget::resizeEvent(event);
+        
+        if (m_glView) {
+            m_glView->setGeometry(rect());
+        }
+        positionSearchBar();
+        positionPerfHud();
+        
+        // Calculate the new terminal dimensions
+        int newCols = event->size().width() / m_charWidth;
+        int newRows = event->size().height() / m_charHeight;
+        
+        // Make sure we have at least 1x1 dimensions
+        newCols = qMax(1, newCols);
+        newRows = qMax(1, newRows);
+        
+        // Check if the dimensions actually changed
+        if (newCols != m_screen.cols() || newRows != m_screen.rows()) {
+            // Resize the terminal buffer; the history reflows as it is read
+            m_screen.resize(newRows, newCols);
+            m_scrollOffset = qMin(m_scrollOffset, m_screen.scrollback().size());
+            flushDamage();
+            
+            // The child hears about the size once a drag has settled, so it
+            // redraws once rather than for every step. The first size goes
+            // out straight away.
+            if (m_sentCols == 0) {
+                sendWindowSize();
+            } else {
+                m_winsizeTimer->start();
+            }
+        }
+    }
+    
+private:
+    // Queue input for the child. The PTY is non-blocking, so whatever it
+    // does not take right away is sent once it is writable again; keys
+    // typed in the meantime are coalesced into that write.
+    void sendToPty(const QByteArray &data) {
+        if (m_masterFd < 0 || data.isEmpty()) {
+            return;
+        }
+        m_writeQueue.append(data);
+        if (!m_writeNotifier->isEnabled()) {
+            flushWriteQueue();
+        }
+    }
+    
+    // Send clipboard text as typed input. Line breaks become CR as the
+    // Enter key sends them, and the text is bracketed if the application
+    // asked for it (mode 2004).
+    void pasteText(const QString &text) {
+        QByteArray data = text.toUtf8();
+        data.replace("\r\n", "\r");
+        data.replace('\n', '\r');
+        if (m_screen.bracketedPaste()) {
+            // An end marker inside the text would let it out of the paste early
+            data.replace("\x1b[201~", "");
+            data.prepend("\x1b[200~");
+            data.append("\x1b[201~");
+        }
+        
+        if (m_scrollOffset > 0) {
+            scrollView(-m_scrollOffset);
+        }
+        sendToPty(data);
+    }
+    
+    void setCursorShown(bool shown) {
+        m_cursorBlinkOn = shown;
+        if (m_glView) {
+            m_glView->setView(m_scrollOffset, m_cursorBlinkOn);
+            m_glView->update();
+        } else {
+            update(cursorRect());
+        }
+    }
+    
+    void positionSearchBar() {
+        int barWidth = qMin(320, width());
+        m_searchBar->setGeometry(width() - barWidth, 0, barWidth, m_searchBar->sizeHint().height());
+    }
+    
+    // The HUD sits in the bottom right corner, clear of the search bar
+    void positionPerfHud() {
+        if (m_perfHud) {
+            m_perfHud->move(qMax(0, width() - m_perfHud->width()), qMax(0, height() - m_perfHud->height()));
+        }
+    }
+    
+    // A paint has finished: count it, and how long the output it shows took
+    // from the PTY to the screen
+    void recordPaint(qint64 time, qint64 cells) {
+        if (!m_perf) {
+            return;
+        }
+        m_perf->addPaint(time, cells);
+        if (m_presentedReadTime != 0) {
+            m_perf->addLatency(monotonicNs() - m_presentedReadTime);
+            m_presentedReadTime = 0;
+        }
+    }
+    
+    // Write the counters, with the setup they were taken on, to a JSON file
+    // in the temporary directory
+    void savePerfCounters() {
+        if (!m_perf) {
+            return;
+        }
+        
+        QJsonObject root;
+        root["renderer"] = m_glView ? "opengl" : "qpainter";
+        root["cols"] = m_screen.cols();
+        root["rows"] = m_screen.rows();
+        root["frameIntervalMs"] = frameInterval();
+        root["maxFrameRate"] = m_maxFrameRate;
+        root["scrollbackLines"] = m_screen.scrollback().size();
+        root["seconds"] = m_perf->toJson();
+        
+        QString name = QString("korzeterm-perf-%1-%2.json")
+            .arg(m_childPid).arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"));
+        QFile file(QDir(QDir::tempPath()).filePath(name));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+            file.write(QJsonDocument(root).toJson()) < 0) {
+            qDebug() << "Failed to save performance counters: " << file.errorString();
+            m_perfHud->setNote("Saving failed: " + file.errorString());
+            return;
+        }
+        m_perfHud->setNote("Saved " + file.fileName());
+    }
+    
+    void openSearch() {
+        positionSearchBar();
+        m_searchBar->show();
+        m_searchBar->raise();
+        m_searchBar->setFocus();
+        m_searchBar->selectAll();
+    }
+    
+    void closeSearch() {
+        m_searchBar->hide();
+        if (m_searcher) {
+            m_searcher->cancel();
+        }
+        m_matches.clear();
+        m_currentMatch = -1;
+        setFocus();
+        m_fullRepaint = true;
+        flushDamage();
+    }
+    
+    // Every edit of the query starts a new search of the history as it is
+    // now; matches stream in through collectMatches()
+    void startSearch(const QString &text) {
+        m_matches.clear();
+        m_currentMatch = -1;
+        m_searchBar->setStyleSheet(QString());
+        if (text.isEmpty()) {
+            if (m_searcher) {
+                m_searcher->cancel();
+            }
+        } else {
+            if (!m_searcher) {
+                m_searcher = new ScrollbackSearcher(this);
+                connect(m_searcher, &ScrollbackSearcher::matchesAvailable, this, &TerminalWidget::collectMatches);
+                m_searcher->start();
+            }
+            QVector<uint> ucs4 = text.toUcs4();
+            std::vector<uint32_t> needle(ucs4.begin(), ucs4.end());
+            m_searcher->search(needle, m_screen.scrollback().searchSnapshot());
+        }
+        m_fullRepaint = true;
+        flushDamage();
+    }
+    
+    void collectMatches() {
+        bool finished = m_searcher->takeMatches(&m_matches);
         
-        // Use monospace font
-        m_font = QFontDatabase::systemFont(QFontDatabase::FixedFont);
-        m_font.setPointSize(10);
+        // Show the newest match as soon as there is one
+        if (m_currentMatch < 0 && !m_matches.empty()) {
+            m_currentMatch = 0;
+            revealMatch();
+        }
+        if (finished && m_matches.empty() && !m_searchBar->text().isEmpty()) {
+            m_searchBar->setStyleSheet("color: rgb(251, 73, 52);");
+        }
         
-        // Font metrics for character dimensions
-        m_fontMetrics = new QFontMetrics(m_font);
-        m_charWidth = m_fontMetrics->horizontalAdvance('M');
-        m_charHeight = m_fontMetrics->height();
+        m_fullRepaint = true;
+        requestFrame();
+    }
+    
+    // Step through the matches, positive directions going back in time
+    void moveToMatch(int direction) {
+        if (m_matches.empty()) {
+            return;
+        }
+        int count = int(m_matches.size());
+        m_currentMatch = ((m_currentMatch + direction) % count + count) % count;
+        revealMatch();
+        m_fullRepaint = true;
+        flushDamage();
+    }
+    
+    // Scroll the current match into view, to the middle if it was not
+    void revealMatch() {
+        const SearchMatch &match = m_matches[m_currentMatch];
+        const Scrollback &scrollback = m_screen.scrollback();
+        int row = scrollback.rowOf(match.line, match.column);
+        if (row < 0) {
+            return;
+        }
         
-        // Initialize terminal buffer
-        m_rows = 24;
-        m_cols = 80;
-        m_buffer.resize(m_rows);
-        for (int i = 0; i < m_rows; i++) {
-            m_buffer[i].resize(m_cols);
+        int top = scrollback.size() - m_scrollOffset;
+        if (row < top || row >= top + qMin(m_scrollOffset, m_screen.rows())) {
+            m_scrollOffset = qBound(1, scrollback.size() - row + m_screen.rows() / 2, scrollback.size());
+            m_fullRepaint = true;
+        }
+    }
+    
+    // Matches on the history rows in view, as cell spans
+    std::vector<CellHighlight> visibleHighlights() const {
+        std::vector<CellHighlight> highlights;
+        if (m_matches.empty()) {
+            return highlights;
         }
         
-        // Initialize color palette (xterm-256)
-        initializeColorPalette();
+        // m_matches is ordered newest first
+        struct NewerLine {
+            bool operator()(const SearchMatch &match, int64_t line) const { return match.line > line; }
+            bool operator()(int64_t line, const SearchMatch &match) const { return line > match.line; }
+        };
         
-        // Default colors
-        m_defaultFg = QColor(235, 219, 178);
-        m_defaultBg = QColor(40, 40, 40);
-        m_currentFg = m_defaultFg;
-        m_currentBg = m_defaultBg;
-        m_cursorColor = QColor(235, 219, 178);
+        const Scrollback &scrollback = m_screen.scrollback();
+        int historyRows = qMin(m_scrollOffset, m_screen.rows());
+        for (int y = 0; y < historyRows; y++) {
+            int length;
+            int64_t lineNumber;
+            int column;
+            scrollback.line(scrollback.size() - m_scrollOffset + y, &length, &lineNumber, &column);
+            
+            std::pair<std::vector<SearchMatch>::const_iterator, std::vector<SearchMatch>::const_iterator> range =
+                std::equal_range(m_matches.begin(), m_matches.end(), lineNumber, NewerLine());
+            for (std::vector<SearchMatch>::const_iterator it = range.first; it != range.second; ++it) {
+                int start = qMax(it->column, column);
+                int end = qMin(it->column + it->length, column + length);
+                if (start < end) {
+                    CellHighlight highlight;
+                    highlight.row = y;
+                    highlight.firstCol = start - column;
+                    highlight.lastCol = end - column - 1;
+                    highlight.current = (it - m_matches.begin()) == m_currentMatch;
+                    highlights.push_back(highlight);
+                }
+            }
+        }
+        return highlights;
+    }
+    
+    // Tell the child the current size, if it has not been told already
+    void sendWindowSize() {
+        m_winsizeTimer->stop();
+        if (m_masterFd < 0 || (m_screen.cols() == m_sentCols && m_screen.rows() == m_sentRows)) {
+            return;
+        }
         
-        // Initialize cursor position
-        m_cursorX = 0;
-        m_cursorY = 0;
-        m_cursorVisible = true;
+        struct winsize ws;
+        ws.ws_col = m_screen.cols();
+        ws.ws_row = m_screen.rows();
+        ws.ws_xpixel = width();
+        ws.ws_ypixel = height();
+        if (ioctl(m_masterFd, TIOCSWINSZ, &ws) == 0) {
+            m_sentCols = m_screen.cols();
+            m_sentRows = m_screen.rows();
+        }
+    }
+    
+    QRect cursorRect() const {
+        return QRect(m_screen.cursorX() * m_charWidth, (m_screen.cursorY() + m_scrollOffset) * m_charHeight,
+                     m_charWidth, m_charHeight);
+    }
+    
+    // Paint a block of cells. Neighbouring cells with the same background
+    // share one fill, and cells with the same color and style share one
+    // glyph run.
+    void paintCells(QPainter &painter, int firstRow, int lastRow, int firstCol, int lastCol) {
+        int ascent = m_fontMetrics->ascent();
         
-        // Initialize escape sequence state
-        m_escapeState = EscapeState::None;
-        m_escapeSequence.clear();
+        for (int y = firstRow; y <= lastRow; y++) {
+            int length;
+            const TermCell *row = visibleLine(y, &length);
+            int endCol = qMin(lastCol + 1, length);
+            int top = y * m_charHeight;
+            
+            // Backgrounds that differ from the default
+            for (int x = firstCol; x < endCol;) {
+                uint16_t bg = row[x].bg;
+                int runEnd = x + 1;
+                while (runEnd < endCol && row[runEnd].bg == bg) {
+                    runEnd++;
+                }
+                if (bg != ColorDefaultBg) {
+                    painter.fillRect(x * m_charWidth, top, (runEnd - x) * m_charWidth,
+                                     m_charHeight, color(bg));
+                }
+                x = runEnd;
+            }
+            
+            // Text
+            for (int x = firstCol; x < endCol;) {
+                const TermCell &first = row[x];
+                int runEnd = x + 1;
+                while (runEnd < endCol && row[runEnd].fg == first.fg && row[runEnd].attrs == first.attrs) {
+                    runEnd++;
+                }
+                paintTextRun(painter, row, x, runEnd, top + ascent);
+                x = runEnd;
+            }
+        }
+    }
+    
+    // Draw cells [startCol, endCol) of a row, which all share fg and attrs
+    void paintTextRun(QPainter &painter, const TermCell *row, int startCol, int endCol, int baseline) {
+        const TermCell &first = row[startCol];
+        int style = GlyphCache::styleFor(first);
+        bool underline = first.attrs & AttrUnderline;
         
-        // Text attributes
-        m_bold = false;
-        m_italic = false;
-        m_underline = false;
+        m_runGlyphs.resize(0);
+        m_runPositions.resize(0);
         
-        // Start the PTY
-        startPty();
+        for (int x = startCol; x < endCol; x++) {
+            uint32_t codepoint = row[x].codepoint;
+            if (QChar::isSpace(codepoint)) {
+                continue;
+            }
+            
+            if (m_penColor != first.fg) {
+                painter.setPen(color(first.fg));
+                m_penColor = first.fg;
+            }
+            
+            quint32 glyph = m_glyphCache->glyphIndex(codepoint, style);
+            if (glyph != 0) {
+                m_runGlyphs.append(glyph);
+                m_runPositions.append(QPointF(x * m_charWidth, baseline));
+            } else {
+                // Not in the primary font - let QPainter find a fallback
+                painter.setFont(m_glyphCache->font(style));
+                painter.drawText(x * m_charWidth, baseline, cellText(row[x]));
+            }
+        }
         
-        // Set up read timer
-        m_readTimer = new QTimer(this);
-        connect(m_readTimer, &QTimer::timeout, this, &TerminalWidget::readFromPty);
-        m_readTimer->start(10); // Check every 10ms
+        if (!m_runGlyphs.isEmpty()) {
+            QGlyphRun run;
+            run.setRawFont(m_glyphCache->rawFont(style));
+            run.setGlyphIndexes(m_runGlyphs);
+            run.setPositions(m_runPositions);
+            painter.drawGlyphRun(QPointF(0, 0), run);
+        }
         
-        // Cursor blink timer
-        m_cursorBlinkTimer = new QTimer(this);
-        connect(m_cursorBlinkTimer, &QTimer::timeout, this, [this]() {
-            m_cursorVisible = !m_cursorVisible;
-            update(cursorRect());
-        });
-        m_cursorBlinkTimer->start(500); // Blink every 500ms
+        if (underline) {
+            if (m_penColor != first.fg) {
+                painter.setPen(color(first.fg));
+                m_penColor = first.fg;
+            }
+            int underlineY = baseline + 2;
+            painter.drawLine(startCol * m_charWidth, underlineY, endCol * m_charWidth - 1, underlineY);
+        }
     }
     
-    ~TerminalWidget() {
-        if (m_childPid > 0) {
-            kill(m_childPid, SIGTERM);
+    QColor color(uint16_t index) const {
+        return QColor::fromRgb(m_screen.color(index));
+    }
+    
+    // Row y of the viewport, which shows scrollback when scrolled back
+    const TermCell *visibleLine(int y, int *length) const {
+        return m_screen.visibleLine(y, m_scrollOffset, length);
+    }
+    
+    void scrollView(int lines) {
+        int offset = qBound(0, m_scrollOffset + lines, m_screen.scrollback().size());
+        if (offset != m_scrollOffset) {
+            m_scrollOffset = offset;
+            m_fullRepaint = true;
+            flushDamage();
         }
-        
-        if (m_masterFd >= 0) {
-            ::close(m_masterFd);  // Use global namespace for ::close to avoid QWidget::close
+    }
+    
+    int frameInterval() const {
+        qreal fps = m_maxFrameRate;
+        if (fps <= 0) {
+            QWindow *windowHandle = window()->windowHandle();
+            QScreen *screen = windowHandle ? windowHandle->screen() : QGuiApplication::primaryScreen();
+            fps = screen ? screen->refreshRate() : 60;
+        }
+        return qMax(1, qRound(1000.0 / qMax(qreal(1), fps)));
+    }
+    
+    // Ask for the latest state to be presented. Output on an idle terminal is
+    // presented immediately to keep typing latency low; while output keeps
+    // streaming, frames are spaced out by the frame interval and everything
+    // parsed in between is folded into the next one.
+    void requestFrame() {
+        if (m_frameRequestTime < 0) {
+            m_frameRequestTime = m_frameClock.elapsed();
+        }
+        if (m_frameTimer->isActive()) {
+            return;
         }
         
-        delete m_fontMetrics;
+        qint64 wait = m_lastFrameTime + frameInterval() - m_frameClock.elapsed();
+        if (wait <= 0) {
+            presentFrame();
+        } else {
+            m_frameTimer->start(int(wait));
+        }
     }
     
-protected:
-    void paintEvent(QPaintEvent *event) override {
-        QPainter painter(this);
-        painter.setFont(m_font);
+    // Turn the damage collected while parsing into repaint requests. Region
+    // scrolls are blitted so that only the lines that actually changed get
+    // painted.
+    void flushDamage() {
+        if (m_glView) {
+            // The GL view redraws the whole grid every frame
+            m_glView->setView(m_scrollOffset, m_cursorBlinkOn);
+            m_glView->setHighlights(visibleHighlights());
+            m_glView->update();
+            m_screen.clearDamage();
+            m_fullRepaint = false;
+            return;
+        }
         
-        // Fill background
-        painter.fillRect(event->rect(), m_defaultBg);
+        int rows = m_screen.rows();
+        const std::vector<TerminalScreen::ScrollDamage> &scrolls = m_screen.scrollDamage();
+        bool fullRepaint = m_fullRepaint || m_screen.needsFullRepaint() ||
+                           (!scrolls.empty() && m_scrollOffset > 0);
         
-        // Draw text
-        for (int y = 0; y < m_rows; y++) {
-            for (int x = 0; x < m_cols; x++) {
-                const TermChar &ch = m_buffer[y][x];
-                
-                // Draw background if different from default
-                if (ch.background != m_defaultBg) {
-                    painter.fillRect(x * m_charWidth, y * m_charHeight, 
-                                    m_charWidth, m_charHeight, ch.background);
+        if (fullRepaint) {
+            update();
+        } else {
+            for (const TerminalScreen::ScrollDamage &damage : scrolls) {
+                // A region scrolled by its full height or more has been
+                // redrawn line by line anyway
+                int height = damage.bottom - damage.top + 1;
+                if (qAbs(damage.lines) >= height) {
+                    continue;
                 }
                 
-                // Draw character if not a space
-                if (!ch.character.isSpace()) {
-                    QFont charFont = m_font;
-                    
-                    // Apply text styling
-                    if (ch.bold) {
-                        charFont.setBold(true);
-                    }
-                    if (ch.italic) {
-                        charFont.setItalic(true);
-                    }
-                    
-                    painter.setFont(charFont);
-                    painter.setPen(ch.foreground);
-                    painter.drawText(x * m_charWidth, y * m_charHeight + m_fontMetrics->ascent(), 
-                                    ch.character);
-                    
-                    // Draw underline if needed
-                    if (ch.underline) {
-                        int underlineY = y * m_charHeight + m_fontMetrics->ascent() + 2;
-                        painter.drawLine(x * m_charWidth, underlineY, 
-                                        (x + 1) * m_charWidth, underlineY);
+                QRect region(0, damage.top * m_charHeight, m_screen.cols() * m_charWidth, height * m_charHeight);
+                scroll(0, -damage.lines * m_charHeight, region);
+                
+                // The old cursor image moves along, or out of view
+                if (m_paintedCursorY >= damage.top && m_paintedCursorY <= damage.bottom) {
+                    m_paintedCursorY -= damage.lines;
+                    if (m_paintedCursorY < damage.top || m_paintedCursorY > damage.bottom) {
+                        m_paintedCursorY = -1;
                     }
                 }
             }
-        }
-        
-        // Draw cursor
-        if (m_cursorVisible && m_cursorY < m_buffer.size() && m_cursorX < m_buffer[m_cursorY].size()) {
-            painter.fillRect(cursorRect(), m_cursorColor);
             
-            // Draw character under cursor with inverted colors
-            const TermChar &cursorChar = m_buffer[m_cursorY][m_cursorX];
-            QFont cursorFont = m_font;
+            for (int y = 0; y < rows - m_scrollOffset; y++) {
+                const TerminalScreen::LineDamage &damage = m_screen.lineDamage(y);
+                if (damage.first <= damage.last) {
+                    update(damage.first * m_charWidth, (y + m_scrollOffset) * m_charHeight,
+                           (damage.last - damage.first + 1) * m_charWidth, m_charHeight);
+                }
+            }
             
-            if (cursorChar.bold) {
-                cursorFont.setBold(true);
+            // The cursor leaves its old cell and is drawn in the new one
+            if (m_paintedCursorY >= 0) {
+                update(m_paintedCursorX * m_charWidth, m_paintedCursorY * m_charHeight,
+                       m_charWidth, m_charHeight);
             }
-            if (cursorChar.italic) {
-                cursorFont.setItalic(true);
+            update(cursorRect());
+        }
+        
+        m_screen.clearDamage();
+        m_fullRepaint = false;
+        m_paintedCursorX = m_screen.cursorX();
+        m_paintedCursorY = m_screen.cursorY() + m_scrollOffset;
+    }
+    
+    static QString cellText(const TermCell &cell) {
+        uint codepoint = cell.codepoint;
+        return QString::fromUcs4(&codepoint, 1);
+    }
+    
+private slots:
+    // Write queued input until the PTY would block. A large paste is fed in
+    // slices, going back to the event loop between them so painting and
+    // reading carry on while it streams.
+    void flushWriteQueue() {
+        int budget = kWriteBudget;
+        while (m_writeOffset < m_writeQueue.size()) {
+            if (budget <= 0) {
+                m_writeNotifier->setEnabled(true);
+                break;
             }
             
-            painter.setFont(cursorFont);
-            painter.setPen(m_defaultBg);
-            painter.drawText(m_cursorX * m_charWidth, 
-                            m_cursorY * m_charHeight + m_fontMetrics->ascent(), 
-                            cursorChar.character);
+            int length = qMin(m_writeQueue.size() - m_writeOffset, budget);
+            ssize_t written = write(m_masterFd, m_writeQueue.constData() + m_writeOffset, length);
+            if (written > 0) {
+                m_writeOffset += int(written);
+                budget -= int(written);
+            } else if (written == -1 && errno == EINTR) {
+                continue;
+            } else if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                m_writeNotifier->setEnabled(true);
+                break;
+            } else {
+                // The child has gone away; nothing will read the rest
+                if (written == -1 && errno != EIO) {
+                    qDebug() << "Error writing to PTY: " << strerror(errno);
+                }
+                m_writeOffset = m_writeQueue.size();
+            }
+        }
+        
+        if (m_writeOffset >= m_writeQueue.size()) {
+            m_writeQueue.clear();
+            m_writeOffset = 0;
+            m_writeNotifier->setEnabled(false);
+        } else if (m_writeOffset > kWriteBudget) {
+            // Drop what has been sent so the queue does not keep growing
+            m_writeQueue.remove(0, m_writeOffset);
+            m_writeOffset = 0;
         }
     }
     
-    void keyPressEvent(QKeyEvent *event) override {
-        // Only process if we have a valid master file descriptor
-        if (m_masterFd < 0) {
+    void readFromPty() {
+        if (!m_ptyChannel) {
             return;
         }
         
-        QByteArray data;
+        // Parse what the reader thread has queued, but stop after a fixed budget
+        // so a flood of output cannot starve painting and input handling; the
+        // rest is picked up again right after the event loop has had its turn
+        SpscByteRing &ring = m_ptyChannel->ring();
+        qint64 readTime = m_ptyChannel->acknowledge();
+        int64_t scrolledLines = m_screen.scrolledLines();
+        qint64 parseStart = m_perf ? monotonicNs() : 0;
         
-        // Handle special keys
-        switch (event->key()) {
-            case Qt::Key_Return:
-            case Qt::Key_Enter:
-                data = "\r";
-                break;
-                
-            case Qt::Key_Backspace:
-                data = "\x7f"; // ASCII DEL
-                break;
-                
-            case Qt::Key_Tab:
-                data = "\t";
-                break;
-                
-            case Qt::Key_Up:
-                data = "\x1b[A"; // ANSI escape sequence for up arrow
-                break;
-                
-            case Qt::Key_Down:
-                data = "\x1b[B"; // ANSI escape sequence for down arrow
-                break;
-                
-            case Qt::Key_Right:
-                data = "\x1b[C"; // ANSI escape sequence for right arrow
-                break;
-                
-            case Qt::Key_Left:
-                data = "\x1b[D"; // ANSI escape sequence for left arrow
-                break;
-                
-            case Qt::Key_Home:
-                data = "\x1b[H"; // ANSI escape sequence for home
-                break;
-                
-            case Qt::Key_End:
-                data = "\x1b[F"; // ANSI escape sequence for end
-                break;
-                
-            case Qt::Key_PageUp:
-                data = "\x1b[5~"; // Page Up
-                break;
-                
-            case Qt::Key_PageDown:
-                data = "\x1b[6~"; // Page Down
-                break;
-                
-            case Qt::Key_Delete:
-                data = "\x1b[3~"; // Delete
+        int budget = kPtyReadBudget;
+        while (budget > 0) {
+            size_t length;
+            const char *data = ring.readRegion(&length);
+            if (length == 0) {
                 break;
-
-            case Qt::Key_C:
-                if (event->modifiers() & Qt::ControlModifier) {
-                    // Ctrl+C - send SIGINT
-                    data = QByteArray(1, 3); // ASCII ETX (End of Text)
-                    m_pendingNewline = false; // Clear any pending newline to avoid issues
-                } else {
-                    data = event->text().toUtf8();
+            }
+            
+            length = std::min(length, size_t(budget));
+            m_screen.feed(data, int(length));
+            ring.commitRead(length);
+            budget -= int(length);
+        }
+        
+        m_ptyChannel->consumed();
+        
+        if (m_perf && budget < kPtyReadBudget) {
+            m_perf->addParse(kPtyReadBudget - budget, monotonicNs() - parseStart);
+            if (m_unpresentedReadTime == 0) {
+                m_unpresentedReadTime = readTime;
+            }
+        }
+        
+        if (budget < kPtyReadBudget) {
+            // Keep a scrolled-back view on the same content
+            if (m_scrollOffset > 0) {
+                int64_t scrolled = m_screen.scrolledLines() - scrolledLines;
+                int offset = int(qMin(m_scrollOffset + scrolled, int64_t(m_screen.scrollback().size())));
+                if (offset != m_scrollOffset) {
+                    m_scrollOffset = offset;
+                    m_fullRepaint = true;
                 }
-                break;
-                
-            default:
-                if (event->modifiers() & Qt::ControlModifier) {
-                    if (event->key() >= Qt::Key_A && event->key() <= Qt::Key_Z) {
-                        // Control key combinations (Ctrl+A through Ctrl+Z)
-                        char ch = event->key() - Qt::Key_A + 1;
-                        data = QByteArray(1, ch);
-                    } else if (event->key() == Qt::Key_BracketLeft) {
-                        // Ctrl+[
-                        data = QByteArray(1, '\x1b');
-                    }
-                } else {
-                    // Normal text input
-                    data = event->text().toUtf8();
+            }
+            
+            // Hold a synchronized frame back until the application has
+            // finished drawing it
+            if (m_screen.synchronizedUpdate()) {
+                if (!m_syncTimer->isActive()) {
+                    m_syncTimer->start();
                 }
+            } else {
+                m_syncTimer->stop();
+                requestFrame();
+            }
+        }
+        if (budget <= 0 && !ring.isEmpty()) {
+            QMetaObject::invokeMethod(this, "readFromPty", Qt::QueuedConnection);
+        } else if (m_ptyChannel->isClosed() && ring.isEmpty() && !m_finished) {
+            // The shell has usually exited by the time its PTY hangs up. If
+            // not, the destructor terminates and reaps it.
+            if (m_childPid > 0 && ChildReaper::reap(m_childPid)) {
+                m_childPid = -1;
+            }
+            m_finished = true;
+            emit finished();
+        }
+    }
+    
+    void presentFrame() {
+        // A frame timer set before a synchronized update began waits for its end
+        if (m_screen.synchronizedUpdate()) {
+            return;
+        }
+        
+        // Every frame interval that went by with this frame due and not
+        // shown - the GUI thread was busy or the timer late - counts as
+        // a dropped frame
+        qint64 now = m_frameClock.elapsed();
+        if (m_perf && m_frameRequestTime >= 0) {
+            int interval = frameInterval();
+            qint64 due = qMax(m_frameRequestTime, m_lastFrameTime + interval);
+            m_perf->addFrame(int(qMax(qint64(0), now - due) / interval));
+            
+            // The output read for this frame shows with its next paint
+            if (m_presentedReadTime == 0) {
+                m_presentedReadTime = m_unpresentedReadTime;
+            }
+            m_unpresentedReadTime = 0;
+        }
+        m_frameRequestTime = -1;
+        m_lastFrameTime = now;
+        flushDamage();
+    }
+    
+private:
+    QFont m_font;
+    QFontMetrics *m_fontMetrics;
+    GlyphCache *m_glyphCache;           // Shared by every session in the window
+    int m_penColor;                     // Color index of the painter's pen, -1 if unknown
+    QVector<quint32> m_runGlyphs;       // Scratch buffers for paintTextRun()
+    QVector<QPointF> m_runPositions;
+    int m_charWidth;
+    int m_charHeight;
+    
+    TerminalScreen m_screen;
+    int m_scrollOffset;                 // Lines the view is scrolled back
+    bool m_fullRepaint;                 // View changed, repaint everything
+    int m_paintedCursorX;               // Cursor cell as last requested for painting
+    int m_paintedCursorY;
+    QColor m_cursorColor;
+    bool m_cursorBlinkOn;
+    GlTerminalView *m_glView;           // Set when presenting through OpenGL
+    
+    // Performance HUD; the read times are on monotonicNs(), 0 for none
+    PerfCounters *m_perf;               // Set while the HUD is shown
+    PerfHud *m_perfHud;
+    qint64 m_unpresentedReadTime;       // Oldest output parsed but not presented yet
+    qint64 m_presentedReadTime;         // Oldest output presented but not painted yet
+    
+    pid_t m_childPid;
+    int m_masterFd;
+    
+    // PTY output parsed per GUI wakeup
+    static const int kPtyReadBudget = 1024 * 1024;
+    
+    PtyChannel *m_ptyChannel;
+    bool m_finished;                    // finished() has been emitted
+    QTimer *m_cursorBlinkTimer;
+    
+    // Scrollback search
+    ScrollbackSearcher *m_searcher;     // Created by the first search
+    QLineEdit *m_searchBar;
+    std::vector<SearchMatch> m_matches; // Newest first
+    int m_currentMatch;                 // Index into m_matches, -1 for none
+    
+    // Input waiting for the PTY, and the most written per flush
+    static const int kWriteBudget = 256 * 1024;
+    QByteArray m_writeQueue;
+    int m_writeOffset;                  // Bytes of m_writeQueue already written
+    QSocketNotifier *m_writeNotifier;
+    
+    // Frame pacing
+    int m_maxFrameRate;                 // 0 = display refresh rate
+    QTimer *m_frameTimer;
+    QElapsedTimer m_frameClock;
+    qint64 m_lastFrameTime;             // ms on m_frameClock
+    qint64 m_frameRequestTime;          // When the pending frame was asked for, -1 if none
+    
+    // Longest a synchronized update may hold presentation, in ms
+    static const int kSyncTimeout = 150;
+    QTimer *m_syncTimer;
+    
+    // Size last sent with TIOCSWINSZ, and the quiet time before a new one is
+    static const int kWinsizeDelay = 80;
+    int m_sentCols;
+    int m_sentRows;
+    QTimer *m_winsizeTimer;
+};
+
+// Settings every new session starts with
+struct SessionSettings {
+    int scrollbackLines;
+    int scrollbackMegabytes;
+    int maxFrameRate;                   // 0 = display refresh rate
+    bool openGL;                        // Present through GlTerminalView
+    bool perfHud;                       // Start with the performance HUD shown
+};
+
+// The font every session is drawn in
+static QFont terminalFont() {
+    QFont font = QFontDatabase::systemFont(QFontDatabase::FixedFont);
+    font.setPointSize(10);
+    return font;
+}
+
+// Main window: tabs of sessions, each tab a tree of splitters with the
+// sessions as leaves. What the sessions share - the glyph cache, the PTY
+// reactor and the shell pool - belongs to the process and outlives the
+// window, so opening one more session, or one more window in server mode,
+// costs a child process, a screen and a ring, not a thread, a font load or
+// an atlas. Sessions start their shells in the window's directory.
+//
+// Ctrl+Shift+T opens a tab, Ctrl+Shift+E and Ctrl+Shift+O split the focused
+// session side by side and one above the other, Ctrl+Shift+W closes it and
+// Ctrl+PgUp/PgDown switch tabs. A session whose child exits closes itself,
+// and the window closes with its last session.
+class TerminalWindow : public QMainWindow {
+    Q_OBJECT
+    
+public:
+    TerminalWindow(const SessionSettings &settings, GlyphCache *glyphCache, PtyReactor *reactor,
+                   ShellPool *shells, const QByteArray &directory)
+        : m_settings(settings), m_glyphCache(glyphCache), m_reactor(reactor), m_shells(shells),
+          m_directory(directory), m_tabsOpened(0) {
+        setWindowTitle("KorzeTerm");
+        
+        m_tabs = new QTabWidget(this);
+        m_tabs->setDocumentMode(true);
+        m_tabs->setTabBarAutoHide(true);
+        m_tabs->tabBar()->setFocusPolicy(Qt::NoFocus);
+        setCentralWidget(m_tabs);
+        connect(m_tabs, &QTabWidget::currentChanged, this, [this](int index) {
+            if (index >= 0) {
+                focusSessionIn(m_tabs->widget(index));
+            }
+        });
+        
+        addShortcut(QKeySequence("Ctrl+Shift+T"), [this]() { newTab(m_directory); });
+        addShortcut(QKeySequence("Ctrl+Shift+E"), [this]() { splitSession(Qt::Horizontal); });
+        addShortcut(QKeySequence("Ctrl+Shift+O"), [this]() { splitSession(Qt::Vertical); });
+        addShortcut(QKeySequence("Ctrl+Shift+W"), [this]() {
+            if (TerminalWidget *session = currentSession()) {
+                closeSession(session);
+            }
+        });
+        addShortcut(QKeySequence("Ctrl+PgDown"), [this]() {
+            m_tabs->setCurrentIndex((m_tabs->currentIndex() + 1) % m_tabs->count());
+        });
+        addShortcut(QKeySequence("Ctrl+PgUp"), [this]() {
+            m_tabs->setCurrentIndex((m_tabs->currentIndex() + m_tabs->count() - 1) % m_tabs->count());
+        });
+        
+        newTab(m_directory);
+    }
+    
+    // Open a tab with a session started in directory
+    void newTab(const QByteArray &directory) {
+        QSplitter *root = new QSplitter();
+        root->setChildrenCollapsible(false);
+        TerminalWidget *session = createSession(directory);
+        root->addWidget(session);
+        int index = m_tabs->addTab(root, QString("Terminal %1").arg(++m_tabsOpened));
+        m_tabs->setCurrentIndex(index);
+        session->setFocus();
+    }
+    
+    // Split the focused session in two along orientation, the new session
+    // after it
+    void splitSession(Qt::Orientation orientation) {
+        TerminalWidget *session = currentSession();
+        if (!session) {
+            return;
         }
         
-        // Send data to the PTY
-        if (!data.isEmpty()) {
-            write(m_masterFd, data.constData(), data.size());
+        QSplitter *parent = qobject_cast<QSplitter *>(session->parentWidget());
+        int index = parent->indexOf(session);
+        TerminalWidget *added = createSession(m_directory);
+        
+        if (parent->count() == 1 || parent->orientation() == orientation) {
+            // Room in this splitter: the two share the old session's space
+            QList<int> sizes = parent->sizes();
+            parent->setOrientation(orientation);
+            parent->insertWidget(index + 1, added);
+            int size = sizes.value(index);
+            sizes[index] = size / 2;
+            sizes.insert(index + 1, size - size / 2);
+            parent->setSizes(sizes);
+        } else {
+            // Otherwise a splitter of the other way takes the session's place
+            QList<int> sizes = parent->sizes();
+            QSplitter *splitter = new QSplitter(orientation);
+            splitter->setChildrenCollapsible(false);
+            parent->replaceWidget(index, splitter);
+            splitter->addWidget(session);
+            splitter->addWidget(added);
+            splitter->setSizes(QList<int>() << 1 << 1);
+            parent->setSizes(sizes);
         }
+        added->setFocus();
     }
     
-    void resizeEvent(QResizeEvent *event) override {
-        QWidget::resizeEvent(event);
+private:
+    TerminalWidget *createSession(const QByteArray &directory) {
+        TerminalWidget *session = new TerminalWidget(m_glyphCache, m_reactor, m_shells->take(directory));
+        session->setScrollbackLimits(m_settings.scrollbackLines, m_settings.scrollbackMegabytes);
+        session->setMaxFrameRate(m_settings.maxFrameRate);
+        session->setPerfHudShown(m_settings.perfHud);
+        if (m_settings.openGL && !session->setOpenGLRenderer(true)) {
+            qDebug() << "OpenGL 3.3 is not available, using the software renderer";
+            m_settings.openGL = false;
+        }
+        connect(session, &TerminalWidget::finished, this, [this, session]() {
+            closeSession(session);
+        });
+        return session;
+    }
+    
+    // Take the session out of its tab, folding up splitters left with a
+    // single child, and close the tab once it has no sessions left
+    void closeSession(TerminalWidget *session) {
+        QSplitter *parent = qobject_cast<QSplitter *>(session->parentWidget());
+        if (!parent) {
+            return;     // Closed already, its child exiting on the way out
+        }
         
-        // Calculate the new terminal dimensions
-        int newCols = event->size().width() / m_charWidth;
-        int newRows = event->size().height() / m_charHeight;
+        // May be called from one of the session's own slots
+        session->hide();
+        session->setParent(nullptr);
+        session->deleteLater();
         
-        // Make sure we have at least 1x1 dimensions
-        newCols = qMax(1, newCols);
-        newRows = qMax(1, newRows);
+        QWidget *page = parent;
+        while (page->parentWidget() && m_tabs->indexOf(page) < 0) {
+            page = page->parentWidget();
+        }
         
-        // Check if the dimensions actually changed
-        if (newCols != m_cols || newRows != m_rows) {
-            // Resize the terminal buffer
-            resizeBuffer(newRows, newCols);
-            
-            // Notify the PTY of the new size
-            if (m_masterFd >= 0) {
-                struct winsize ws;
-                ws.ws_col = newCols;
-                ws.ws_row = newRows;
-                ws.ws_xpixel = event->size().width();
-                ws.ws_ypixel = event->size().height();
-                ioctl(m_masterFd, TIOCSWINSZ, &ws);
+        if (parent != page && parent->count() == 1) {
+            QSplitter *grandparent = qobject_cast<QSplitter *>(parent->parentWidget());
+            QList<int> sizes = grandparent->sizes();
+            QWidget *remaining = parent->widget(0);
+            grandparent->replaceWidget(grandparent->indexOf(parent), remaining);
+            grandparent->setSizes(sizes);
+            parent->deleteLater();
+        }
+        
+        if (!page->findChild<TerminalWidget *>()) {
+            m_tabs->removeTab(m_tabs->indexOf(page));
+            page->deleteLater();
+            if (m_tabs->count() == 0) {
+                close();
             }
+            return;
         }
+        focusSessionIn(page);
     }
     
-private:
-    // ANSI escape sequence state
-    enum class EscapeState {
-        None,           // Not in an escape sequence
-        Escape,         // Just received ESC
-        Bracket,        // Received ESC [
-        Parameter,      // Collecting parameters
-        OSC,            // Operating System Command (ESC ])
-        OSCParameter    // Collecting OSC parameters
-    };
+    // The session with the focus, its search bar included
+    TerminalWidget *currentSession() const {
+        for (QWidget *widget = QApplication::focusWidget(); widget; widget = widget->parentWidget()) {
+            if (TerminalWidget *session = qobject_cast<TerminalWidget *>(widget)) {
+                return session;
+            }
+        }
+        QWidget *page = m_tabs->currentWidget();
+        return page ? page->findChild<TerminalWidget *>() : nullptr;
+    }
     
-    QRect cursorRect() const {
-        return QRect(m_cursorX * m_charWidth, m_cursorY * m_charHeight, m_charWidth, m_charHeight);
-    }
-    
-    void initializeColorPalette() {
-        // Basic 16 colors
-        m_colorPalette.resize(256);
-        
-        // Standard colors (0-7)
-        m_colorPalette[0] = QColor(40, 40, 40);      // Black
-        m_colorPalette[1] = QColor(204, 36, 29);     // Red
-        m_colorPalette[2] = QColor(152, 151, 26);    // Green
-        m_colorPalette[3] = QColor(215, 153, 33);    // Yellow
-        m_colorPalette[4] = QColor(69, 133, 136);    // Blue
-        m_colorPalette[5] = QColor(177, 98, 134);    // Magenta
-        m_colorPalette[6] = QColor(104, 157, 106);   // Cyan
-        m_colorPalette[7] = QColor(168, 153, 132);   // White
-        
-        // Bright colors (8-15)
-        m_colorPalette[8] = QColor(146, 131, 116);   // Bright Black (Gray)
-        m_colorPalette[9] = QColor(251, 73, 52);     // Bright Red
-        m_colorPalette[10] = QColor(184, 187, 38);   // Bright Green
-        m_colorPalette[11] = QColor(250, 189, 47);   // Bright Yellow
-        m_colorPalette[12] = QColor(131, 165, 152);  // Bright Blue
-        m_colorPalette[13] = QColor(211, 134, 155);  // Bright Magenta
-        m_colorPalette[14] = QColor(142, 192, 124);  // Bright Cyan
-        m_colorPalette[15] = QColor(235, 219, 178);  // Bright White
-        
-        // Generate 216 colors for 6x6x6 color cube (16-231)
-        int index = 16;
-        for (int r = 0; r < 6; r++) {
-            for (int g = 0; g < 6; g++) {
-                for (int b = 0; b < 6; b++) {
-                    int red = r == 0 ? 0 : (r * 40 + 55);
-                    int green = g == 0 ? 0 : (g * 40 + 55);
-                    int blue = b == 0 ? 0 : (b * 40 + 55);
-                    m_colorPalette[index++] = QColor(red, green, blue);
-                }
+    // Give the focus back to the session last focused in a tab
+    void focusSessionIn(QWidget *page) {
+        TerminalWidget *session = nullptr;
+        QWidget *focused = page->focusWidget();
+        if (focused && page->isAncestorOf(focused)) {
+            for (QWidget *widget = focused; widget && !session; widget = widget->parentWidget()) {
+                session = qobject_cast<TerminalWidget *>(widget);
             }
         }
-        
-        // Generate 24 grayscale colors (232-255)
-        for (int i = 0; i < 24; i++) {
-            int value = i * 10 + 8;
-            m_colorPalette[232 + i] = QColor(value, value, value);
+        if (!session) {
+            session = page->findChild<TerminalWidget *>();
+        }
+        if (session) {
+            session->setFocus();
         }
     }
     
-    void startPty() {
-        // Create a pseudo-terminal
-        m_childPid = forkpty(&m_masterFd, nullptr, nullptr, nullptr);
-        
-        if (m_childPid == -1) {
-            // Fork failed
-            qDebug() << "Failed to fork PTY: " << strerror(errno);
-            return;
-        } else if (m_childPid == 0) {
-            // Child process - execute the shell
-            char *shell = getenv("SHELL");
-            if (!shell) shell = const_cast<char*>("/bin/bash");
-            
-            // Set TERM environment variable
-            setenv("TERM", "xterm-256color", 1);
-            
-            // Set ZSH shell prompt to not display % at the end
-            if (strstr(shell, "zsh")) {
-                setenv("PROMPT", "%~ $ ", 1);
-            }
-            
-            // Execute the shell
-            execl(shell, shell, "-l", nullptr);
-            
-            // If execl returns, there was an error
-            perror("execl");
-            exit(1);
+    template <typename Function>
+    void addShortcut(const QKeySequence &keys, Function function) {
+        QShortcut *shortcut = new QShortcut(keys, this);
+        connect(shortcut, &QShortcut::activated, this, function);
+    }
+    
+    SessionSettings m_settings;
+    GlyphCache *m_glyphCache;
+    PtyReactor *m_reactor;
+    ShellPool *m_shells;
+    QByteArray m_directory;
+    QTabWidget *m_tabs;
+    int m_tabsOpened;
+};
+
+// Where korzeterm --server listens: the user's runtime directory, or the
+// temporary directory without one
+static QByteArray serverSocketPath() {
+    QByteArray directory = qgetenv("XDG_RUNTIME_DIR");
+    if (directory.isEmpty()) {
+        directory = QFile::encodeName(QDir::tempPath());
+    }
+    return directory + "/korzeterm-" + QByteArray::number(uint(getuid())) + ".socket";
+}
+
+// Connect to a running server, -1 if there is none. A socket the user does
+// not own is not trusted with requests.
+static int connectToServer() {
+    QByteArray path = serverSocketPath();
+    struct stat st;
+    struct sockaddr_un address;
+    if (lstat(path.constData(), &st) != 0 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid() ||
+        size_t(path.size()) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.constData(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Resident mode, korzeterm --server. The process starts Qt, loads the font
+// and forks a spare shell once, then opens windows at the request of
+// korzeterm --client, which writes one line to the server's socket:
+// "window <directory>" or "tab <directory>". Every window shares the glyph
+// cache, atlas, reactor and shell pool, so the first prompt of a new window
+// takes about as long as drawing the window.
+//
+// The server answers each request with "ok" once the window is open, and
+// runs until it is killed; windows closing do not end it.
+class TerminalServer : public QObject {
+    Q_OBJECT
+
+public:
+    TerminalServer(const SessionSettings &settings, GlyphCache *glyphCache, PtyReactor *reactor, ShellPool *shells)
+        : m_settings(settings), m_glyphCache(glyphCache), m_reactor(reactor), m_shells(shells),
+          m_listenFd(-1), m_listenNotifier(nullptr) {}
+    
+    ~TerminalServer() {
+        // The windows go first, their sessions use what the server shares
+        for (QWidget *widget : QApplication::topLevelWidgets()) {
+            delete qobject_cast<TerminalWindow *>(widget);
+        }
+        for (QHash<int, Client>::iterator it = m_clients.begin(); it != m_clients.end(); ++it) {
+            delete it.value().notifier;
+            ::close(it.key());
+        }
+        if (m_listenFd >= 0) {
+            delete m_listenNotifier;
+            ::close(m_listenFd);
+            unlink(m_path.constData());
         }
-        
-        // Parent process continues here
-        // Set the PTY to non-blocking mode
-        int flags = fcntl(m_masterFd, F_GETFL, 0);
-        fcntl(m_masterFd, F_SETFL, flags | O_NONBLOCK);
     }
     
-    void resizeBuffer(int newRows, int newCols) {
-        // Save old buffer dimensions
-        int oldRows = m_rows;
-        int oldCols = m_cols;
+    // Take over the socket, unless another server still answers on it
+    bool listen() {
+        m_path = serverSocketPath();
+        int running = connectToServer();
+        if (running >= 0) {
+            ::close(running);
+            fprintf(stderr, "korzeterm: a server is already running on %s\n", m_path.constData());
+            return false;
+        }
         
-        // Create a new buffer with the new dimensions
-        QVector<QVector<TermChar>> newBuffer(newRows);
-        for (int i = 0; i < newRows; i++) {
-            newBuffer[i].resize(newCols);
+        struct sockaddr_un address;
+        if (size_t(m_path.size()) >= sizeof(address.sun_path)) {
+            fprintf(stderr, "korzeterm: socket path too long: %s\n", m_path.constData());
+            return false;
         }
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, m_path.constData(), m_path.size());
         
-        // Copy the data from the old buffer to the new one
-        for (int y = 0; y < qMin(oldRows, newRows); y++) {
-            for (int x = 0; x < qMin(oldCols, newCols); x++) {
-                newBuffer[y][x] = m_buffer[y][x];
+        // A socket left behind by a server that was killed is replaced. Only
+        // the user may connect to the new one.
+        unlink(m_path.constData());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        mode_t mask = umask(0077);
+        bool bound = fd >= 0 && bind(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0;
+        umask(mask);
+        if (!bound || ::listen(fd, 16) != 0) {
+            fprintf(stderr, "korzeterm: cannot listen on %s: %s\n", m_path.constData(), strerror(errno));
+            if (fd >= 0) {
+                ::close(fd);
             }
+            return false;
         }
         
-        // Update the dimensions and buffer
-        m_rows = newRows;
-        m_cols = newCols;
-        m_buffer = newBuffer;
-        
-        // Make sure the cursor is still in bounds
-        m_cursorX = qMin(m_cursorX, m_cols - 1);
-        m_cursorY = qMin(m_cursorY, m_rows - 1);
+        m_listenFd = fd;
+        m_listenNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+        connect(m_listenNotifier, SIGNAL(activated(int)), this, SLOT(acceptClients()));
+        return true;
     }
-    
-    void processOutput(const QByteArray &data) {
-        // We need to handle UTF-8 sequences properly
-        int i = 0;
-        while (i < data.size()) {
-            char c = data[i++];
-            
-            // Check if we're in the middle of a UTF-8 sequence
-            if (m_utf8Remaining > 0) {
-                if ((c & 0xC0) == 0x80) {
-                    // This is a UTF-8 continuation byte
-                    m_utf8Buffer += c;
-                    m_utf8Remaining--;
-                    
-                    if (m_utf8Remaining == 0) {
-                        // Process the complete UTF-8 sequence
-                        processUtf8Sequence(m_utf8Buffer);
-                        m_utf8Buffer.clear();
-                    }
+
+private slots:
+    void acceptClients() {
+        for (;;) {
+            int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
                     continue;
-                } else {
-                    // Invalid UTF-8 sequence, reset and process as normal
-                    m_utf8Remaining = 0;
-                    m_utf8Buffer.clear();
                 }
+                return;
             }
             
-            // Start of UTF-8 sequence
-            if ((c & 0x80) != 0) {
-                if ((c & 0xE0) == 0xC0) {
-                    // 2-byte sequence
-                    m_utf8Remaining = 1;
-                    m_utf8Buffer = QByteArray(1, c);
-                } else if ((c & 0xF0) == 0xE0) {
-                    // 3-byte sequence
-                    m_utf8Remaining = 2;
-                    m_utf8Buffer = QByteArray(1, c);
-                } else if ((c & 0xF8) == 0xF0) {
-                    // 4-byte sequence
-                    m_utf8Remaining = 3;
-                    m_utf8Buffer = QByteArray(1, c);
-                } else {
-                    // Invalid UTF-8 byte, treat as ASCII
-                    processChar(c);
-                }
-            } else {
-                // ASCII character
-                processChar(c);
+            // Only the user who started the server may open windows in it
+            struct ucred peer;
+            socklen_t length = sizeof(peer);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 || peer.uid != getuid()) {
+                ::close(fd);
+                continue;
             }
+            
+            Client &client = m_clients[fd];
+            client.notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+            connect(client.notifier, SIGNAL(activated(int)), this, SLOT(readRequest(int)));
         }
-        
-        // Redraw the terminal
-        update();
     }
     
-    void processUtf8Sequence(const QByteArray &utf8Bytes) {
-        // Convert UTF-8 bytes to Unicode code point
-        QString str = QString::fromUtf8(utf8Bytes);
-        if (str.isEmpty()) {
+    // Read what a client has sent; once its line is complete, act on it
+    void readRequest(int fd) {
+        QHash<int, Client>::iterator it = m_clients.find(fd);
+        if (it == m_clients.end()) {
             return;
         }
+        Client &client = it.value();
         
-        QChar ch = str[0];
-        
-        // Store character with attributes
-        m_buffer[m_cursorY][m_cursorX].character = ch;
-        m_buffer[m_cursorY][m_cursorX].foreground = m_currentFg;
-        m_buffer[m_cursorY][m_cursorX].background = m_currentBg;
-        m_buffer[m_cursorY][m_cursorX].bold = m_bold;
-        m_buffer[m_cursorY][m_cursorX].italic = m_italic;
-        m_buffer[m_cursorY][m_cursorX].underline = m_underline;
-        
-        // Move cursor forward
-        m_cursorX++;
-        
-        // Check if it's a wide character (like CJK)
-        // A simple heuristic for CJK characters - they generally have high Unicode values
-        // This is not perfect but works for most common cases
-        uint unicode = ch.unicode();
-        if ((unicode >= 0x3000 && unicode <= 0x9FFF) || // CJK unified ideographs, symbols, etc.
-            (unicode >= 0xAC00 && unicode <= 0xD7AF) || // Hangul
-            (unicode >= 0xF900 && unicode <= 0xFAFF) || // CJK compatibility ideographs
-            (unicode >= 0xFF00 && unicode <= 0xFFEF) || // Halfwidth and fullwidth forms
-            (unicode >= 0x20000 && unicode <= 0x2FFFF)) { // CJK extension areas
-            
-            // Mark the next cell as part of this character
-            if (m_cursorX < m_cols) {
-                m_buffer[m_cursorY][m_cursorX].character = QChar::Space;
-                m_cursorX++;
+        bool hungUp = false;
+        char buffer[4096];
+        for (;;) {
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length > 0) {
+                client.request.append(buffer, int(length));
+            } else if (length == -1 && errno == EINTR) {
+                continue;
+            } else {
+                hungUp = length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                break;
             }
         }
         
-        // Handle line wrapping
-        if (m_cursorX >= m_cols) {
-            m_cursorX = 0;
-            m_cursorY++;
-            if (m_cursorY >= m_rows) {
-                scrollUp();
-                m_cursorY = m_rows - 1;
-            }
+        int end = client.request.indexOf('\n');
+        if (end < 0 && !hungUp && client.request.size() <= kMaxRequest) {
+            return;     // The rest is still on its way
         }
+        if (end >= 0) {
+            QByteArray reply = handleRequest(client.request.left(end));
+            ssize_t written;
+            do {
+                written = write(fd, reply.constData(), reply.size());
+            } while (written == -1 && errno == EINTR);
+        }
+        
+        // Called from the notifier's own signal
+        client.notifier->setEnabled(false);
+        client.notifier->deleteLater();
+        ::close(fd);
+        m_clients.erase(it);
     }
+
+private:
+    struct Client {
+        QSocketNotifier *notifier;
+        QByteArray request;
+    };
     
-    void processChar(char c) {
-        // Process character based on current escape state
-        switch (m_escapeState) {
-            case EscapeState::None:
-                if (c == '\x1b') { // ESC character
-                    m_escapeState = EscapeState::Escape;
-                    m_escapeSequence.clear();
-                } else {
-                    processRegularChar(c);
-                }
-                break;
-                
-            case EscapeState::Escape:
-                if (c == '[') {
-                    m_escapeState = EscapeState::Bracket;
-                } else if (c == ']') {
-                    // OSC sequence (Operating System Command)
-                    m_escapeState = EscapeState::OSC;
-                    m_escapeSequence.clear();
-                } else if (c == '%') {
-                    // Ignore % character in escape sequences - common in some terminals
-                    // Just stay in escape state for now
-                } else {
-                    // Simple ESC sequence (not fully supported)
-                    m_escapeState = EscapeState::None;
-                    processRegularChar(c);
-                }
-                break;
-                
-            case EscapeState::Bracket:
-                if ((c >= '0' && c <= '9') || c == ';' || c == '?' || c == ' ' || c == '>') {
-                    // Collect parameter
-                    m_escapeSequence += c;
-                    m_escapeState = EscapeState::Parameter;
-                } else {
-                    // Single character command
-                    processEscapeSequence(c, m_escapeSequence);
-                    m_escapeState = EscapeState::None;
-                }
-                break;
-                
-            case EscapeState::Parameter:
-                if ((c >= '0' && c <= '9') || c == ';' || c == '?' || c == ' ' || c == '>' || c == '=') {
-                    // Continue collecting parameter
-                    m_escapeSequence += c;
-                } else {
-                    // Process the complete escape sequence
-                    processEscapeSequence(c, m_escapeSequence);
-                    m_escapeState = EscapeState::None;
-                }
-                break;
-                
-            case EscapeState::OSC:
-                if (c >= '0' && c <= '9') {
-                    m_escapeSequence += c;
-                } else if (c == ';') {
-                    m_escapeSequence += c;
-                    m_escapeState = EscapeState::OSCParameter;
-                } else {
-                    // Invalid OSC sequence
-                    m_escapeState = EscapeState::None;
-                }
-                break;
-                
-            case EscapeState::OSCParameter:
-                if (c == '\x07' || (c == '\\' && m_escapeSequence.endsWith("\x1b"))) {
-                    // BEL or ESC \ terminates OSC sequence
-                    // Process OSC command - currently ignored
-                    m_escapeState = EscapeState::None;
-                } else {
-                    m_escapeSequence += c;
-                }
-                break;
+    static const int kMaxRequest = 64 * 1024;
+    
+    QByteArray handleRequest(const QByteArray &request) {
+        int space = request.indexOf(' ');
+        QByteArray command = space < 0 ? request : request.left(space);
+        QByteArray directory = space < 0 ? QByteArray() : request.mid(space + 1);
+        
+        if (command == "window") {
+            openWindow(directory);
+        } else if (command == "tab") {
+            // In the window last used, or a new one if none is left
+            TerminalWindow *window = qobject_cast<TerminalWindow *>(QApplication::activeWindow());
+            if (!window) {
+                window = m_lastWindow;
+            }
+            if (window) {
+                window->newTab(directory);
+                window->raise();
+                window->activateWindow();
+            } else {
+                openWindow(directory);
+            }
+        } else {
+            return "error unknown request\n";
         }
+        return "ok\n";
     }
     
-    void processRegularChar(char c) {
-        // Handle basic terminal output
-        switch (c) {
-            case '\r': // Carriage return
-                m_cursorX = 0;
-                // Handle CR+LF as a single operation to prevent dangling %
-                if (m_pendingNewline) {
-                    m_pendingNewline = false;
-                }
-                break;
-                
-            case '\n': // Line feed
-                if (m_pendingNewline) {
-                    // Already had a newline pending, just process it
-                    m_pendingNewline = false;
-                } else {
-                    // Mark that we've seen a newline
-                    m_pendingNewline = true;
-                    
-                    // Process immediately
-                    m_cursorY++;
-                    if (m_cursorY >= m_rows) {
-                        // Need to scroll the buffer
-                        scrollUp();
-                        m_cursorY = m_rows - 1;
-                    }
-                    // Important: Reset cursor X position for proper prompt alignment
-                    m_cursorX = 0;
-                }
-                break;
-                
-            case '\b': // Backspace
-                if (m_cursorX > 0) {
-                    m_cursorX--;
-                }
-                break;
-                
-            case '\t': // Tab
-                // Set tab stops every 8 characters - important for programs like fastfetch
-                m_cursorX = ((m_cursorX + 8) / 8) * 8;
-                if (m_cursorX >= m_cols) {
-                    m_cursorX = 0;
-                    m_cursorY++;
-                    if (m_cursorY >= m_rows) {
-                        scrollUp();
-                        m_cursorY = m_rows - 1;
-                    }
-                }
-                break;
-                
-            case '\a': // Bell
-                // Would normally beep
-                break;
-                
-            default:
-                if (c >= 32) { // Printable character
-                    // Clear any pending newline state
-                    m_pendingNewline = false;
-                    
-                    // Store the character in the buffer with current attributes
-                    m_buffer[m_cursorY][m_cursorX].character = QChar(c);
-                    m_buffer[m_cursorY][m_cursorX].foreground = m_currentFg;
-                    m_buffer[m_cursorY][m_cursorX].background = m_currentBg;
-                    m_buffer[m_cursorY][m_cursorX].bold = m_bold;
-                    m_buffer[m_cursorY][m_cursorX].italic = m_italic;
-                    m_buffer[m_cursorY][m_cursorX].underline = m_underline;
-                    
-                    // Move cursor forward
-                    m_cursorX++;
-                    
-                    if (m_cursorX >= m_cols) {
-                        m_cursorX = 0;
-                        m_cursorY++;
-                        if (m_cursorY >= m_rows) {
-                            scrollUp();
-                            m_cursorY = m_rows - 1;
-                        }
-                    }
-                }
-        }
+    void openWindow(const QByteArray &directory) {
+        TerminalWindow *window = new TerminalWindow(m_settings, m_glyphCache, m_reactor, m_shells, directory);
+        window->setAttribute(Qt::WA_DeleteOnClose);
+        window->resize(800, 600);
+        window->show();
+        m_lastWindow = window;
     }
     
-    void processEscapeSequence(char finalChar, const QString &parameters) {
-        // Parse the parameter string into integers
-        QStringList paramList = parameters.split(';');
-        QVector<int> params;
-        
-        // Check for private mode sequences
-        bool privateMode = parameters.startsWith('?') || parameters.startsWith('>');
-        QString cleanParams = parameters;
-        if (privateMode) {
-            cleanParams = parameters.mid(1);
-            paramList = cleanParams.split(';');
-        }
-        
-        for (const QString &param : paramList) {
-            bool ok;
-            int value = param.toInt(&ok);
-            params.append(ok ? value : 0);
-        }
-        
-        // Default parameter is 0 if none specified
-        if (params.isEmpty()) {
-            params.append(0);
-        }
-        
-        // Process based on the final character
-        switch (finalChar) {
-            case 'm': // SGR - Select Graphic Rendition
-                processSGR(params);
-                break;
-                
-            case 'H': // CUP - Cursor Position
-            case 'f': // HVP - Horizontal and Vertical Position
-                if (params.size() >= 2) {
-                    // Parameters are 1-based, convert to 0-based
-                    m_cursorY = qBound(0, params[0] - 1, m_rows - 1);
-                    m_cursorX = qBound(0, params[1] - 1, m_cols - 1);
-                } else {
-                    // Move to home position (0,0)
-                    m_cursorX = 0;
-                    m_cursorY = 0;
-                }
-                break;
-                
-            case 'A': // CUU - Cursor Up
-                m_cursorY = qMax(0, m_cursorY - qMax(1, params[0]));
-                break;
-                
-            case 'B': // CUD - Cursor Down
-                m_cursorY = qMin(m_rows - 1, m_cursorY + qMax(1, params[0]));
-                break;
-                
-            case 'C': // CUF - Cursor Forward
-                m_cursorX = qMin(m_cols - 1, m_cursorX + qMax(1, params[0]));
-                break;
-                
-            case 'D': // CUB - Cursor Back
-                m_cursorX = qMax(0, m_cursorX - qMax(1, params[0]));
-                break;
-                
-            case 'G': // CHA - Cursor Horizontal Absolute
-                m_cursorX = qBound(0, params[0] - 1, m_cols - 1);
-                break;
-                
-            case 'J': // ED - Erase in Display
-                switch (params[0]) {
-                    case 0: // Clear from cursor to end of screen
-                        clearScreen(m_cursorY, m_cursorX, m_rows - 1, m_cols - 1);
-                        break;
-                    case 1: // Clear from beginning of screen to cursor
-                        clearScreen(0, 0, m_cursorY, m_cursorX);
-                        break;
-                    case 2: // Clear entire screen
-                    case 3: // Clear entire screen and scrollback (treated the same)
-                        clearScreen(0, 0, m_rows - 1, m_cols - 1);
-                        break;
-                }
-                break;
-                
-            case 'K': // EL - Erase in Line
-                switch (params[0]) {
-                    case 0: // Clear from cursor to end of line
-                        clearLine(m_cursorY, m_cursorX, m_cols - 1);
-                        break;
-                    case 1: // Clear from beginning of line to cursor
-                        clearLine(m_cursorY, 0, m_cursorX);
-                        break;
-                    case 2: // Clear entire line
-                        clearLine(m_cursorY, 0, m_cols - 1);
-                        break;
-                }
-                break;
-                
-            case 's': // SCP - Save Cursor Position
-                m_savedCursorX = m_cursorX;
-                m_savedCursorY = m_cursorY;
-                break;
-                
-            case 'u': // RCP - Restore Cursor Position
-                m_cursorX = m_savedCursorX;
-                m_cursorY = m_savedCursorY;
-                break;
-                
-            case 'l': // Reset Mode
-            case 'h': // Set Mode
-                if (privateMode) {
-                    // Handle private mode sequences
-                    for (int param : params) {
-                        switch (param) {
-                            case 25: // Show/hide cursor
-                                m_cursorVisible = (finalChar == 'h');
-                                break;
-                            // Add more private mode handlers as needed
-                        }
-                    }
-                }
-                break;
-                
-            case 'd': // VPA - Line Position Absolute
-                m_cursorY = qBound(0, params[0] - 1, m_rows - 1);
-                break;
-                
-            case 'r': // DECSTBM - Set Top and Bottom Margins (scrolling region)
-                // Ignoring for now, but important for some complex terminal programs
-                break;
-                
-            case 'n': // DSR - Device Status Report
-                if (params[0] == 6) {
-                    // Report cursor position - not implementing response
-                }
-                break;
-        }
+    SessionSettings m_settings;
+    GlyphCache *m_glyphCache;
+    PtyReactor *m_reactor;
+    ShellPool *m_shells;
+    QByteArray m_path;
+    int m_listenFd;
+    QSocketNotifier *m_listenNotifier;
+    QHash<int, Client> m_clients;
+    QPointer<TerminalWindow> m_lastWindow;
+};
+
+// korzeterm --client [--tab]: ask the server for a window, or a tab in its
+// most recent window, in the current directory. Returns the exit status, or
+// -1 if no server is running.
+static int runClient(bool tab) {
+    int fd = connectToServer();
+    if (fd < 0) {
+        return -1;
     }
     
-    void processSGR(const QVector<int> &params) {
-        // Process SGR parameters
-        for (int i = 0; i < params.size(); i++) {
-            int param = params[i];
-            
-            switch (param) {
-                case 0: // Reset all attributes
-                    m_currentFg = m_defaultFg;
-                    m_currentBg = m_defaultBg;
-                    m_bold = false;
-                    m_italic = false;
-                    m_underline = false;
-                    break;
-                    
-                case 1: // Bold
-                    m_bold = true;
-                    break;
-                    
-                case 3: // Italic
-                    m_italic = true;
-                    break;
-                    
-                case 4: // Underline
-                    m_underline = true;
-                    break;
-                    
-                case 22: // Normal intensity (not bold)
-                    m_bold = false;
-                    break;
-                    
-                case 23: // Not italic
-                    m_italic = false;
-                    break;
-                    
-                case 24: // Not underlined
-                    m_underline = false;
-                    break;
-                    
-                case 30: case 31: case 32: case 33: // Foreground colors
-                case 34: case 35: case 36: case 37:
-                    m_currentFg = m_colorPalette[param - 30];
-                    break;
-                    
-                case 38: // Extended foreground color
-                    if (i + 2 < params.size() && params[i + 1] == 5) { // 256 color mode
-                        int colorIndex = params[i + 2];
-                        if (colorIndex >= 0 && colorIndex < 256) {
-                            m_currentFg = m_colorPalette[colorIndex];
-                        }
-                        i += 2; // Skip the next two parameters
-                    } else if (i + 4 < params.size() && params[i + 1] == 2) { // RGB mode
-                        int r = params[i + 2];
-                        int g = params[i + 3];
-                        int b = params[i + 4];
-                        m_currentFg = QColor(r, g, b);
-                        i += 4; // Skip the next four parameters
-                    }
-                    break;
-                    
-                case 39: // Default foreground color
-                    m_currentFg = m_defaultFg;
-                    break;
-                    
-                case 40: case 41: case 42: case 43: // Background colors
-                case 44: case 45: case 46: case 47:
-                    m_currentBg = m_colorPalette[param - 40];
-                    break;
-                    
-                case 48: // Extended background color
-                    if (i + 2 < params.size() && params[i + 1] == 5) { // 256 color mode
-                        int colorIndex = params[i + 2];
-                        if (colorIndex >= 0 && colorIndex < 256) {
-                            m_currentBg = m_colorPalette[colorIndex];
-                        }
-                        i += 2; // Skip the next two parameters
-                    } else if (i + 4 < params.size() && params[i + 1] == 2) { // RGB mode
-                        int r = params[i + 2];
-                        int g = params[i + 3];
-                        int b = params[i + 4];
-                        m_currentBg = QColor(r, g, b);
-                        i += 4; // Skip the next four parameters
-                    }
-                    break;
-                    
-                case 49: // Default background color
-                    m_currentBg = m_defaultBg;
-                    break;
-                    
-                case 90: case 91: case 92: case 93: // Bright foreground colors
-                case 94: case 95: case 96: case 97:
-                    m_currentFg = m_colorPalette[param - 90 + 8];
-                    break;
-                    
-                case 100: case 101: case 102: case 103: // Bright background colors
-                case 104: case 105: case 106: case 107:
-                    m_currentBg = m_colorPalette[param - 100 + 8];
-                    break;
-            }
-        }
+    // Without a directory that fits on the line the session starts where
+    // the server was started
+    char directory[PATH_MAX];
+    if (!getcwd(directory, sizeof(directory)) || strchr(directory, '\n')) {
+        directory[0] = '\0';
     }
+    std::string request = std::string(tab ? "tab " : "window ") + directory + "\n";
     
-    void clearScreen(int startRow, int startCol, int endRow, int endCol) {
-        for (int y = startRow; y <= endRow; y++) {
-            for (int x = (y == startRow ? startCol : 0); 
-                 x <= (y == endRow ? endCol : m_cols - 1); x++) {
-                m_buffer[y][x] = TermChar();
-            }
+    size_t offset = 0;
+    while (offset < request.size()) {
+        ssize_t written = write(fd, request.data() + offset, request.size() - offset);
+        if (written < 0 && errno != EINTR) {
+            fprintf(stderr, "korzeterm: cannot reach the server: %s\n", strerror(errno));
+            ::close(fd);
+            return 1;
         }
+        offset += size_t(qMax(ssize_t(0), written));
     }
     
-    void clearLine(int row, int startCol, int endCol) {
-        for (int x = startCol; x <= endCol; x++) {
-            m_buffer[row][x] = TermChar();
+    // Wait for the window to be opened, but not forever on a stuck server
+    char reply[256];
+    size_t length = 0;
+    struct pollfd pollFd;
+    pollFd.fd = fd;
+    pollFd.events = POLLIN;
+    while (length < sizeof(reply) - 1 && !memchr(reply, '\n', length) && poll(&pollFd, 1, 5000) > 0) {
+        ssize_t count = read(fd, reply + length, sizeof(reply) - 1 - length);
+        if (count <= 0) {
+            break;
         }
+        length += size_t(count);
     }
+    ::close(fd);
+    reply[length] = '\0';
     
-    void scrollUp() {
-        // Move all lines up one position
-        for (int y = 0; y < m_rows - 1; y++) {
-            m_buffer[y] = m_buffer[y + 1];
+    if (strncmp(reply, "ok\n", 3) != 0) {
+        fprintf(stderr, "korzeterm: the server did not open a window%s%s", length ? ": " : "\n", reply);
+        return 1;
+    }
+    return 0;
+}
+
+// Run the workloads of korzeterm-bench, then any recordings, through an
+// 80x24 session without a child, painting it into an image after every
+// chunk. This is the training run of profile-guided builds, so it goes
+// through the same parser and QPainter renderer as a live session.
+static int runReplay(int argc, char *argv[]) {
+    size_t size = 4 * 1024 * 1024;
+    std::vector<const char *> recordings;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--mb") == 0 && i + 1 < argc) {
+            size = size_t(std::max(1, atoi(argv[++i]))) * 1024 * 1024;
+        } else {
+            recordings.push_back(argv[i]);
         }
-        
-        // Clear the bottom line
-        for (int x = 0; x < m_cols; x++) {
-            m_buffer[m_rows - 1][x] = TermChar();
+    }
+    
+    QFont font = terminalFont();
+    GlyphCache glyphCache(font);
+    QFontMetrics metrics(font);
+    
+    ShellProcess noShell = {-1, -1};
+    TerminalWidget session(&glyphCache, nullptr, noShell);
+    session.resize(metrics.horizontalAdvance('M') * 80, metrics.height() * 24);
+    QImage image(session.size(), QImage::Format_RGB32);
+    
+    std::vector<std::pair<std::string, std::string>> streams;
+    for (const Workload &workload : kWorkloads) {
+        streams.push_back(std::make_pair(std::string(workload.name), workload.make(size)));
+    }
+    int result = 0;
+    for (const char *recording : recordings) {
+        std::string data;
+        if (!readFile(recording, &data)) {
+            fprintf(stderr, "Failed to read %s: %s\n", recording, strerror(errno));
+            result = 1;
+            continue;
         }
+        streams.push_back(std::make_pair(std::string(recording), data));
     }
     
-private slots:
-    void readFromPty() {
-        if (m_masterFd < 0) {
-            return;
+    for (const std::pair<std::string, std::string> &stream : streams) {
+        const std::string &data = stream.second;
+        QElapsedTimer timer;
+        timer.start();
+        for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+            size_t length = std::min(kChunkSize, data.size() - offset);
+            session.replay(data.data() + offset, int(length));
+            session.render(&image);
         }
-        
-        // Read data from the PTY
-        char buffer[4096];
-        ssize_t bytesRead = read(m_masterFd, buffer, sizeof(buffer) - 1);
-        
-        if (bytesRead > 0) {
-            // Null-terminate the data
-            buffer[bytesRead] = '\0';
-            
-            // Process the data
-            processOutput(QByteArray(buffer, bytesRead));
-        } else if (bytesRead == -1 && errno != EAGAIN) {
-            // An error occurred
-            qDebug() << "Error reading from PTY: " << strerror(errno);
+        double seconds = qMax(qint64(1), timer.nsecsElapsed()) / 1e9;
+        printf("%-24s %10.1f MB/s\n", stream.first.c_str(), data.size() / (1024.0 * 1024.0) / seconds);
+    }
+    return result;
+}
+
+// Include moc file since we're using Q_OBJECT
+#include "main.moc"
+
+// Replace BUILD_COMMAND() with regular main
+int main(int argc, char *argv[]) {
+    // --client [--tab] hands the window over to a running server without
+    // starting Qt, and without one opens it here as usual
+    if (argc > 1 && strcmp(argv[1], "--client") == 0) {
+        int result = runClient(argc > 2 && strcmp(argv[2], "--tab") == 0);
+        if (result >= 0) {
+            return result;
         }
     }
+    bool serving = argc > 1 && strcmp(argv[1], "--server") == 0;
     
-private:
-    QFont m_font;
-    QFontMetrics *m_fontMetrics;
-    int m_charWidth;
-    int m_charHeight;
-    
-    int m_rows;
-    int m_cols;
-    QVector<QVector<TermChar>> m_buffer;
+    // --replay [--mb N] [recording...] paints the benchmark workloads
+    // offscreen instead of opening a window
+    bool replaying = argc > 1 && strcmp(argv[1], "--replay") == 0;
+    if (replaying && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
     
-    QVector<QColor> m_colorPalette;
-    QColor m_defaultFg;
-    QColor m_defaultBg;
-    QColor m_currentFg;
-    QColor m_currentBg;
-    QColor m_cursorColor;
+    // KORZETERM_RENDERER=opengl presents through the GPU; the QPainter
+    // renderer stays the default and the fallback
+    QByteArray renderer = qgetenv("KORZETERM_RENDERER");
+    bool useOpenGL = renderer == "opengl" || renderer == "gl";
+    if (useOpenGL && QOpenGLContext::openGLModuleType() == QOpenGLContext::LibGL) {
+        QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+        format.setVersion(3, 3);
+        format.setProfile(QSurfaceFormat::CoreProfile);
+        QSurfaceFormat::setDefaultFormat(format);
+    }
     
-    int m_cursorX;
-    int m_cursorY;
-    int m_savedCursorX = 0;
-    int m_savedCursorY = 0;
-    bool m_cursorVisible;
-    bool m_pendingNewline = false; // Track newline state
+    // Every session draws from the same glyph atlas
+    if (useOpenGL) {
+        QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
+    }
     
-    // Text attributes
-    bool m_bold;
-    bool m_italic;
-    bool m_underline;
+    QApplication app(argc, argv);
+    if (replaying) {
+        return runReplay(argc - 2, argv + 2);
+    }
     
-    // UTF-8 processing
-    int m_utf8Remaining = 0;
-    uint32_t m_utf8CodePoint = 0;
-    QByteArray m_utf8Buffer;
+    // Sessions reap their own shells, and this reaps the ones they leave
+    // behind still running
+    ChildReaper reaper;
     
-    // Escape sequence processing
-    EscapeState m_escapeState;
-    QString m_escapeSequence;
+    SessionSettings settings;
     
-    pid_t m_childPid;
-    int m_masterFd;
+    // Scrollback size can be tuned from the environment
+    bool linesSet = false;
+    bool megabytesSet = false;
+    settings.scrollbackLines = qEnvironmentVariableIntValue("KORZETERM_SCROLLBACK_LINES", &linesSet);
+    settings.scrollbackMegabytes = qEnvironmentVariableIntValue("KORZETERM_SCROLLBACK_MB", &megabytesSet);
+    if (!linesSet) {
+        settings.scrollbackLines = Scrollback::kDefaultMaxLines;
+    }
+    if (!megabytesSet) {
+        settings.scrollbackMegabytes = Scrollback::kDefaultMaxMegabytes;
+    }
     
-    QTimer *m_readTimer;
-    QTimer *m_cursorBlinkTimer;
-};
-
-// Include moc file since we're using Q_OBJECT
-#include "main.moc"
-
-// Replace BUILD_COMMAND() with regular main
-int main(int argc, char *argv[]) {
-    QApplication app(argc, argv);
+    // Optional frame rate cap, the display refresh rate by default
+    settings.maxFrameRate = qEnvironmentVariableIntValue("KORZETERM_FPS");
+    settings.openGL = useOpenGL;
     
-    QMainWindow window;
-    window.setWindowTitle("KorzeTerm");
-    window.resize(800, 600);
+    // KORZETERM_HUD=1 opens every session with the performance HUD shown
+    settings.perfHud = qEnvironmentVariableIntValue("KORZETERM_HUD") != 0;
     
-    QWidget *centralWidget = new QWidget(&window);
-    window.setCentralWidget(centralWidget);
+    // Shared by every session and window of the process
+    GlyphCache glyphCache(terminalFont());
+    PtyReactor reactor;
+    reactor.start();
+    ShellPool shells;
     
-    QVBoxLayout *layout = new QVBoxLayout(centralWidget);
-    layout->setContentsMargins(0, 0, 0, 0);
-    layout->setSpacing(0);
+    // The server opens no window of its own and outlives the ones it opens.
+    // It keeps a spare shell forked unless KORZETERM_SPARE_SHELL=0.
+    if (serving) {
+        app.setQuitOnLastWindowClosed(false);
+        QByteArray spare = qgetenv("KORZETERM_SPARE_SHELL");
+        char directory[PATH_MAX];
+        shells.setKeepSpare(spare != "0", getcwd(directory, sizeof(directory)) ? QByteArray(directory) : QByteArray());
+        
+        TerminalServer server(settings, &glyphCache, &reactor, &shells);
+        if (!server.listen()) {
+            return 1;
+        }
+        return app.exec();
+    }
     
-    TerminalWidget *terminal = new TerminalWidget(centralWidget);
-    layout->addWidget(terminal);
+    TerminalWindow window(settings, &glyphCache, &reactor, &shells, QByteArray());
+    window.resize(800, 600);
     
     window.show();
     return app.exec();
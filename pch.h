@@ -0,0 +1,10 @@
+// Precompiled by the build script and forced into main.cpp with -include, so
+// that the Qt headers are parsed once instead of on every build. main.cpp
+// still includes what it uses; the include guards make those free.
+
+#include <QtWidgets>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
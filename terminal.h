@@ -0,0 +1,2016 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2025 Korzeterm Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Terminal core: cell storage, scrollback and the escape sequence parser.
+// This header has no Qt dependency so the parser and screen model can be
+// driven without a window or a PTY.
+
+#ifndef KORZETERM_TERMINAL_H
+#define KORZETERM_TERMINAL_H
+
+#include <stdint.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "unicode.h"
+
+// Cell attribute bits (TermCell::attrs)
+enum CellAttr : uint16_t {
+    AttrBold      = 1 << 0,
+    AttrItalic    = 1 << 1,
+    AttrUnderline = 1 << 2
+};
+
+// Color indices stored in cells: 0-255 are the xterm-256 palette, followed
+// by the default colors and then interned truecolor values
+enum : uint16_t {
+    ColorDefaultFg = 256,
+    ColorDefaultBg = 257,
+    ColorFirstInterned = 258
+};
+
+// Packed terminal cell: 21-bit codepoint and attribute bits share one word,
+// followed by foreground and background color-table indices (8 bytes total)
+struct TermCell {
+    uint32_t codepoint : 21;
+    uint32_t attrs : 11;
+    uint16_t fg;
+    uint16_t bg;
+};
+
+static_assert(sizeof(TermCell) == 8, "TermCell should pack into 8 bytes");
+
+static const TermCell kBlankCell = { ' ', 0, ColorDefaultFg, ColorDefaultBg };
+
+// Escape sequence parser, after the DEC VT500 state machine described by
+// Paul Williams (vt100.net/emu/dec_ansi_parser). Every (state, byte) pair is
+// looked up in a table built at compile time that yields the action to run and
+// the next state. C1 controls are not recognised since 0x80-0x9F are UTF-8
+// continuation bytes; UTF-8 text is decoded in the ground state before it
+// reaches the table.
+namespace vt {
+
+enum State : uint8_t {
+    Ground,
+    Escape,
+    EscapeIntermediate,
+    CsiEntry,
+    CsiParam,
+    CsiIntermediate,
+    CsiIgnore,
+    DcsEntry,
+    DcsParam,
+    DcsIntermediate,
+    DcsPassthrough,
+    DcsIgnore,
+    OscString,
+    SosPmApcString,
+    StateCount
+};
+
+enum Action : uint8_t {
+    ActionNone,         // Consume the byte
+    ActionPrint,        // Printable character in the ground state
+    ActionExecute,      // C0 control
+    ActionClear,        // Start of a new sequence
+    ActionCollect,      // Intermediate or private-marker byte
+    ActionParam,        // Digit, ';' or ':'
+    ActionEscDispatch,  // Final byte of an ESC sequence
+    ActionCsiDispatch   // Final byte of a control sequence
+};
+
+// Table entries pack the action into the high nibble and the next state into
+// the low nibble
+struct ParserTable {
+    uint8_t entries[StateCount][256];
+    
+    constexpr ParserTable() : entries() {
+        // Bytes not covered below (including 0x80-0xFF outside the ground
+        // state) are ignored without changing state
+        for (int state = 0; state < StateCount; state++) {
+            set(State(state), 0x00, 0xFF, ActionNone, State(state));
+        }
+        
+        set(Ground, 0x00, 0x1F, ActionExecute, Ground);
+        set(Ground, 0x20, 0x7E, ActionPrint, Ground);
+        set(Ground, 0x80, 0xFF, ActionPrint, Ground);
+        
+        set(Escape, 0x00, 0x1F, ActionExecute, Escape);
+        set(Escape, 0x20, 0x2F, ActionCollect, EscapeIntermediate);
+        set(Escape, 0x30, 0x7E, ActionEscDispatch, Ground);
+        set(Escape, '[', '[', ActionClear, CsiEntry);
+        set(Escape, ']', ']', ActionNone, OscString);
+        set(Escape, 'P', 'P', ActionClear, DcsEntry);
+        set(Escape, 'X', 'X', ActionNone, SosPmApcString);
+        set(Escape, '^', '_', ActionNone, SosPmApcString);
+        
+        set(EscapeIntermediate, 0x00, 0x1F, ActionExecute, EscapeIntermediate);
+        set(EscapeIntermediate, 0x20, 0x2F, ActionCollect, EscapeIntermediate);
+        set(EscapeIntermediate, 0x30, 0x7E, ActionEscDispatch, Ground);
+        
+        set(CsiEntry, 0x00, 0x1F, ActionExecute, CsiEntry);
+        set(CsiEntry, 0x20, 0x2F, ActionCollect, CsiIntermediate);
+        set(CsiEntry, 0x30, 0x3B, ActionParam, CsiParam);
+        set(CsiEntry, 0x3C, 0x3F, ActionCollect, CsiParam);
+        set(CsiEntry, 0x40, 0x7E, ActionCsiDispatch, Ground);
+        
+        set(CsiParam, 0x00, 0x1F, ActionExecute, CsiParam);
+        set(CsiParam, 0x20, 0x2F, ActionCollect, CsiIntermediate);
+        set(CsiParam, 0x30, 0x3B, ActionParam, CsiParam);
+        set(CsiParam, 0x3C, 0x3F, ActionNone, CsiIgnore);
+        set(CsiParam, 0x40, 0x7E, ActionCsiDispatch, Ground);
+        
+        set(CsiIntermediate, 0x00, 0x1F, ActionExecute, CsiIntermediate);
+        set(CsiIntermediate, 0x20, 0x2F, ActionCollect, CsiIntermediate);
+        set(CsiIntermediate, 0x30, 0x3F, ActionNone, CsiIgnore);
+        set(CsiIntermediate, 0x40, 0x7E, ActionCsiDispatch, Ground);
+        
+        set(CsiIgnore, 0x00, 0x1F, ActionExecute, CsiIgnore);
+        set(CsiIgnore, 0x40, 0x7E, ActionNone, Ground);
+        
+        // Device control strings are recognised so that their payload is
+        // skipped, but nothing is dispatched
+        set(DcsEntry, 0x20, 0x2F, ActionCollect, DcsIntermediate);
+        set(DcsEntry, 0x30, 0x3B, ActionParam, DcsParam);
+        set(DcsEntry, 0x3A, 0x3A, ActionNone, DcsIgnore);
+        set(DcsEntry, 0x3C, 0x3F, ActionCollect, DcsParam);
+        set(DcsEntry, 0x40, 0x7E, ActionNone, DcsPassthrough);
+        
+        set(DcsParam, 0x20, 0x2F, ActionCollect, DcsIntermediate);
+        set(DcsParam, 0x30, 0x3B, ActionParam, DcsParam);
+        set(DcsParam, 0x3A, 0x3A, ActionNone, DcsIgnore);
+        set(DcsParam, 0x3C, 0x3F, ActionNone, DcsIgnore);
+        set(DcsParam, 0x40, 0x7E, ActionNone, DcsPassthrough);
+        
+        set(DcsIntermediate, 0x20, 0x2F, ActionCollect, DcsIntermediate);
+        set(DcsIntermediate, 0x30, 0x3F, ActionNone, DcsIgnore);
+        set(DcsIntermediate, 0x40, 0x7E, ActionNone, DcsPassthrough);
+        
+        // OSC strings end with BEL or ST (ESC \); their contents are dropped
+        set(OscString, 0x07, 0x07, ActionNone, Ground);
+        
+        // Transitions that apply in every state
+        for (int state = 0; state < StateCount; state++) {
+            set(State(state), 0x18, 0x18, ActionExecute, Ground);
+            set(State(state), 0x1A, 0x1A, ActionExecute, Ground);
+            set(State(state), 0x1B, 0x1B, ActionClear, Escape);
+        }
+    }
+    
+    constexpr void set(State state, int first, int last, Action action, State next) {
+        for (int c = first; c <= last; c++) {
+            entries[state][c] = uint8_t((action << 4) | next);
+        }
+    }
+};
+
+static constexpr ParserTable kParserTable;
+
+// Numeric parameters of a control sequence, collected in place. Values
+// introduced by ':' are flagged as sub-parameters of the value before them.
+struct Params {
+    enum { kMaxParams = 32, kMaxValue = 65535 };
+    
+    int values[kMaxParams];
+    int count;
+    uint32_t subParams;         // Bit i set if values[i] followed a ':'
+    char privateMarker;         // One of "<=>?", or 0
+    char intermediates[2];
+    int numIntermediates;
+    
+    void clear() {
+        values[0] = 0;
+        count = 1;
+        subParams = 0;
+        privateMarker = 0;
+        numIntermediates = 0;
+    }
+    
+    void addDigit(int digit) {
+        int &value = values[count - 1];
+        value = value * 10 + digit;
+        if (value > kMaxValue) {
+            value = kMaxValue;
+        }
+    }
+    
+    void nextParam(bool subParam) {
+        if (count < kMaxParams) {
+            if (subParam) {
+                subParams |= 1u << count;
+            }
+            values[count++] = 0;
+        }
+    }
+    
+    void collect(char c) {
+        if (c >= 0x3C && c <= 0x3F) {
+            privateMarker = c;
+        } else if (numIntermediates < 2) {
+            intermediates[numIntermediates++] = c;
+        }
+    }
+    
+    int size() const { return count; }
+    const int &operator[](int i) const { return values[i]; }
+    const int *begin() const { return values; }
+    const int *end() const { return values + count; }
+    
+    bool isSubParam(int i) const {
+        return i < count && (subParams & (1u << i));
+    }
+};
+
+} // namespace vt
+
+// Length of the run of printable ASCII (0x20-0x7E) at the start of data.
+// Plain text makes up most terminal output, so the parser hands such runs
+// to the screen in bulk instead of byte by byte. Both x86 variants use
+// signed byte compares: anything >= 0x80 is negative and fails the lower
+// bound along with the C0 controls.
+static inline int printableAsciiRunScalar(const char *data, int length, int i) {
+    while (i < length && data[i] >= 0x20 && data[i] < 0x7F) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int printableAsciiRunAvx2(const char *data, int length) {
+    const __m256i low = _mm256_set1_epi8(0x1F);
+    const __m256i high = _mm256_set1_epi8(0x7F);
+    int i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        __m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, low), _mm256_cmpgt_epi8(high, bytes));
+        uint32_t stop = ~uint32_t(_mm256_movemask_epi8(printable));
+        if (stop) {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    return printableAsciiRunScalar(data, length, i);
+}
+
+static int printableAsciiRunSse2(const char *data, int length) {
+    const __m128i low = _mm_set1_epi8(0x1F);
+    const __m128i high = _mm_set1_epi8(0x7F);
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, low), _mm_cmpgt_epi8(high, bytes));
+        uint32_t stop = ~uint32_t(_mm_movemask_epi8(printable)) & 0xFFFF;
+        if (stop) {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    return printableAsciiRunScalar(data, length, i);
+}
+
+static int printableAsciiRun(const char *data, int length) {
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    return hasAvx2 ? printableAsciiRunAvx2(data, length) : printableAsciiRunSse2(data, length);
+}
+#elif defined(__ARM_NEON)
+static int printableAsciiRun(const char *data, int length) {
+    const uint8x16_t low = vdupq_n_u8(0x1F);
+    const uint8x16_t high = vdupq_n_u8(0x7F);
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(data + i));
+        uint8x16_t printable = vandq_u8(vcgtq_u8(bytes, low), vcltq_u8(bytes, high));
+        
+        // No movemask on NEON: test each half as a 64-bit word
+        uint64x2_t halves = vreinterpretq_u64_u8(printable);
+        uint64_t stopLow = ~vgetq_lane_u64(halves, 0);
+        uint64_t stopHigh = ~vgetq_lane_u64(halves, 1);
+        if (stopLow) {
+            return i + __builtin_ctzll(stopLow) / 8;
+        }
+        if (stopHigh) {
+            return i + 8 + __builtin_ctzll(stopHigh) / 8;
+        }
+    }
+    return printableAsciiRunScalar(data, length, i);
+}
+#else
+static int printableAsciiRun(const char *data, int length) {
+    return printableAsciiRunScalar(data, length, 0);
+}
+#endif
+
+// Bounded scrollback history. Lines are trimmed of trailing blanks and packed
+// back to back into fixed-size blocks of cells. Once the line or byte limit is
+// exceeded the oldest lines are dropped, and emptied blocks are recycled so a
+// full history scrolls without allocating.
+//
+// A screen line that was soft-wrapped is joined with the one that follows it,
+// so the history holds logical lines and is read back as rows of the current
+// width. Changing the width only invalidates the row counts; they are
+// recomputed the next time the history is read.
+//
+// Each block also carries a bloom filter of the case-folded trigrams in it,
+// so that a search only has to scan the blocks that may contain the text.
+// The filter is built by the first search that reaches the block, on the
+// search's thread, which keeps the work off the parser for output nobody
+// searches. Only the newest block is ever written to: older ones are shared
+// read-only with searches running on other threads, and are not recycled
+// while a search still holds them.
+class Scrollback {
+public:
+    static const int kDefaultMaxLines = 10000;
+    static const int kDefaultMaxMegabytes = 32;
+    static const int kBloomBits = 32768;
+    
+    struct BlockData {
+        std::vector<TermCell> cells;
+        std::vector<uint32_t> lineEnds;  // End offset of each line in cells
+        
+        // Written by indexBlock(), from the one thread searching the history
+        mutable bool indexed = false;
+        mutable uint64_t bloom[kBloomBits / 64];
+    };
+    
+    // A block as handed to a search: its lines from firstLocal on are
+    // absolute lines firstLine + firstLocal onwards
+    struct SearchBlock {
+        std::shared_ptr<const BlockData> data;
+        int64_t firstLine;
+        int firstLocal;
+    };
+    
+    Scrollback() : m_maxLines(kDefaultMaxLines), m_maxBytes(size_t(kDefaultMaxMegabytes) * 1024 * 1024),
+                   m_firstLine(0), m_endLine(0), m_openLine(false), m_width(80), m_layoutWidth(0),
+                   m_rowCount(0) {}
+    
+    void setLimits(int maxLines, size_t maxBytes) {
+        m_maxLines = std::max(0, maxLines);
+        m_maxBytes = maxBytes;
+        enforceLimits();
+    }
+    
+    // Width the history is read back at
+    void setWidth(int width) {
+        width = std::max(1, width);
+        if (width != m_width) {
+            m_width = width;
+            m_layoutWidth = 0;
+        }
+    }
+    
+    // Rows at the current width
+    int size() const {
+        updateLayout();
+        return int(m_rowCount);
+    }
+    
+    // Absolute number of the oldest line held and one past the newest
+    int64_t firstLine() const { return m_firstLine; }
+    int64_t endLine() const { return m_endLine; }
+    
+    // Add a screen line. If it was soft-wrapped, the next line pushed
+    // continues it.
+    void push(const TermCell *cells, int length, bool wrapped = false) {
+        if (m_maxLines == 0) {
+            return;
+        }
+        
+        // Trailing blanks are implied by the line length, except where the
+        // text carries on into the next line
+        while (!wrapped && length > 0 && isBlank(cells[length - 1])) {
+            length--;
+        }
+        if (length > kBlockCells) {
+            length = kBlockCells;
+        }
+        
+        bool join = m_openLine && !m_blocks.empty() && openLineLength() + length <= kBlockCells;
+        m_openLine = wrapped;
+        if (join) {
+            extendOpenLine(cells, length);
+            enforceLimits();
+            return;
+        }
+        
+        if (m_blocks.empty() || m_blocks.back().data->cells.size() + length > size_t(kBlockCells)) {
+            m_blocks.push_back(takeBlock());
+            m_blocks.back().firstLine = m_endLine;
+        }
+        
+        Block &block = m_blocks.back();
+        BlockData &data = *block.data;
+        data.cells.insert(data.cells.end(), cells, cells + length);
+        data.lineEnds.push_back(uint32_t(data.cells.size()));
+        m_endLine++;
+        addRows(block, rowsFor(length));
+        
+        enforceLimits();
+    }
+    
+    // Row 0 is the oldest row still held; returns its cells and length.
+    // The absolute line the row belongs to and the column it starts at
+    // within that line are stored if asked for.
+    const TermCell *line(int index, int *length, int64_t *lineNumber = nullptr, int *column = nullptr) const {
+        updateLayout();
+        
+        // Rows are nearly always read close to the newest end, so walk the
+        // blocks and their lines backwards from there
+        int64_t remaining = m_rowCount - index;
+        std::deque<Block>::const_iterator it = m_blocks.end();
+        do {
+            --it;
+            if (remaining <= it->rows) {
+                break;
+            }
+            remaining -= it->rows;
+        } while (it != m_blocks.begin());
+        
+        const BlockData &data = *it->data;
+        int firstLocal = int(std::max<int64_t>(0, m_firstLine - it->firstLine));
+        int local = int(data.lineEnds.size()) - 1;
+        int rows = rowsFor(lineLength(data, local));
+        while (local > firstLocal && remaining > rows) {
+            remaining -= rows;
+            local--;
+            rows = rowsFor(lineLength(data, local));
+        }
+        
+        int offset = (rows - int(remaining)) * m_width;
+        if (lineNumber) {
+            *lineNumber = it->firstLine + local;
+        }
+        if (column) {
+            *column = offset;
+        }
+        *length = std::min(m_width, lineLength(data, local) - offset);
+        return data.cells.data() + lineStart(data, local) + offset;
+    }
+    
+    // Row index of a column of an absolute line at the current width, or -1
+    // if the line is no longer held
+    int rowOf(int64_t lineNumber, int column) const {
+        if (lineNumber < m_firstLine || lineNumber >= m_endLine) {
+            return -1;
+        }
+        updateLayout();
+        
+        int64_t rowsAfter = 0;
+        std::deque<Block>::const_iterator it = m_blocks.end();
+        do {
+            --it;
+            if (lineNumber >= it->firstLine) {
+                break;
+            }
+            rowsAfter += it->rows;
+        } while (it != m_blocks.begin());
+        
+        const BlockData &data = *it->data;
+        int target = int(lineNumber - it->firstLine);
+        for (int local = int(data.lineEnds.size()) - 1; local > target; local--) {
+            rowsAfter += rowsFor(lineLength(data, local));
+        }
+        int rows = rowsFor(lineLength(data, target));
+        int row = std::min(column / m_width, rows - 1);
+        return int(m_rowCount - rowsAfter - rows + row);
+    }
+    
+    // All blocks for a search, newest first. Blocks that are full are shared
+    // as they are; the newest one is still being written to and is copied.
+    std::vector<SearchBlock> searchSnapshot() const {
+        std::vector<SearchBlock> blocks;
+        blocks.reserve(m_blocks.size());
+        for (std::deque<Block>::const_reverse_iterator it = m_blocks.rbegin(); it != m_blocks.rend(); ++it) {
+            SearchBlock block;
+            if (it == m_blocks.rbegin()) {
+                block.data = std::make_shared<BlockData>(*it->data);
+            } else {
+                block.data = it->data;
+            }
+            block.firstLine = it->firstLine;
+            block.firstLocal = int(std::max<int64_t>(0, m_firstLine - it->firstLine));
+            blocks.push_back(block);
+        }
+        return blocks;
+    }
+    
+    void clear() {
+        while (!m_blocks.empty()) {
+            dropOldestBlock();
+        }
+        m_firstLine = m_endLine;
+        m_openLine = false;
+    }
+    
+    // Search helpers: ASCII case folding and the bloom filter bit of a
+    // trigram of case-folded codepoints
+    static uint32_t foldCase(uint32_t codepoint) {
+        return codepoint >= 'A' && codepoint <= 'Z' ? codepoint + ('a' - 'A') : codepoint;
+    }
+    
+    static int trigramBit(uint32_t a, uint32_t b, uint32_t c) {
+        uint32_t hash = (a * 0x9E3779B1u) ^ (b * 0x85EBCA77u) ^ (c * 0xC2B2AE3Du);
+        return int((hash * 0x2545F491u) >> 17);   // 15 bits for kBloomBits
+    }
+    
+    // Build a block's bloom filter if no search has yet. Each cell is folded
+    // once, and its products carried along for the two trigrams after it.
+    static void indexBlock(const BlockData &data) {
+        if (data.indexed) {
+            return;
+        }
+        
+        std::fill(data.bloom, data.bloom + kBloomBits / 64, 0);
+        for (int local = 0; local < int(data.lineEnds.size()); local++) {
+            const TermCell *cells = data.cells.data() + lineStart(data, local);
+            int length = lineLength(data, local);
+            if (length < 3) {
+                continue;
+            }
+            
+            uint32_t first = foldCase(cells[0].codepoint) * 0x9E3779B1u;
+            uint32_t second = foldCase(cells[1].codepoint) * 0x85EBCA77u;
+            uint32_t secondAsFirst = foldCase(cells[1].codepoint) * 0x9E3779B1u;
+            for (int i = 2; i < length; i++) {
+                uint32_t codepoint = foldCase(cells[i].codepoint);
+                int bit = int(((first ^ second ^ (codepoint * 0xC2B2AE3Du)) * 0x2545F491u) >> 17);
+                data.bloom[bit >> 6] |= uint64_t(1) << (bit & 63);
+                first = secondAsFirst;
+                second = codepoint * 0x85EBCA77u;
+                secondAsFirst = codepoint * 0x9E3779B1u;
+            }
+        }
+        data.indexed = true;
+    }
+    
+    static uint32_t lineStart(const BlockData &data, int local) {
+        return local > 0 ? data.lineEnds[local - 1] : 0;
+    }
+    
+    static int lineLength(const BlockData &data, int local) {
+        return int(data.lineEnds[local] - lineStart(data, local));
+    }
+    
+private:
+    struct Block {
+        std::shared_ptr<BlockData> data;
+        int64_t firstLine;                // Absolute number of the first line
+        mutable int64_t rows;             // Rows of the lines still held, at m_layoutWidth
+    };
+    
+    static const int kBlockCells = 16 * 1024;
+    static const size_t kBlockBytes = kBlockCells * sizeof(TermCell) + sizeof(BlockData);
+    
+    static_assert(kBloomBits == 1 << 15, "trigramBit() yields 15 bits");
+    
+    static bool isBlank(const TermCell &cell) {
+        return cell.codepoint == ' ' && cell.attrs == 0 && cell.bg == ColorDefaultBg;
+    }
+    
+    int rowsFor(int length) const {
+        return length <= m_width ? 1 : (length + m_width - 1) / m_width;
+    }
+    
+    int openLineLength() const {
+        const BlockData &data = *m_blocks.back().data;
+        return lineLength(data, int(data.lineEnds.size()) - 1);
+    }
+    
+    // Append cells to the newest line, moving it into a block of its own
+    // first if its current one has no room left
+    void extendOpenLine(const TermCell *cells, int length) {
+        Block *block = &m_blocks.back();
+        int oldLength = openLineLength();
+        
+        if (block->data->cells.size() + length > size_t(kBlockCells)) {
+            BlockData &data = *block->data;
+            uint32_t start = lineStart(data, int(data.lineEnds.size()) - 1);
+            Block moved = takeBlock();
+            moved.firstLine = m_endLine - 1;
+            moved.data->cells.assign(data.cells.begin() + start, data.cells.end());
+            moved.data->lineEnds.push_back(uint32_t(moved.data->cells.size()));
+            data.cells.resize(start);
+            data.lineEnds.pop_back();
+            addRows(*block, -rowsFor(oldLength));
+            m_blocks.push_back(std::move(moved));
+            block = &m_blocks.back();
+            addRows(*block, rowsFor(oldLength));
+        }
+        
+        BlockData &data = *block->data;
+        data.cells.insert(data.cells.end(), cells, cells + length);
+        data.lineEnds.back() = uint32_t(data.cells.size());
+        addRows(*block, rowsFor(oldLength + length) - rowsFor(oldLength));
+    }
+    
+    // Keep the row counts current while they are valid; stale ones are
+    // recomputed wholesale by updateLayout()
+    void addRows(Block &block, int64_t rows) {
+        if (m_layoutWidth == m_width) {
+            block.rows += rows;
+            m_rowCount += rows;
+        }
+    }
+    
+    void updateLayout() const {
+        if (m_layoutWidth == m_width) {
+            return;
+        }
+        
+        m_rowCount = 0;
+        for (const Block &block : m_blocks) {
+            int64_t rows = 0;
+            int firstLocal = int(std::max<int64_t>(0, m_firstLine - block.firstLine));
+            for (int local = firstLocal; local < int(block.data->lineEnds.size()); local++) {
+                rows += rowsFor(lineLength(*block.data, local));
+            }
+            block.rows = rows;
+            m_rowCount += rows;
+        }
+        m_layoutWidth = m_width;
+    }
+    
+    Block takeBlock() {
+        Block block;
+        if (!m_spareBlocks.empty()) {
+            block.data = m_spareBlocks.back();
+            m_spareBlocks.pop_back();
+        } else {
+            block.data = std::make_shared<BlockData>();
+            block.data->cells.reserve(kBlockCells);
+        }
+        block.data->indexed = false;
+        block.firstLine = 0;
+        block.rows = 0;
+        return block;
+    }
+    
+    void dropOldestBlock() {
+        Block &front = m_blocks.front();
+        m_firstLine = std::max(m_firstLine, front.firstLine + int64_t(front.data->lineEnds.size()));
+        addRows(front, -front.rows);
+        
+        // Keep one emptied block around for reuse, unless a search still
+        // reads it
+        if (m_spareBlocks.empty() && front.data.use_count() == 1) {
+            front.data->cells.clear();
+            front.data->lineEnds.clear();
+            m_spareBlocks.push_back(std::move(front.data));
+        }
+        m_blocks.pop_front();
+    }
+    
+    void enforceLimits() {
+        while (m_endLine - m_firstLine > m_maxLines) {
+            Block &front = m_blocks.front();
+            addRows(front, -rowsFor(lineLength(*front.data, int(m_firstLine - front.firstLine))));
+            m_firstLine++;
+            if (m_firstLine >= front.firstLine + int64_t(front.data->lineEnds.size())) {
+                dropOldestBlock();
+            }
+        }
+        
+        while (m_blocks.size() > 1 && m_blocks.size() * kBlockBytes > m_maxBytes) {
+            dropOldestBlock();
+        }
+    }
+    
+    int m_maxLines;
+    size_t m_maxBytes;
+    int64_t m_firstLine;      // Absolute number of the oldest line held
+    int64_t m_endLine;        // Absolute number one past the newest line
+    bool m_openLine;          // The newest line continues in the next push
+    std::deque<Block> m_blocks;
+    std::vector<std::shared_ptr<BlockData>> m_spareBlocks;
+    
+    // Row layout, recomputed lazily after a width change
+    int m_width;
+    mutable int m_layoutWidth;
+    mutable int64_t m_rowCount;
+};
+
+// Position of a search hit: a column range of an absolute scrollback line
+struct SearchMatch {
+    int64_t line;
+    int column;
+    int length;
+};
+
+// Literal text search over scrollback blocks, ignoring ASCII case. Blocks
+// whose bloom filter lacks any of the needle's trigrams are skipped without
+// looking at their cells; a block searched for the first time has its
+// filter built first. Matches do not span logical lines.
+class SearchPattern {
+public:
+    explicit SearchPattern(const std::vector<uint32_t> &needle) : m_needle(needle) {
+        for (uint32_t &codepoint : m_needle) {
+            codepoint = Scrollback::foldCase(codepoint);
+        }
+        for (size_t i = 0; i + 2 < m_needle.size(); i++) {
+            m_trigramBits.push_back(Scrollback::trigramBit(m_needle[i], m_needle[i + 1], m_needle[i + 2]));
+        }
+    }
+    
+    bool empty() const {
+        return m_needle.empty();
+    }
+    
+    bool mayMatch(const Scrollback::BlockData &data) const {
+        if (m_trigramBits.empty()) {
+            return true;
+        }
+        Scrollback::indexBlock(data);
+        for (int bit : m_trigramBits) {
+            if (!(data.bloom[bit >> 6] & (uint64_t(1) << (bit & 63)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Append the block's matches to out, newest first
+    void search(const Scrollback::SearchBlock &block, std::vector<SearchMatch> *out) const {
+        const Scrollback::BlockData &data = *block.data;
+        if (m_needle.empty() || !mayMatch(data)) {
+            return;
+        }
+        
+        int needleLength = int(m_needle.size());
+        for (int local = int(data.lineEnds.size()) - 1; local >= block.firstLocal; local--) {
+            const TermCell *cells = data.cells.data() + Scrollback::lineStart(data, local);
+            int length = Scrollback::lineLength(data, local);
+            for (int column = length - needleLength; column >= 0; column--) {
+                if (Scrollback::foldCase(cells[column].codepoint) == m_needle[0] && matchesAt(cells + column)) {
+                    SearchMatch match;
+                    match.line = block.firstLine + local;
+                    match.column = column;
+                    match.length = needleLength;
+                    out->push_back(match);
+                }
+            }
+        }
+    }
+    
+private:
+    bool matchesAt(const TermCell *cells) const {
+        for (size_t i = 1; i < m_needle.size(); i++) {
+            if (Scrollback::foldCase(cells[i].codepoint) != m_needle[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    std::vector<uint32_t> m_needle;     // Case-folded
+    std::vector<int> m_trigramBits;
+};
+
+// Pack a color as 0xAARRGGBB with full alpha (the layout of QRgb)
+constexpr uint32_t packRgb(int r, int g, int b) {
+    return 0xFF000000u | (uint32_t(r) << 16) | (uint32_t(g) << 8) | uint32_t(b);
+}
+
+// The xterm-256 palette with our own first 16 colors, followed by the
+// default foreground and background, built at compile time
+struct Palette {
+    uint32_t colors[ColorFirstInterned];
+    
+    constexpr Palette() : colors() {
+        // Standard colors (0-7)
+        colors[0] = packRgb(40, 40, 40);      // Black
+        colors[1] = packRgb(204, 36, 29);     // Red
+        colors[2] = packRgb(152, 151, 26);    // Green
+        colors[3] = packRgb(215, 153, 33);    // Yellow
+        colors[4] = packRgb(69, 133, 136);    // Blue
+        colors[5] = packRgb(177, 98, 134);    // Magenta
+        colors[6] = packRgb(104, 157, 106);   // Cyan
+        colors[7] = packRgb(168, 153, 132);   // White
+        
+        // Bright colors (8-15)
+        colors[8] = packRgb(146, 131, 116);   // Bright Black (Gray)
+        colors[9] = packRgb(251, 73, 52);     // Bright Red
+        colors[10] = packRgb(184, 187, 38);   // Bright Green
+        colors[11] = packRgb(250, 189, 47);   // Bright Yellow
+        colors[12] = packRgb(131, 165, 152);  // Bright Blue
+        colors[13] = packRgb(211, 134, 155);  // Bright Magenta
+        colors[14] = packRgb(142, 192, 124);  // Bright Cyan
+        colors[15] = packRgb(235, 219, 178);  // Bright White
+        
+        // 6x6x6 color cube (16-231)
+        int index = 16;
+        for (int r = 0; r < 6; r++) {
+            for (int g = 0; g < 6; g++) {
+                for (int b = 0; b < 6; b++) {
+                    colors[index++] = packRgb(cubeLevel(r), cubeLevel(g), cubeLevel(b));
+                }
+            }
+        }
+        
+        // 24 grayscale colors (232-255)
+        for (int i = 0; i < 24; i++) {
+            int value = i * 10 + 8;
+            colors[232 + i] = packRgb(value, value, value);
+        }
+        
+        colors[ColorDefaultFg] = packRgb(235, 219, 178);
+        colors[ColorDefaultBg] = packRgb(40, 40, 40);
+    }
+    
+    static constexpr int cubeLevel(int level) {
+        return level == 0 ? 0 : level * 40 + 55;
+    }
+};
+
+static constexpr Palette kPalette;
+
+// Color table indexed by TermCell::fg/bg. The palette and defaults come
+// first, followed by a bounded set of truecolor values that are reused in
+// least-recently-used order, so cells only ever hold a 16-bit index. Lookups
+// go through a small open-addressed hash and nothing here allocates after
+// construction.
+//
+// Cells that still refer to an evicted truecolor entry (typically deep in
+// the scrollback) show the color that replaced it.
+class ColorTable {
+public:
+    static constexpr int kMaxTrueColors = 4096;
+    
+    ColorTable() : m_used(0), m_newest(kNone), m_oldest(kNone) {
+        std::copy(kPalette.colors, kPalette.colors + ColorFirstInterned, m_colors);
+        std::fill(m_hash, m_hash + kHashSize, kNone);
+    }
+    
+    uint32_t color(uint16_t index) const {
+        return m_colors[index];
+    }
+    
+    // Index for a truecolor value, interning it on first use
+    uint16_t intern(uint32_t rgb) {
+        int position = find(rgb);
+        int slot;
+        if (m_hash[position] != kNone) {
+            slot = m_hash[position];
+            unlink(slot);
+        } else {
+            if (m_used < kMaxTrueColors) {
+                slot = m_used++;
+            } else {
+                // Reuse the entry that has gone unused the longest
+                slot = m_oldest;
+                unlink(slot);
+                erase(m_colors[ColorFirstInterned + slot]);
+                position = find(rgb);
+            }
+            m_colors[ColorFirstInterned + slot] = rgb;
+            m_hash[position] = slot;
+        }
+        
+        pushNewest(slot);
+        return uint16_t(ColorFirstInterned + slot);
+    }
+    
+private:
+    static constexpr int kHashSize = kMaxTrueColors * 2;   // Power of two, at most half full
+    static constexpr uint16_t kNone = 0xFFFF;
+    
+    static int hashOf(uint32_t rgb) {
+        return int(((rgb & 0xFFFFFF) * 2654435761u) >> 19) & (kHashSize - 1);
+    }
+    
+    // Hash position holding rgb, or the empty position where it would go
+    int find(uint32_t rgb) const {
+        int position = hashOf(rgb);
+        while (m_hash[position] != kNone && m_colors[ColorFirstInterned + m_hash[position]] != rgb) {
+            position = (position + 1) & (kHashSize - 1);
+        }
+        return position;
+    }
+    
+    // Remove rgb from the hash, shifting later entries of the probe run back
+    // so that lookups never need tombstones
+    void erase(uint32_t rgb) {
+        int hole = find(rgb);
+        m_hash[hole] = kNone;
+        for (int position = (hole + 1) & (kHashSize - 1); m_hash[position] != kNone;
+             position = (position + 1) & (kHashSize - 1)) {
+            int home = hashOf(m_colors[ColorFirstInterned + m_hash[position]]);
+            if (((position - home) & (kHashSize - 1)) >= ((position - hole) & (kHashSize - 1))) {
+                m_hash[hole] = m_hash[position];
+                m_hash[position] = kNone;
+                hole = position;
+            }
+        }
+    }
+    
+    // Recency list of truecolor slots, newest first
+    void unlink(int slot) {
+        uint16_t prev = m_prev[slot];
+        uint16_t next = m_next[slot];
+        if (prev != kNone) {
+            m_next[prev] = next;
+        } else {
+            m_newest = next;
+        }
+        if (next != kNone) {
+            m_prev[next] = prev;
+        } else {
+            m_oldest = prev;
+        }
+    }
+    
+    void pushNewest(int slot) {
+        m_prev[slot] = kNone;
+        m_next[slot] = m_newest;
+        if (m_newest != kNone) {
+            m_prev[m_newest] = slot;
+        } else {
+            m_oldest = slot;
+        }
+        m_newest = slot;
+    }
+    
+    uint32_t m_colors[ColorFirstInterned + kMaxTrueColors];
+    uint16_t m_hash[kHashSize];         // Truecolor slot, or kNone
+    uint16_t m_prev[kMaxTrueColors];
+    uint16_t m_next[kMaxTrueColors];
+    int m_used;                         // Truecolor slots handed out so far
+    uint16_t m_newest;
+    uint16_t m_oldest;
+};
+
+// Screen state and the escape sequence interpreter that drives it. Nothing
+// here depends on Qt or a PTY: output bytes go in through feed(), and the
+// view reads back the cells, the cursor and the damage collected since the
+// last clearDamage(). bench.cpp drives it directly.
+class TerminalScreen {
+public:
+    // Columns changed on one line since the last clearDamage()
+    struct LineDamage {
+        int first;
+        int last;
+        LineDamage() : first(INT_MAX), last(-1) {}
+    };
+    
+    // Rows [top, bottom] moved up by lines (down if negative) since the last
+    // clearDamage(); the rows that came into view are in the line damage
+    struct ScrollDamage {
+        int top;
+        int bottom;
+        int lines;
+    };
+    
+    TerminalScreen(int rows = 24, int cols = 80)
+        : m_rows(rows), m_cols(cols), m_screenTop(0), m_scrolledLines(0),
+          m_fullRepaint(true), m_scrollTop(0), m_scrollBottom(rows - 1),
+          m_altScreenTop(0), m_altScreen(false), m_cursorX(0), m_cursorY(0),
+          m_cursorVisible(true), m_synchronizedUpdate(false), m_bracketedPaste(false),
+          m_pendingNewline(false),
+          m_currentFg(ColorDefaultFg), m_currentBg(ColorDefaultBg), m_currentAttrs(0),
+          m_utf8State(unicode::Utf8Accept), m_utf8CodePoint(0), m_parserState(vt::Ground) {
+        m_cells.assign(m_rows * m_cols, kBlankCell);
+        m_altCells.assign(m_rows * m_cols, kBlankCell);
+        m_lineDamage.assign(m_rows, LineDamage());
+        m_lineWrapped.assign(m_rows, false);
+        m_altLineWrapped.assign(m_rows, false);
+        saveCursor();
+        m_scrollDamage.reserve(kMaxScrollDamage);
+        m_scrollback.setWidth(m_cols);
+        m_params.clear();
+    }
+    
+    int rows() const { return m_rows; }
+    int cols() const { return m_cols; }
+    int cursorX() const { return m_cursorX; }
+    int cursorY() const { return m_cursorY; }
+    bool cursorVisible() const { return m_cursorVisible; }
+    
+    // DEC private mode 2026: the application is drawing a frame and asks for
+    // it to be shown only once complete. The view holds presentation while
+    // this is set and may give up waiting with endSynchronizedUpdate().
+    bool synchronizedUpdate() const { return m_synchronizedUpdate; }
+    void endSynchronizedUpdate() { m_synchronizedUpdate = false; }
+    
+    // DEC private mode 2004: pasted text should be wrapped in ESC [ 200 ~
+    // and ESC [ 201 ~
+    bool bracketedPaste() const { return m_bracketedPaste; }
+    
+    Scrollback &scrollback() { return m_scrollback; }
+    const Scrollback &scrollback() const { return m_scrollback; }
+    
+    // Lines scrolled off the top since creation, so a view into the
+    // scrollback can stay anchored to its content
+    int64_t scrolledLines() const { return m_scrolledLines; }
+    
+    // Color-table entry for TermCell::fg/bg, as 0xAARRGGBB
+    uint32_t color(uint16_t index) const { return m_colors.color(index); }
+    
+    // Cells of screen row y. The screen is a ring of m_rows lines starting at
+    // m_screenTop, so scrolling only advances the head.
+    const TermCell *line(int y) const {
+        return &m_cells[lineSlot(y) * m_cols];
+    }
+    
+    // Row y of a view scrolled back scrollOffset lines into the history.
+    // Scrollback lines may be shorter than the screen is wide.
+    const TermCell *visibleLine(int y, int scrollOffset, int *length) const {
+        if (y < scrollOffset) {
+            return m_scrollback.line(m_scrollback.size() - scrollOffset + y, length);
+        }
+        *length = m_cols;
+        return line(y - scrollOffset);
+    }
+    
+    // Damage since the last clearDamage(): region scrolls to blit, in order,
+    // then per-line column spans, or a request to repaint everything
+    const LineDamage &lineDamage(int y) const { return m_lineDamage[lineSlot(y)]; }
+    const std::vector<ScrollDamage> &scrollDamage() const { return m_scrollDamage; }
+    bool needsFullRepaint() const { return m_fullRepaint; }
+    
+    void clearDamage() {
+        std::fill(m_lineDamage.begin(), m_lineDamage.end(), LineDamage());
+        m_scrollDamage.clear();
+        m_fullRepaint = false;
+    }
+    
+    // Forget a newline seen just before, so the next one is not swallowed
+    void clearPendingNewline() {
+        m_pendingNewline = false;
+    }
+    
+    // Resize in place, reusing the cell storage of both screens. Lines that
+    // would fall off the bottom with the cursor go into the history from the
+    // top instead, so the cursor line stays in view. The history is not
+    // rewritten: it reflows to the new width the next time it is read.
+    void resize(int newRows, int newCols) {
+        if (newRows == m_rows && newCols == m_cols) {
+            return;
+        }
+        
+        // Under the alternate screen, the primary's cursor line is the one
+        // that the cursor saved on entering it returns to
+        if (m_altScreen) {
+            swapScreenStorage();
+            m_savedCursor.y -= dropLinesAbove(m_savedCursor.y, newRows, true);
+            swapScreenStorage();
+            m_cursorY -= dropLinesAbove(m_cursorY, newRows, false);
+        } else {
+            int dropped = dropLinesAbove(m_cursorY, newRows, true);
+            m_cursorY -= dropped;
+            m_savedCursor.y = std::max(0, m_savedCursor.y - dropped);
+        }
+        
+        repackLines(newRows, newCols);
+        swapScreenStorage();
+        repackLines(newRows, newCols);
+        swapScreenStorage();
+        
+        m_rows = newRows;
+        m_cols = newCols;
+        m_scrollback.setWidth(m_cols);
+        m_lineDamage.assign(m_rows, LineDamage());
+        m_scrollDamage.clear();
+        m_fullRepaint = true;
+        m_scrollTop = 0;
+        m_scrollBottom = m_rows - 1;
+        
+        // Make sure the cursor is still in bounds
+        m_cursorX = std::min(m_cursorX, m_cols - 1);
+        m_cursorY = std::min(m_cursorY, m_rows - 1);
+        m_savedCursor.x = std::min(m_savedCursor.x, m_cols - 1);
+        m_savedCursor.y = std::min(m_savedCursor.y, m_rows - 1);
+    }
+    
+    // Interpret a chunk of output from the child
+    void feed(const char *data, int length) {
+        for (int i = 0; i < length; i++) {
+            unsigned char c = data[i];
+            
+            if (m_parserState == vt::Ground) {
+                // Fast path: copy runs of printable ASCII straight into the line
+                if (c >= 0x20 && c < 0x7F && m_utf8State == unicode::Utf8Accept) {
+                    int run = printableAsciiRun(data + i, length - i);
+                    writeAsciiRun(data + i, run);
+                    i += run - 1;
+                    continue;
+                }
+                
+                // Text outside escape sequences may be UTF-8. Complete
+                // sequences are decoded in one step, anything split across
+                // reads or malformed goes through the byte-wise decoder.
+                if (c >= 0x80 && m_utf8State == unicode::Utf8Accept) {
+                    uint32_t codepoint;
+                    int sequenceLength = unicode::decodeUtf8Sequence(data + i, length - i, &codepoint);
+                    if (sequenceLength > 0) {
+                        printCodepoint(codepoint);
+                        i += sequenceLength - 1;
+                        continue;
+                    }
+                }
+                if ((c >= 0x80 || m_utf8State != unicode::Utf8Accept) && processUtf8Byte(c)) {
+                    continue;
+                }
+            }
+            
+            processByte(c);
+        }
+    }
+    
+private:
+    int lineSlot(int y) const {
+        int slot = m_screenTop + y;
+        return slot >= m_rows ? slot - m_rows : slot;
+    }
+    
+    TermCell *line(int y) {
+        return &m_cells[lineSlot(y) * m_cols];
+    }
+    
+    // Move the top lines out of the current screen, into the history if
+    // asked, until row cursorY fits into newRows. Returns the lines dropped.
+    int dropLinesAbove(int cursorY, int newRows, bool keepHistory) {
+        int dropped = std::max(0, cursorY - (newRows - 1));
+        for (int i = 0; i < dropped; i++) {
+            if (keepHistory) {
+                m_scrollback.push(line(0), m_cols, m_lineWrapped[lineSlot(0)]);
+            }
+            m_screenTop = lineSlot(1);
+        }
+        if (keepHistory) {
+            m_scrolledLines += dropped;
+        }
+        return dropped;
+    }
+    
+    // Lay out the current screen's lines for a new size within its existing
+    // storage; m_rows and m_cols still hold the old size
+    void repackLines(int newRows, int newCols) {
+        // Unroll the ring so that row y starts at y * m_cols
+        std::rotate(m_cells.begin(), m_cells.begin() + size_t(m_screenTop) * m_cols, m_cells.end());
+        std::rotate(m_lineWrapped.begin(), m_lineWrapped.begin() + m_screenTop, m_lineWrapped.end());
+        m_screenTop = 0;
+        
+        // Repack the rows that stay for the new width: forwards when lines
+        // get shorter, backwards when they get longer
+        int keptRows = std::min(m_rows, newRows);
+        size_t newSize = size_t(newRows) * newCols;
+        if (newCols <= m_cols) {
+            for (int y = 1; y < keptRows; y++) {
+                TermCell *src = &m_cells[size_t(y) * m_cols];
+                std::copy(src, src + newCols, &m_cells[size_t(y) * newCols]);
+            }
+            m_cells.resize(newSize);
+        } else {
+            m_cells.resize(std::max(m_cells.size(), newSize));
+            for (int y = keptRows - 1; y >= 0; y--) {
+                TermCell *src = &m_cells[size_t(y) * m_cols];
+                TermCell *dst = &m_cells[size_t(y) * newCols];
+                std::copy_backward(src, src + m_cols, dst + m_cols);
+                std::fill(dst + m_cols, dst + newCols, kBlankCell);
+            }
+            m_cells.resize(newSize);
+        }
+        std::fill(m_cells.begin() + size_t(keptRows) * newCols, m_cells.end(), kBlankCell);
+        
+        // Rewrapping the screen itself is not attempted, so a width change
+        // ends every soft wrap on it
+        m_lineWrapped.resize(newRows, false);
+        if (newCols != m_cols) {
+            std::fill(m_lineWrapped.begin(), m_lineWrapped.end(), false);
+        } else {
+            std::fill(m_lineWrapped.begin() + keptRows, m_lineWrapped.end(), false);
+        }
+    }
+    
+    // Exchange the cell storage of the primary and alternate screens. Only
+    // the vectors' buffers change hands, no cell is copied.
+    void swapScreenStorage() {
+        m_cells.swap(m_altCells);
+        m_lineWrapped.swap(m_altLineWrapped);
+        std::swap(m_screenTop, m_altScreenTop);
+    }
+    
+    // Switch between the primary and the alternate screen (modes 47, 1047
+    // and 1049). The alternate screen has no history, so nothing written
+    // to it ever reaches the scrollback.
+    void setAltScreen(bool enabled) {
+        if (enabled == m_altScreen) {
+            return;
+        }
+        swapScreenStorage();
+        m_altScreen = enabled;
+        m_scrollDamage.clear();
+        m_fullRepaint = true;
+    }
+    
+    // DECSC/DECRC: the cursor position together with the text attributes
+    void saveCursor() {
+        m_savedCursor.x = m_cursorX;
+        m_savedCursor.y = m_cursorY;
+        m_savedCursor.fg = m_currentFg;
+        m_savedCursor.bg = m_currentBg;
+        m_savedCursor.attrs = m_currentAttrs;
+    }
+    
+    void restoreCursor() {
+        m_cursorX = std::min(m_savedCursor.x, m_cols - 1);
+        m_cursorY = std::min(m_savedCursor.y, m_rows - 1);
+        m_currentFg = m_savedCursor.fg;
+        m_currentBg = m_savedCursor.bg;
+        m_currentAttrs = m_savedCursor.attrs;
+        m_pendingNewline = false;
+    }
+    
+    // Damage tracking: each ring slot remembers the column span changed since
+    // the last flush, so the damage moves with the line when the screen scrolls
+    void markDirty(int y, int firstCol, int lastCol) {
+        LineDamage &damage = m_lineDamage[lineSlot(y)];
+        damage.first = std::min(damage.first, firstCol);
+        damage.last = std::max(damage.last, lastCol);
+    }
+    
+    TermCell makeCell(uint32_t codepoint) const {
+        TermCell cell;
+        cell.codepoint = codepoint;
+        cell.attrs = m_currentAttrs;
+        cell.fg = m_currentFg;
+        cell.bg = m_currentBg;
+        return cell;
+    }
+    
+    // Store printable ASCII at the cursor with the current attributes,
+    // filling whole line segments at a time and wrapping between them
+    void writeAsciiRun(const char *text, int count) {
+        m_pendingNewline = false;
+        TermCell cell = makeCell(' ');
+        
+        while (count > 0) {
+            int n = std::min(count, m_cols - m_cursorX);
+            TermCell *cells = line(m_cursorY) + m_cursorX;
+            for (int k = 0; k < n; k++) {
+                cell.codepoint = static_cast<unsigned char>(text[k]);
+                cells[k] = cell;
+            }
+            markDirty(m_cursorY, m_cursorX, m_cursorX + n - 1);
+            
+            m_cursorX += n;
+            text += n;
+            count -= n;
+            
+            if (m_cursorX >= m_cols) {
+                autoWrap();
+            }
+        }
+    }
+    
+    // Feed a byte of a UTF-8 sequence, returns false if the byte is not part
+    // of one and should go through the parser instead. The decoder state
+    // lives in the screen, so sequences split across reads are handled.
+    bool processUtf8Byte(unsigned char c) {
+        uint8_t state = unicode::decodeUtf8(m_utf8State, &m_utf8CodePoint, c);
+        if (state != unicode::Utf8Reject) {
+            m_utf8State = state;
+            if (state == unicode::Utf8Accept) {
+                printCodepoint(m_utf8CodePoint);
+            }
+            return true;
+        }
+        
+        // Malformed input shows up as U+FFFD. A byte that cut a sequence
+        // short is then looked at again on its own.
+        bool truncated = m_utf8State != unicode::Utf8Accept;
+        m_utf8State = unicode::Utf8Accept;
+        printCodepoint(0xFFFD);
+        if (truncated) {
+            return c < 0x80 ? false : processUtf8Byte(c);
+        }
+        return true;
+    }
+    
+    // Run one byte through the escape sequence state machine
+    void processByte(unsigned char c) {
+        uint8_t entry = vt::kParserTable.entries[m_parserState][c];
+        m_parserState = vt::State(entry & 0x0F);
+        
+        switch (entry >> 4) {
+            case vt::ActionPrint:
+            case vt::ActionExecute:
+                processRegularChar(char(c));
+                break;
+                
+            case vt::ActionClear:
+                m_params.clear();
+                break;
+                
+            case vt::ActionCollect:
+                m_params.collect(char(c));
+                break;
+                
+            case vt::ActionParam:
+                if (c == ';' || c == ':') {
+                    m_params.nextParam(c == ':');
+                } else {
+                    m_params.addDigit(c - '0');
+                }
+                break;
+                
+            case vt::ActionEscDispatch:
+                processEscDispatch(char(c));
+                break;
+                
+            case vt::ActionCsiDispatch:
+                processEscapeSequence(char(c), m_params);
+                break;
+        }
+    }
+    
+    // ESC <intermediates> <final>
+    void processEscDispatch(char finalChar) {
+        if (m_params.numIntermediates > 0) {
+            // Character set designations and the like are not supported
+            return;
+        }
+        
+        switch (finalChar) {
+            case '7': // DECSC - Save Cursor
+                saveCursor();
+                break;
+                
+            case '8': // DECRC - Restore Cursor
+                restoreCursor();
+                break;
+                
+            case 'D': // IND - Index
+                lineFeed();
+                break;
+                
+            case 'E': // NEL - Next Line
+                wrapLine();
+                break;
+                
+            case 'M': // RI - Reverse Index
+                reverseLineFeed();
+                break;
+        }
+    }
+    
+    void printCodepoint(uint32_t codepoint) {
+        // Combining marks and other zero-width characters are not composed
+        // into the previous cell; dropping them keeps the columns aligned
+        int width = unicode::width(codepoint);
+        if (width == 0) {
+            return;
+        }
+        
+        m_pendingNewline = false;
+        
+        // A wide character never straddles the right margin
+        if (width == 2 && m_cursorX == m_cols - 1 && m_cols > 1) {
+            clearLine(m_cursorY, m_cursorX, m_cursorX);
+            autoWrap();
+        }
+        
+        // Store character with attributes; the cell after a wide character
+        // is a blank placeholder
+        TermCell *cells = line(m_cursorY);
+        TermCell cell = makeCell(codepoint);
+        int lastCol = m_cursorX;
+        cells[m_cursorX] = cell;
+        if (width == 2 && m_cursorX + 1 < m_cols) {
+            cell.codepoint = ' ';
+            cells[++lastCol] = cell;
+        }
+        markDirty(m_cursorY, m_cursorX, lastCol);
+        m_cursorX = lastCol + 1;
+        
+        // Handle line wrapping
+        if (m_cursorX >= m_cols) {
+            autoWrap();
+        }
+    }
+    
+    // Wrap at the right margin. The line is marked as continuing on the next
+    // one, so the history can join them up again at another width.
+    void autoWrap() {
+        m_lineWrapped[lineSlot(m_cursorY)] = true;
+        wrapLine();
+    }
+    
+    // Move to the start of the next line, scrolling at the bottom margin
+    void wrapLine() {
+        m_cursorX = 0;
+        lineFeed();
+    }
+    
+    // Move down a line; at the bottom margin the scroll region moves up instead
+    void lineFeed() {
+        if (m_cursorY == m_scrollBottom) {
+            scrollRegionUp(m_scrollTop, m_scrollBottom, 1, true);
+        } else if (m_cursorY < m_rows - 1) {
+            m_cursorY++;
+        }
+    }
+    
+    // Move up a line; at the top margin the scroll region moves down instead
+    void reverseLineFeed() {
+        if (m_cursorY == m_scrollTop) {
+            scrollRegionDown(m_scrollTop, m_scrollBottom, 1);
+        } else if (m_cursorY > 0) {
+            m_cursorY--;
+        }
+    }
+    
+    void processRegularChar(char c) {
+        // Handle basic terminal output
+        switch (c) {
+            case '\r': // Carriage return
+                m_cursorX = 0;
+                // Handle CR+LF as a single operation to prevent dangling %
+                if (m_pendingNewline) {
+                    m_pendingNewline = false;
+                }
+                break;
+                
+            case '\n': // Line feed
+                if (m_pendingNewline) {
+                    // Already had a newline pending, just process it
+                    m_pendingNewline = false;
+                } else {
+                    // Mark that we've seen a newline
+                    m_pendingNewline = true;
+                    
+                    // Process immediately
+                    lineFeed();
+                    // Important: Reset cursor X position for proper prompt alignment
+                    m_cursorX = 0;
+                }
+                break;
+                
+            case '\b': // Backspace
+                if (m_cursorX > 0) {
+                    m_cursorX--;
+                }
+                break;
+                
+            case '\t': // Tab
+                // Set tab stops every 8 characters - important for programs like fastfetch
+                m_cursorX = ((m_cursorX + 8) / 8) * 8;
+                if (m_cursorX >= m_cols) {
+                    wrapLine();
+                }
+                break;
+                
+            case '\a': // Bell
+                // Would normally beep
+                break;
+                
+            default:
+                if (c >= 32) { // Printable character
+                    // Clear any pending newline state
+                    m_pendingNewline = false;
+                    
+                    // Store the character in the buffer with current attributes
+                    line(m_cursorY)[m_cursorX] = makeCell(static_cast<unsigned char>(c));
+                    markDirty(m_cursorY, m_cursorX, m_cursorX);
+                    
+                    // Move cursor forward
+                    m_cursorX++;
+                    
+                    if (m_cursorX >= m_cols) {
+                        autoWrap();
+                    }
+                }
+        }
+    }
+    
+    void processEscapeSequence(char finalChar, const vt::Params &params) {
+        // Sequences with intermediates (e.g. DECSCUSR) are not supported, and
+        // the only private marker understood is DEC's '?'
+        if (params.numIntermediates > 0 || (params.privateMarker != 0 && params.privateMarker != '?')) {
+            return;
+        }
+        bool privateMode = params.privateMarker == '?';
+        
+        // Process based on the final character
+        switch (finalChar) {
+            case 'm': // SGR - Select Graphic Rendition
+                if (!privateMode) {
+                    processSGR(params);
+                }
+                break;
+                
+            case 'H': // CUP - Cursor Position
+            case 'f': // HVP - Horizontal and Vertical Position
+                if (params.size() >= 2) {
+                    // Parameters are 1-based, convert to 0-based
+                    m_cursorY = std::clamp(params[0] - 1, 0, m_rows - 1);
+                    m_cursorX = std::clamp(params[1] - 1, 0, m_cols - 1);
+                } else {
+                    // Move to home position (0,0)
+                    m_cursorX = 0;
+                    m_cursorY = 0;
+                }
+                break;
+                
+            case 'A': // CUU - Cursor Up
+                m_cursorY = std::max(0, m_cursorY - std::max(1, params[0]));
+                break;
+                
+            case 'B': // CUD - Cursor Down
+                m_cursorY = std::min(m_rows - 1, m_cursorY + std::max(1, params[0]));
+                break;
+                
+            case 'C': // CUF - Cursor Forward
+                m_cursorX = std::min(m_cols - 1, m_cursorX + std::max(1, params[0]));
+                break;
+                
+            case 'D': // CUB - Cursor Back
+                m_cursorX = std::max(0, m_cursorX - std::max(1, params[0]));
+                break;
+                
+            case 'G': // CHA - Cursor Horizontal Absolute
+                m_cursorX = std::clamp(params[0] - 1, 0, m_cols - 1);
+                break;
+                
+            case 'J': // ED - Erase in Display
+                switch (params[0]) {
+                    case 0: // Clear from cursor to end of screen
+                        clearScreen(m_cursorY, m_cursorX, m_rows - 1, m_cols - 1);
+                        break;
+                    case 1: // Clear from beginning of screen to cursor
+                        clearScreen(0, 0, m_cursorY, m_cursorX);
+                        break;
+                    case 2: // Clear entire screen
+                        clearScreen(0, 0, m_rows - 1, m_cols - 1);
+                        break;
+                    case 3: // Clear entire screen and scrollback
+                        clearScreen(0, 0, m_rows - 1, m_cols - 1);
+                        m_scrollback.clear();
+                        break;
+                }
+                break;
+                
+            case 'K': // EL - Erase in Line
+                switch (params[0]) {
+                    case 0: // Clear from cursor to end of line
+                        clearLine(m_cursorY, m_cursorX, m_cols - 1);
+                        break;
+                    case 1: // Clear from beginning of line to cursor
+                        clearLine(m_cursorY, 0, m_cursorX);
+                        break;
+                    case 2: // Clear entire line
+                        clearLine(m_cursorY, 0, m_cols - 1);
+                        break;
+                }
+                break;
+                
+            case 's': // SCP - Save Cursor Position
+                saveCursor();
+                break;
+                
+            case 'u': // RCP - Restore Cursor Position
+                restoreCursor();
+                break;
+                
+            case 'l': // Reset Mode
+            case 'h': // Set Mode
+                if (privateMode) {
+                    // Handle private mode sequences
+                    for (int param : params) {
+                        switch (param) {
+                            case 25: // Show/hide cursor
+                                m_cursorVisible = (finalChar == 'h');
+                                break;
+                                
+                            case 47: // Alternate screen
+                                setAltScreen(finalChar == 'h');
+                                break;
+                                
+                            case 1047: // Alternate screen, cleared on leaving
+                                if (finalChar == 'l' && m_altScreen) {
+                                    clearScreen(0, 0, m_rows - 1, m_cols - 1);
+                                }
+                                setAltScreen(finalChar == 'h');
+                                break;
+                                
+                            case 1048: // Save/restore cursor
+                                if (finalChar == 'h') {
+                                    saveCursor();
+                                } else {
+                                    restoreCursor();
+                                }
+                                break;
+                                
+                            case 1049: // Save cursor and switch to a cleared alternate screen
+                                if (finalChar == 'h') {
+                                    if (!m_altScreen) {
+                                        saveCursor();
+                                        setAltScreen(true);
+                                        clearScreen(0, 0, m_rows - 1, m_cols - 1);
+                                    }
+                                } else if (m_altScreen) {
+                                    setAltScreen(false);
+                                    restoreCursor();
+                                }
+                                break;
+                                
+                            case 2004: // Bracketed paste
+                                m_bracketedPaste = (finalChar == 'h');
+                                break;
+                                
+                            case 2026: // Synchronized output
+                                m_synchronizedUpdate = (finalChar == 'h');
+                                break;
+                            // Add more private mode handlers as needed
+                        }
+                    }
+                }
+                break;
+                
+            case 'd': // VPA - Line Position Absolute
+                m_cursorY = std::clamp(params[0] - 1, 0, m_rows - 1);
+                break;
+                
+            case 'r': // DECSTBM - Set Top and Bottom Margins (scrolling region)
+                if (!privateMode) {
+                    int top = std::max(1, params[0]) - 1;
+                    int bottom = params.size() >= 2 && params[1] > 0 ? params[1] - 1 : m_rows - 1;
+                    bottom = std::min(bottom, m_rows - 1);
+                    if (top < bottom) {
+                        m_scrollTop = top;
+                        m_scrollBottom = bottom;
+                        m_cursorX = 0;
+                        m_cursorY = 0;
+                    }
+                }
+                break;
+                
+            case 'L': // IL - Insert Line
+                if (m_cursorY >= m_scrollTop && m_cursorY <= m_scrollBottom) {
+                    scrollRegionDown(m_cursorY, m_scrollBottom, std::max(1, params[0]));
+                    m_cursorX = 0;
+                }
+                break;
+                
+            case 'M': // DL - Delete Line
+                if (m_cursorY >= m_scrollTop && m_cursorY <= m_scrollBottom) {
+                    scrollRegionUp(m_cursorY, m_scrollBottom, std::max(1, params[0]), false);
+                    m_cursorX = 0;
+                }
+                break;
+                
+            case 'S': // SU - Scroll Up
+                if (!privateMode) {
+                    scrollRegionUp(m_scrollTop, m_scrollBottom, std::max(1, params[0]), true);
+                }
+                break;
+                
+            case 'T': // SD - Scroll Down (with more parameters it is mouse tracking)
+                if (!privateMode && params.size() == 1) {
+                    scrollRegionDown(m_scrollTop, m_scrollBottom, std::max(1, params[0]));
+                }
+                break;
+                
+            case 'n': // DSR - Device Status Report
+                if (params[0] == 6) {
+                    // Report cursor position - not implementing response
+                }
+                break;
+        }
+    }
+    
+    void processSGR(const vt::Params &params) {
+        // Process SGR parameters
+        for (int i = 0; i < params.size(); i++) {
+            int param = params[i];
+            
+            // Sub-parameters are consumed by the parameter they belong to
+            if (params.isSubParam(i)) {
+                continue;
+            }
+            
+            switch (param) {
+                case 0: // Reset all attributes
+                    m_currentFg = ColorDefaultFg;
+                    m_currentBg = ColorDefaultBg;
+                    m_currentAttrs = 0;
+                    break;
+                    
+                case 1: // Bold
+                    m_currentAttrs |= AttrBold;
+                    break;
+                    
+                case 3: // Italic
+                    m_currentAttrs |= AttrItalic;
+                    break;
+                    
+                case 4: // Underline (4:0 turns it off, other styles map to single)
+                    if (params.isSubParam(i + 1) && params[i + 1] == 0) {
+                        m_currentAttrs &= ~AttrUnderline;
+                    } else {
+                        m_currentAttrs |= AttrUnderline;
+                    }
+                    break;
+                    
+                case 22: // Normal intensity (not bold)
+                    m_currentAttrs &= ~AttrBold;
+                    break;
+                    
+                case 23: // Not italic
+                    m_currentAttrs &= ~AttrItalic;
+                    break;
+                    
+                case 24: // Not underlined
+                    m_currentAttrs &= ~AttrUnderline;
+                    break;
+                    
+                case 30: case 31: case 32: case 33: // Foreground colors
+                case 34: case 35: case 36: case 37:
+                    m_currentFg = param - 30;
+                    break;
+                    
+                case 38: { // Extended foreground color
+                    int color;
+                    i = parseExtendedColor(params, i, &color);
+                    if (color >= 0) {
+                        m_currentFg = color;
+                    }
+                    break;
+                }
+                    
+                case 39: // Default foreground color
+                    m_currentFg = ColorDefaultFg;
+                    break;
+                    
+                case 40: case 41: case 42: case 43: // Background colors
+                case 44: case 45: case 46: case 47:
+                    m_currentBg = param - 40;
+                    break;
+                    
+                case 48: { // Extended background color
+                    int color;
+                    i = parseExtendedColor(params, i, &color);
+                    if (color >= 0) {
+                        m_currentBg = color;
+                    }
+                    break;
+                }
+                    
+                case 49: // Default background color
+                    m_currentBg = ColorDefaultBg;
+                    break;
+                    
+                case 90: case 91: case 92: case 93: // Bright foreground colors
+                case 94: case 95: case 96: case 97:
+                    m_currentFg = param - 90 + 8;
+                    break;
+                    
+                case 100: case 101: case 102: case 103: // Bright background colors
+                case 104: case 105: case 106: case 107:
+                    m_currentBg = param - 100 + 8;
+                    break;
+            }
+        }
+    }
+    
+    // Parse the color after an SGR 38/48 at params[i], in either the
+    // semicolon form (38;5;n, 38;2;r;g;b) or the colon form (38:5:n,
+    // 38:2::r:g:b, 38:2:r:g:b). Sets *color to a color index or -1 and
+    // returns the index of the last parameter consumed.
+    int parseExtendedColor(const vt::Params &params, int i, int *color) {
+        *color = -1;
+        
+        if (params.isSubParam(i + 1)) {
+            int end = i + 1;
+            while (params.isSubParam(end)) {
+                end++;
+            }
+            
+            const int *sub = &params[i + 1];
+            int numSub = end - (i + 1);
+            if (numSub >= 2 && sub[0] == 5) { // 256 color mode
+                if (sub[1] < 256) {
+                    *color = sub[1];
+                }
+            } else if (numSub >= 4 && sub[0] == 2) { // RGB mode, optional color space id
+                const int *rgb = numSub >= 5 ? sub + 2 : sub + 1;
+                *color = internColor(rgb[0], rgb[1], rgb[2]);
+            }
+            return end - 1;
+        }
+        
+        if (i + 2 < params.size() && params[i + 1] == 5) { // 256 color mode
+            int colorIndex = params[i + 2];
+            if (colorIndex >= 0 && colorIndex < 256) {
+                *color = colorIndex;
+            }
+            return i + 2; // Skip the next two parameters
+        } else if (i + 4 < params.size() && params[i + 1] == 2) { // RGB mode
+            *color = internColor(params[i + 2], params[i + 3], params[i + 4]);
+            return i + 4; // Skip the next four parameters
+        }
+        return i;
+    }
+    
+    // Map a truecolor SGR value to a color-table index
+    uint16_t internColor(int r, int g, int b) {
+        return m_colors.intern(packRgb(std::clamp(r, 0, 255), std::clamp(g, 0, 255), std::clamp(b, 0, 255)));
+    }
+    
+    void clearScreen(int startRow, int startCol, int endRow, int endCol) {
+        for (int y = startRow; y <= endRow; y++) {
+            clearLine(y, (y == startRow ? startCol : 0), (y == endRow ? endCol : m_cols - 1));
+        }
+    }
+    
+    void clearLine(int row, int startCol, int endCol) {
+        TermCell *cells = line(row);
+        std::fill(cells + startCol, cells + endCol + 1, kBlankCell);
+        markDirty(row, startCol, endCol);
+        
+        // Erasing through the margin ends a soft-wrapped line
+        if (endCol == m_cols - 1) {
+            m_lineWrapped[lineSlot(row)] = false;
+        }
+    }
+    
+    // Move lines [top, bottom] up by count, blanking the lines that come in
+    // at the bottom. When the region is the whole screen the ring head just
+    // advances, and the lines leaving the top go into the history if asked
+    // and on the primary screen; otherwise the rows inside the region are
+    // moved down the ring. Damage moves with the lines either way.
+    void scrollRegionUp(int top, int bottom, int count, bool keepHistory) {
+        count = std::min(count, bottom - top + 1);
+        keepHistory = keepHistory && !m_altScreen;
+        
+        if (top == 0 && bottom == m_rows - 1) {
+            for (int i = 0; i < count; i++) {
+                if (keepHistory) {
+                    m_scrollback.push(line(0), m_cols, m_lineWrapped[lineSlot(0)]);
+                }
+                m_screenTop = lineSlot(1);
+                m_lineDamage[lineSlot(m_rows - 1)] = LineDamage();
+                clearLine(m_rows - 1, 0, m_cols - 1);
+            }
+            if (keepHistory) {
+                m_scrolledLines += count;
+            }
+        } else {
+            for (int y = top; y + count <= bottom; y++) {
+                moveLine(y + count, y);
+            }
+            for (int y = bottom - count + 1; y <= bottom; y++) {
+                m_lineDamage[lineSlot(y)] = LineDamage();
+                clearLine(y, 0, m_cols - 1);
+            }
+        }
+        
+        addScrollDamage(top, bottom, count);
+    }
+    
+    // Move lines [top, bottom] down by count, blanking the lines that come in
+    // at the top
+    void scrollRegionDown(int top, int bottom, int count) {
+        count = std::min(count, bottom - top + 1);
+        
+        if (top == 0 && bottom == m_rows - 1) {
+            for (int i = 0; i < count; i++) {
+                m_screenTop = lineSlot(m_rows - 1);
+                m_lineDamage[lineSlot(0)] = LineDamage();
+                clearLine(0, 0, m_cols - 1);
+            }
+        } else {
+            for (int y = bottom; y - count >= top; y--) {
+                moveLine(y - count, y);
+            }
+            for (int y = top; y < top + count; y++) {
+                m_lineDamage[lineSlot(y)] = LineDamage();
+                clearLine(y, 0, m_cols - 1);
+            }
+        }
+        
+        addScrollDamage(top, bottom, -count);
+    }
+    
+    void moveLine(int from, int to) {
+        std::copy(line(from), line(from) + m_cols, line(to));
+        m_lineDamage[lineSlot(to)] = m_lineDamage[lineSlot(from)];
+        m_lineWrapped[lineSlot(to)] = m_lineWrapped[lineSlot(from)];
+    }
+    
+    // Record a region scroll for the renderer to blit. Repeated scrolls of
+    // the same region in the same direction are folded together; too many
+    // different ones are cheaper to repaint outright.
+    void addScrollDamage(int top, int bottom, int lines) {
+        if (m_fullRepaint) {
+            return;
+        }
+        
+        if (!m_scrollDamage.empty()) {
+            ScrollDamage &last = m_scrollDamage.back();
+            if (last.top == top && last.bottom == bottom && (last.lines > 0) == (lines > 0)) {
+                last.lines += lines;
+                return;
+            }
+        }
+        
+        if (m_scrollDamage.size() >= kMaxScrollDamage) {
+            m_scrollDamage.clear();
+            m_fullRepaint = true;
+            return;
+        }
+        
+        ScrollDamage damage;
+        damage.top = top;
+        damage.bottom = bottom;
+        damage.lines = lines;
+        m_scrollDamage.push_back(damage);
+    }
+    
+    int m_rows;
+    int m_cols;
+    std::vector<TermCell> m_cells;      // Ring of m_rows lines of m_cols cells
+    int m_screenTop;                    // Slot of screen row 0 in m_cells
+    Scrollback m_scrollback;
+    int64_t m_scrolledLines;
+    
+    // Damage since the last clearDamage()
+    static constexpr size_t kMaxScrollDamage = 8;
+    std::vector<LineDamage> m_lineDamage; // Indexed by ring slot
+    std::vector<bool> m_lineWrapped;    // Ring slot was soft-wrapped into the next line
+    std::vector<ScrollDamage> m_scrollDamage;
+    bool m_fullRepaint;
+    
+    // Scroll margins (DECSTBM), inclusive
+    int m_scrollTop;
+    int m_scrollBottom;
+    
+    // The alternate screen's storage while the primary is shown, and the
+    // primary's while the alternate is; both are allocated up front
+    std::vector<TermCell> m_altCells;
+    std::vector<bool> m_altLineWrapped;
+    int m_altScreenTop;
+    bool m_altScreen;                   // The alternate screen is shown
+    
+    struct SavedCursor {
+        int x;
+        int y;
+        uint16_t fg;
+        uint16_t bg;
+        uint16_t attrs;
+    };
+    
+    int m_cursorX;
+    int m_cursorY;
+    SavedCursor m_savedCursor;          // DECSC
+    bool m_cursorVisible;
+    bool m_synchronizedUpdate;          // Mode 2026
+    bool m_bracketedPaste;              // Mode 2004
+    bool m_pendingNewline;              // Track newline state
+    
+    ColorTable m_colors;
+    uint16_t m_currentFg;
+    uint16_t m_currentBg;
+    
+    // Text attributes (CellAttr bits)
+    uint16_t m_currentAttrs;
+    
+    // UTF-8 decoder state (unicode::Utf8State) and the codepoint so far
+    uint8_t m_utf8State;
+    uint32_t m_utf8CodePoint;
+    
+    // Escape sequence processing
+    vt::State m_parserState;
+    vt::Params m_params;
+};
+
+#endif // KORZETERM_TERMINAL_H
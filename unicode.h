@@ -0,0 +1,426 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2025 Korzeterm Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Unicode support for the terminal core: a streaming UTF-8 decoder and the
+// display width of a codepoint. Both are table driven, with the tables built
+// at compile time.
+
+#ifndef KORZETERM_UNICODE_H
+#define KORZETERM_UNICODE_H
+
+#include <stdint.h>
+
+namespace unicode {
+
+// UTF-8 decoder as a DFA over byte classes, in the spirit of Bjoern
+// Hoehrmann's decoder. It keeps no state beyond (state, codepoint), so a
+// sequence split across two reads continues where it left off. Overlong
+// forms, surrogates and values above U+10FFFF are rejected.
+enum Utf8State : uint8_t {
+    Utf8Accept,         // Between characters; a codepoint is complete
+    Utf8Reject,         // Malformed input
+    Utf8Need1,          // One continuation byte left
+    Utf8Need2,
+    Utf8Need3,
+    Utf8AfterE0,        // Second byte must be A0-BF (no overlongs)
+    Utf8AfterED,        // Second byte must be 80-9F (no surrogates)
+    Utf8AfterF0,        // Second byte must be 90-BF (no overlongs)
+    Utf8AfterF4,        // Second byte must be 80-8F (nothing past U+10FFFF)
+    Utf8StateCount
+};
+
+struct Utf8Table {
+    enum ByteClass : uint8_t {
+        Ascii, Cont80, Cont90, ContA0, Lead2, LeadE0, Lead3, LeadED,
+        LeadF0, Lead4, LeadF4, Invalid, ClassCount
+    };
+    
+    uint8_t byteClass[256];
+    uint8_t leadMask[ClassCount];       // Payload bits of a first byte
+    uint8_t next[Utf8StateCount][ClassCount];
+    
+    constexpr Utf8Table() : byteClass(), leadMask(), next() {
+        setClass(0x00, 0x7F, Ascii);
+        setClass(0x80, 0x8F, Cont80);
+        setClass(0x90, 0x9F, Cont90);
+        setClass(0xA0, 0xBF, ContA0);
+        setClass(0xC0, 0xC1, Invalid);
+        setClass(0xC2, 0xDF, Lead2);
+        setClass(0xE0, 0xE0, LeadE0);
+        setClass(0xE1, 0xEF, Lead3);
+        setClass(0xED, 0xED, LeadED);
+        setClass(0xF0, 0xF0, LeadF0);
+        setClass(0xF1, 0xF3, Lead4);
+        setClass(0xF4, 0xF4, LeadF4);
+        setClass(0xF5, 0xFF, Invalid);
+        
+        leadMask[Ascii] = 0x7F;
+        leadMask[Lead2] = 0x1F;
+        leadMask[LeadE0] = leadMask[Lead3] = leadMask[LeadED] = 0x0F;
+        leadMask[LeadF0] = leadMask[Lead4] = leadMask[LeadF4] = 0x07;
+        
+        for (int state = 0; state < Utf8StateCount; state++) {
+            for (int c = 0; c < ClassCount; c++) {
+                next[state][c] = Utf8Reject;
+            }
+        }
+        
+        next[Utf8Accept][Ascii] = Utf8Accept;
+        next[Utf8Accept][Lead2] = Utf8Need1;
+        next[Utf8Accept][LeadE0] = Utf8AfterE0;
+        next[Utf8Accept][Lead3] = Utf8Need2;
+        next[Utf8Accept][LeadED] = Utf8AfterED;
+        next[Utf8Accept][LeadF0] = Utf8AfterF0;
+        next[Utf8Accept][Lead4] = Utf8Need3;
+        next[Utf8Accept][LeadF4] = Utf8AfterF4;
+        
+        for (int c = Cont80; c <= ContA0; c++) {
+            next[Utf8Need1][c] = Utf8Accept;
+            next[Utf8Need2][c] = Utf8Need1;
+            next[Utf8Need3][c] = Utf8Need2;
+        }
+        next[Utf8AfterE0][ContA0] = Utf8Need1;
+        next[Utf8AfterED][Cont80] = Utf8Need1;
+        next[Utf8AfterED][Cont90] = Utf8Need1;
+        next[Utf8AfterF0][Cont90] = Utf8Need2;
+        next[Utf8AfterF0][ContA0] = Utf8Need2;
+        next[Utf8AfterF4][Cont80] = Utf8Need2;
+    }
+    
+    constexpr void setClass(int first, int last, ByteClass byteClassValue) {
+        for (int c = first; c <= last; c++) {
+            byteClass[c] = byteClassValue;
+        }
+    }
+};
+
+static constexpr Utf8Table kUtf8Table;
+
+// Advance the decoder by one byte. When the returned state is Utf8Accept,
+// *codepoint holds a complete character.
+static inline uint8_t decodeUtf8(uint8_t state, uint32_t *codepoint, uint8_t byte) {
+    uint8_t byteClass = kUtf8Table.byteClass[byte];
+    *codepoint = state == Utf8Accept ? (byte & kUtf8Table.leadMask[byteClass])
+                                     : (*codepoint << 6) | (byte & 0x3F);
+    return kUtf8Table.next[state][byteClass];
+}
+
+// Decode a whole sequence starting at a lead byte when it is all in the
+// buffer. Returns its length, or 0 if it is cut off or malformed, in which
+// case the bytes go through decodeUtf8() one at a time. Unlike the DFA,
+// the checks here do not depend on each other, which is faster for
+// sequences that are complete, and they nearly always are.
+static inline int decodeUtf8Sequence(const char *data, int length, uint32_t *codepoint) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    unsigned char lead = bytes[0];
+    
+    if (lead >= 0xC2 && lead < 0xE0) {
+        if (length < 2 || (bytes[1] & 0xC0) != 0x80) {
+            return 0;
+        }
+        *codepoint = (uint32_t(lead & 0x1F) << 6) | (bytes[1] & 0x3F);
+        return 2;
+    }
+    
+    if (lead >= 0xE0 && lead < 0xF0) {
+        if (length < 3 || ((bytes[1] & 0xC0) | ((bytes[2] & 0xC0) >> 2)) != 0xA0) {
+            return 0;
+        }
+        uint32_t value = (uint32_t(lead & 0x0F) << 12) | (uint32_t(bytes[1] & 0x3F) << 6) | (bytes[2] & 0x3F);
+        if (value < 0x800 || (value >= 0xD800 && value <= 0xDFFF)) {
+            return 0;
+        }
+        *codepoint = value;
+        return 3;
+    }
+    
+    if (lead >= 0xF0 && lead < 0xF5) {
+        if (length < 4 || (bytes[1] & 0xC0) != 0x80 || (bytes[2] & 0xC0) != 0x80 || (bytes[3] & 0xC0) != 0x80) {
+            return 0;
+        }
+        uint32_t value = (uint32_t(lead & 0x07) << 18) | (uint32_t(bytes[1] & 0x3F) << 12) |
+                         (uint32_t(bytes[2] & 0x3F) << 6) | (bytes[3] & 0x3F);
+        if (value < 0x10000 || value > 0x10FFFF) {
+            return 0;
+        }
+        *codepoint = value;
+        return 4;
+    }
+    
+    return 0;
+}
+
+struct CodepointRange {
+    uint32_t first;
+    uint32_t last;
+};
+
+// Generated from the Unicode 14.0 character database (EastAsianWidth.txt and
+// the general categories). Zero width: nonspacing and enclosing marks,
+// format characters other than those shown as glyphs, C1 controls and Hangul
+// medial/final jamo. Double width: East Asian Wide and Fullwidth, which
+// includes emoji with default emoji presentation, and the unassigned
+// codepoints the standard reserves as Wide - the rest of the CJK ideograph
+// blocks and planes 2 and 3. Every other unassigned codepoint and the
+// noncharacters are narrow, so stray bytes move the cursor as far as they
+// do in the application that sent them.
+static constexpr CodepointRange kZeroWidthRanges[] = {
+    { 0x0080, 0x009F }, { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+    { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 },
+    { 0x0610, 0x061A }, { 0x061C, 0x061C }, { 0x064B, 0x065F }, { 0x0670, 0x0670 },
+    { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 }, { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED },
+    { 0x0711, 0x0711 }, { 0x0730, 0x074A }, { 0x07A6, 0x07B0 }, { 0x07EB, 0x07F3 },
+    { 0x07FD, 0x07FD }, { 0x0816, 0x0819 }, { 0x081B, 0x0823 }, { 0x0825, 0x0827 },
+    { 0x0829, 0x082D }, { 0x0859, 0x085B }, { 0x0898, 0x089F }, { 0x08CA, 0x08E1 },
+    { 0x08E3, 0x0902 }, { 0x093A, 0x093A }, { 0x093C, 0x093C }, { 0x0941, 0x0948 },
+    { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 },
+    { 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 }, { 0x09CD, 0x09CD }, { 0x09E2, 0x09E3 },
+    { 0x09FE, 0x09FE }, { 0x0A01, 0x0A02 }, { 0x0A3C, 0x0A3C }, { 0x0A41, 0x0A42 },
+    { 0x0A47, 0x0A48 }, { 0x0A4B, 0x0A4D }, { 0x0A51, 0x0A51 }, { 0x0A70, 0x0A71 },
+    { 0x0A75, 0x0A75 }, { 0x0A81, 0x0A82 }, { 0x0ABC, 0x0ABC }, { 0x0AC1, 0x0AC5 },
+    { 0x0AC7, 0x0AC8 }, { 0x0ACD, 0x0ACD }, { 0x0AE2, 0x0AE3 }, { 0x0AFA, 0x0AFF },
+    { 0x0B01, 0x0B01 }, { 0x0B3C, 0x0B3C }, { 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B44 },
+    { 0x0B4D, 0x0B4D }, { 0x0B55, 0x0B56 }, { 0x0B62, 0x0B63 }, { 0x0B82, 0x0B82 },
+    { 0x0BC0, 0x0BC0 }, { 0x0BCD, 0x0BCD }, { 0x0C00, 0x0C00 }, { 0x0C04, 0x0C04 },
+    { 0x0C3C, 0x0C3C }, { 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C48 }, { 0x0C4A, 0x0C4D },
+    { 0x0C55, 0x0C56 }, { 0x0C62, 0x0C63 }, { 0x0C81, 0x0C81 }, { 0x0CBC, 0x0CBC },
+    { 0x0CBF, 0x0CBF }, { 0x0CC6, 0x0CC6 }, { 0x0CCC, 0x0CCD }, { 0x0CE2, 0x0CE3 },
+    { 0x0D00, 0x0D01 }, { 0x0D3B, 0x0D3C }, { 0x0D41, 0x0D44 }, { 0x0D4D, 0x0D4D },
+    { 0x0D62, 0x0D63 }, { 0x0D81, 0x0D81 }, { 0x0DCA, 0x0DCA }, { 0x0DD2, 0x0DD4 },
+    { 0x0DD6, 0x0DD6 }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E },
+    { 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EBC }, { 0x0EC8, 0x0ECD }, { 0x0F18, 0x0F19 },
+    { 0x0F35, 0x0F35 }, { 0x0F37, 0x0F37 }, { 0x0F39, 0x0F39 }, { 0x0F71, 0x0F7E },
+    { 0x0F80, 0x0F84 }, { 0x0F86, 0x0F87 }, { 0x0F8D, 0x0F97 }, { 0x0F99, 0x0FBC },
+    { 0x0FC6, 0x0FC6 }, { 0x102D, 0x1030 }, { 0x1032, 0x1037 }, { 0x1039, 0x103A },
+    { 0x103D, 0x103E }, { 0x1058, 0x1059 }, { 0x105E, 0x1060 }, { 0x1071, 0x1074 },
+    { 0x1082, 0x1082 }, { 0x1085, 0x1086 }, { 0x108D, 0x108D }, { 0x109D, 0x109D },
+    { 0x1160, 0x11FF }, { 0x135D, 0x135F }, { 0x1712, 0x1714 }, { 0x1732, 0x1733 },
+    { 0x1752, 0x1753 }, { 0x1772, 0x1773 }, { 0x17B4, 0x17B5 }, { 0x17B7, 0x17BD },
+    { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 }, { 0x17DD, 0x17DD }, { 0x180B, 0x180F },
+    { 0x1885, 0x1886 }, { 0x18A9, 0x18A9 }, { 0x1920, 0x1922 }, { 0x1927, 0x1928 },
+    { 0x1932, 0x1932 }, { 0x1939, 0x193B }, { 0x1A17, 0x1A18 }, { 0x1A1B, 0x1A1B },
+    { 0x1A56, 0x1A56 }, { 0x1A58, 0x1A5E }, { 0x1A60, 0x1A60 }, { 0x1A62, 0x1A62 },
+    { 0x1A65, 0x1A6C }, { 0x1A73, 0x1A7C }, { 0x1A7F, 0x1A7F }, { 0x1AB0, 0x1ACE },
+    { 0x1B00, 0x1B03 }, { 0x1B34, 0x1B34 }, { 0x1B36, 0x1B3A }, { 0x1B3C, 0x1B3C },
+    { 0x1B42, 0x1B42 }, { 0x1B6B, 0x1B73 }, { 0x1B80, 0x1B81 }, { 0x1BA2, 0x1BA5 },
+    { 0x1BA8, 0x1BA9 }, { 0x1BAB, 0x1BAD }, { 0x1BE6, 0x1BE6 }, { 0x1BE8, 0x1BE9 },
+    { 0x1BED, 0x1BED }, { 0x1BEF, 0x1BF1 }, { 0x1C2C, 0x1C33 }, { 0x1C36, 0x1C37 },
+    { 0x1CD0, 0x1CD2 }, { 0x1CD4, 0x1CE0 }, { 0x1CE2, 0x1CE8 }, { 0x1CED, 0x1CED },
+    { 0x1CF4, 0x1CF4 }, { 0x1CF8, 0x1CF9 }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F },
+    { 0x202A, 0x202E }, { 0x2060, 0x2064 }, { 0x2066, 0x206F }, { 0x20D0, 0x20F0 },
+    { 0x2CEF, 0x2CF1 }, { 0x2D7F, 0x2D7F }, { 0x2DE0, 0x2DFF }, { 0x302A, 0x302D },
+    { 0x3099, 0x309A }, { 0xA66F, 0xA672 }, { 0xA674, 0xA67D }, { 0xA69E, 0xA69F },
+    { 0xA6F0, 0xA6F1 }, { 0xA802, 0xA802 }, { 0xA806, 0xA806 }, { 0xA80B, 0xA80B },
+    { 0xA825, 0xA826 }, { 0xA82C, 0xA82C }, { 0xA8C4, 0xA8C5 }, { 0xA8E0, 0xA8F1 },
+    { 0xA8FF, 0xA8FF }, { 0xA926, 0xA92D }, { 0xA947, 0xA951 }, { 0xA980, 0xA982 },
+    { 0xA9B3, 0xA9B3 }, { 0xA9B6, 0xA9B9 }, { 0xA9BC, 0xA9BD }, { 0xA9E5, 0xA9E5 },
+    { 0xAA29, 0xAA2E }, { 0xAA31, 0xAA32 }, { 0xAA35, 0xAA36 }, { 0xAA43, 0xAA43 },
+    { 0xAA4C, 0xAA4C }, { 0xAA7C, 0xAA7C }, { 0xAAB0, 0xAAB0 }, { 0xAAB2, 0xAAB4 },
+    { 0xAAB7, 0xAAB8 }, { 0xAABE, 0xAABF }, { 0xAAC1, 0xAAC1 }, { 0xAAEC, 0xAAED },
+    { 0xAAF6, 0xAAF6 }, { 0xABE5, 0xABE5 }, { 0xABE8, 0xABE8 }, { 0xABED, 0xABED },
+    { 0xD7B0, 0xD7C6 }, { 0xD7CB, 0xD7FB }, { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F },
+    { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0xFFF9, 0xFFFB }, { 0x101FD, 0x101FD },
+    { 0x102E0, 0x102E0 }, { 0x10376, 0x1037A }, { 0x10A01, 0x10A03 }, { 0x10A05, 0x10A06 },
+    { 0x10A0C, 0x10A0F }, { 0x10A38, 0x10A3A }, { 0x10A3F, 0x10A3F }, { 0x10AE5, 0x10AE6 },
+    { 0x10D24, 0x10D27 }, { 0x10EAB, 0x10EAC }, { 0x10F46, 0x10F50 }, { 0x10F82, 0x10F85 },
+    { 0x11001, 0x11001 }, { 0x11038, 0x11046 }, { 0x11070, 0x11070 }, { 0x11073, 0x11074 },
+    { 0x1107F, 0x11081 }, { 0x110B3, 0x110B6 }, { 0x110B9, 0x110BA }, { 0x110C2, 0x110C2 },
+    { 0x11100, 0x11102 }, { 0x11127, 0x1112B }, { 0x1112D, 0x11134 }, { 0x11173, 0x11173 },
+    { 0x11180, 0x11181 }, { 0x111B6, 0x111BE }, { 0x111C9, 0x111CC }, { 0x111CF, 0x111CF },
+    { 0x1122F, 0x11231 }, { 0x11234, 0x11234 }, { 0x11236, 0x11237 }, { 0x1123E, 0x1123E },
+    { 0x112DF, 0x112DF }, { 0x112E3, 0x112EA }, { 0x11300, 0x11301 }, { 0x1133B, 0x1133C },
+    { 0x11340, 0x11340 }, { 0x11366, 0x1136C }, { 0x11370, 0x11374 }, { 0x11438, 0x1143F },
+    { 0x11442, 0x11444 }, { 0x11446, 0x11446 }, { 0x1145E, 0x1145E }, { 0x114B3, 0x114B8 },
+    { 0x114BA, 0x114BA }, { 0x114BF, 0x114C0 }, { 0x114C2, 0x114C3 }, { 0x115B2, 0x115B5 },
+    { 0x115BC, 0x115BD }, { 0x115BF, 0x115C0 }, { 0x115DC, 0x115DD }, { 0x11633, 0x1163A },
+    { 0x1163D, 0x1163D }, { 0x1163F, 0x11640 }, { 0x116AB, 0x116AB }, { 0x116AD, 0x116AD },
+    { 0x116B0, 0x116B5 }, { 0x116B7, 0x116B7 }, { 0x1171D, 0x1171F }, { 0x11722, 0x11725 },
+    { 0x11727, 0x1172B }, { 0x1182F, 0x11837 }, { 0x11839, 0x1183A }, { 0x1193B, 0x1193C },
+    { 0x1193E, 0x1193E }, { 0x11943, 0x11943 }, { 0x119D4, 0x119D7 }, { 0x119DA, 0x119DB },
+    { 0x119E0, 0x119E0 }, { 0x11A01, 0x11A0A }, { 0x11A33, 0x11A38 }, { 0x11A3B, 0x11A3E },
+    { 0x11A47, 0x11A47 }, { 0x11A51, 0x11A56 }, { 0x11A59, 0x11A5B }, { 0x11A8A, 0x11A96 },
+    { 0x11A98, 0x11A99 }, { 0x11C30, 0x11C36 }, { 0x11C38, 0x11C3D }, { 0x11C3F, 0x11C3F },
+    { 0x11C92, 0x11CA7 }, { 0x11CAA, 0x11CB0 }, { 0x11CB2, 0x11CB3 }, { 0x11CB5, 0x11CB6 },
+    { 0x11D31, 0x11D36 }, { 0x11D3A, 0x11D3A }, { 0x11D3C, 0x11D3D }, { 0x11D3F, 0x11D45 },
+    { 0x11D47, 0x11D47 }, { 0x11D90, 0x11D91 }, { 0x11D95, 0x11D95 }, { 0x11D97, 0x11D97 },
+    { 0x11EF3, 0x11EF4 }, { 0x13430, 0x13438 }, { 0x16AF0, 0x16AF4 }, { 0x16B30, 0x16B36 },
+    { 0x16F4F, 0x16F4F }, { 0x16F8F, 0x16F92 }, { 0x16FE4, 0x16FE4 }, { 0x1BC9D, 0x1BC9E },
+    { 0x1BCA0, 0x1BCA3 }, { 0x1CF00, 0x1CF2D }, { 0x1CF30, 0x1CF46 }, { 0x1D167, 0x1D169 },
+    { 0x1D173, 0x1D182 }, { 0x1D185, 0x1D18B }, { 0x1D1AA, 0x1D1AD }, { 0x1D242, 0x1D244 },
+    { 0x1DA00, 0x1DA36 }, { 0x1DA3B, 0x1DA6C }, { 0x1DA75, 0x1DA75 }, { 0x1DA84, 0x1DA84 },
+    { 0x1DA9B, 0x1DA9F }, { 0x1DAA1, 0x1DAAF }, { 0x1E000, 0x1E006 }, { 0x1E008, 0x1E018 },
+    { 0x1E01B, 0x1E021 }, { 0x1E023, 0x1E024 }, { 0x1E026, 0x1E02A }, { 0x1E130, 0x1E136 },
+    { 0x1E2AE, 0x1E2AE }, { 0x1E2EC, 0x1E2EF }, { 0x1E8D0, 0x1E8D6 }, { 0x1E944, 0x1E94A },
+    { 0xE0001, 0xE0001 }, { 0xE0020, 0xE007F }, { 0xE0100, 0xE01EF },
+};
+
+static constexpr CodepointRange kWideRanges[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+    { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+    { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE },
+    { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+    { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+    { 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 },
+    { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF },
+    { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x2E99 },
+    { 0x2E9B, 0x2EF3 }, { 0x2F00, 0x2FD5 }, { 0x2FF0, 0x2FFB }, { 0x3000, 0x3029 },
+    { 0x302E, 0x303E }, { 0x3041, 0x3096 }, { 0x309B, 0x30FF }, { 0x3105, 0x312F },
+    { 0x3131, 0x318E }, { 0x3190, 0x31E3 }, { 0x31F0, 0x321E }, { 0x3220, 0x3247 },
+    { 0x3250, 0x4DBF }, { 0x4E00, 0xA48C }, { 0xA490, 0xA4C6 }, { 0xA960, 0xA97C },
+    { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE52 },
+    { 0xFE54, 0xFE66 }, { 0xFE68, 0xFE6B }, { 0xFF01, 0xFF60 }, { 0xFFE0, 0xFFE6 },
+    { 0x16FE0, 0x16FE3 }, { 0x16FF0, 0x16FF1 }, { 0x17000, 0x187F7 }, { 0x18800, 0x18CD5 },
+    { 0x18D00, 0x18D08 }, { 0x1AFF0, 0x1AFF3 }, { 0x1AFF5, 0x1AFFB }, { 0x1AFFD, 0x1AFFE },
+    { 0x1B000, 0x1B122 }, { 0x1B150, 0x1B152 }, { 0x1B164, 0x1B167 }, { 0x1B170, 0x1B2FB },
+    { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A },
+    { 0x1F200, 0x1F202 }, { 0x1F210, 0x1F23B }, { 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 },
+    { 0x1F260, 0x1F265 }, { 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C },
+    { 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 },
+    { 0x1F3F4, 0x1F3F4 }, { 0x1F3F8, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC },
+    { 0x1F4FF, 0x1F53D }, { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A },
+    { 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 },
+    { 0x1F6CC, 0x1F6CC }, { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6D7 }, { 0x1F6DD, 0x1F6DF },
+    { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC }, { 0x1F7E0, 0x1F7EB }, { 0x1F7F0, 0x1F7F0 },
+    { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF }, { 0x1FA70, 0x1FA74 },
+    { 0x1FA78, 0x1FA7C }, { 0x1FA80, 0x1FA86 }, { 0x1FA90, 0x1FAAC }, { 0x1FAB0, 0x1FABA },
+    { 0x1FAC0, 0x1FAC5 }, { 0x1FAD0, 0x1FAD9 }, { 0x1FAE0, 0x1FAE7 }, { 0x1FAF0, 0x1FAF6 },
+    { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+static const uint32_t kBlockCount = 0x110000 >> 8;
+
+template <int N>
+constexpr void markMixedBlocks(const CodepointRange (&ranges)[N], bool *mixed) {
+    for (int i = 0; i < N; i++) {
+        for (uint32_t block = ranges[i].first >> 8; block <= ranges[i].last >> 8; block++) {
+            if (ranges[i].first > block << 8 || ranges[i].last < ((block << 8) | 0xFF)) {
+                mixed[block] = true;
+            }
+        }
+    }
+}
+
+// Blocks of 256 codepoints that contain more than one width
+constexpr int countMixedBlocks() {
+    bool mixed[kBlockCount] = {};
+    markMixedBlocks(kZeroWidthRanges, mixed);
+    markMixedBlocks(kWideRanges, mixed);
+    int count = 0;
+    for (uint32_t block = 0; block < kBlockCount; block++) {
+        count += mixed[block];
+    }
+    return count;
+}
+
+// Two-level width table over 256-codepoint blocks. Blocks of a single width
+// share one of three uniform pages; every other block gets its own page of
+// 2-bit widths.
+struct WidthTable {
+    enum { PageNarrow, PageWide, PageZero, UniformPageCount };
+    static const int kPageCount = UniformPageCount + countMixedBlocks();
+    
+    uint8_t blockPage[kBlockCount];
+    uint8_t pages[kPageCount][64];
+    
+    constexpr WidthTable() : blockPage(), pages() {
+        for (int i = 0; i < 64; i++) {
+            pages[PageNarrow][i] = 0x55;    // Width 1 in every 2-bit slot
+            pages[PageWide][i] = 0xAA;      // Width 2
+            pages[PageZero][i] = 0x00;
+        }
+        for (uint32_t block = 0; block < kBlockCount; block++) {
+            blockPage[block] = PageNarrow;
+        }
+        
+        int nextPage = UniformPageCount;
+        fill(kZeroWidthRanges, 0, PageZero, &nextPage);
+        fill(kWideRanges, 2, PageWide, &nextPage);
+    }
+    
+    template <int N>
+    constexpr void fill(const CodepointRange (&ranges)[N], int width, int uniformPage, int *nextPage) {
+        for (int i = 0; i < N; i++) {
+            for (uint32_t block = ranges[i].first >> 8; block <= ranges[i].last >> 8; block++) {
+                uint32_t first = block << 8;
+                uint32_t last = first | 0xFF;
+                if (ranges[i].first <= first && ranges[i].last >= last) {
+                    blockPage[block] = uniformPage;
+                    continue;
+                }
+                
+                // Partly covered: give the block a page of its own, starting
+                // out narrow, and set the covered slots
+                if (blockPage[block] < UniformPageCount) {
+                    blockPage[block] = *nextPage;
+                    for (int j = 0; j < 64; j++) {
+                        pages[*nextPage][j] = 0x55;
+                    }
+                    ++*nextPage;
+                }
+                
+                uint8_t *page = pages[blockPage[block]];
+                uint32_t from = ranges[i].first > first ? ranges[i].first : first;
+                uint32_t to = ranges[i].last < last ? ranges[i].last : last;
+                for (uint32_t codepoint = from; codepoint <= to; codepoint++) {
+                    int slot = codepoint & 0xFF;
+                    int shift = (slot & 3) * 2;
+                    page[slot >> 2] = uint8_t((page[slot >> 2] & ~(3 << shift)) | (width << shift));
+                }
+            }
+        }
+    }
+};
+
+static_assert(WidthTable::kPageCount <= 256, "Width table pages must be indexable by a byte");
+
+static constexpr WidthTable kWidthTable;
+
+// Number of cells a codepoint occupies: 0, 1 or 2
+static constexpr int width(uint32_t codepoint) {
+    if (codepoint < 0x300) {
+        // Latin and the C1 controls are by far the most common
+        return codepoint >= 0x80 && codepoint < 0xA0 ? 0 : 1;
+    }
+    if (codepoint > 0x10FFFF) {
+        return 1;
+    }
+    int slot = codepoint & 0xFF;
+    uint8_t packed = kWidthTable.pages[kWidthTable.blockPage[codepoint >> 8]][slot >> 2];
+    return (packed >> ((slot & 3) * 2)) & 3;
+}
+
+static_assert(width('A') == 1 && width(0x00E9) == 1 && width(0x0301) == 0 && width(0x200B) == 0,
+              "Latin letters are narrow, combining marks and format characters zero width");
+static_assert(width(0x4E00) == 2 && width(0xFF21) == 2 && width(0x1F600) == 2 && width(0x3099) == 0,
+              "Ideographs, fullwidth forms and emoji are wide, wide combining marks zero width");
+static_assert(width(0x0378) == 1 && width(0x05C8) == 1 && width(0xFFFE) == 1 && width(0x11AF9) == 1 &&
+              width(0x1E150) == 1 && width(0xE0080) == 1 && width(0x10FFFF) == 1,
+              "Unassigned codepoints and noncharacters are narrow");
+static_assert(width(0x9FFF) == 2 && width(0x2A6E0) == 2 && width(0x3FFFD) == 2,
+              "Unassigned codepoints reserved as Wide are wide");
+
+} // namespace unicode
+
+#endif // KORZETERM_UNICODE_H
@@ -0,0 +1,218 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2025 Korzeterm Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Byte streams for driving the terminal without a PTY: the generated
+// workloads of korzeterm-bench, which `korzeterm --replay` also runs to
+// train profile-guided builds, and recordings read back from disk.
+
+#ifndef KORZETERM_WORKLOADS_H
+#define KORZETERM_WORKLOADS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <string>
+
+// Same chunking as the PTY reader hands to the widget
+static const size_t kChunkSize = 64 * 1024;
+
+// Small deterministic generator so every run sees the same bytes
+class Random {
+public:
+    explicit Random(uint32_t seed) : m_state(seed) {}
+    
+    uint32_t next(uint32_t range) {
+        m_state = m_state * 1664525u + 1013904223u;
+        return (m_state >> 8) % range;
+    }
+
+private:
+    uint32_t m_state;
+};
+
+static void appendWord(std::string &out, Random &random) {
+    int length = 2 + random.next(9);
+    for (int i = 0; i < length; i++) {
+        out += char('a' + random.next(26));
+    }
+}
+
+static void appendUtf8(std::string &out, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        out += char(codepoint);
+    } else if (codepoint < 0x800) {
+        out += char(0xC0 | (codepoint >> 6));
+        out += char(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        out += char(0xE0 | (codepoint >> 12));
+        out += char(0x80 | ((codepoint >> 6) & 0x3F));
+        out += char(0x80 | (codepoint & 0x3F));
+    } else {
+        out += char(0xF0 | (codepoint >> 18));
+        out += char(0x80 | ((codepoint >> 12) & 0x3F));
+        out += char(0x80 | ((codepoint >> 6) & 0x3F));
+        out += char(0x80 | (codepoint & 0x3F));
+    }
+}
+
+// Plain text in lines of up to 100 columns, like cat on a source file
+static std::string makeAscii(size_t size) {
+    Random random(1);
+    std::string out;
+    while (out.size() < size) {
+        size_t lineStart = out.size();
+        while (out.size() - lineStart < 90) {
+            appendWord(out, random);
+            out += ' ';
+        }
+        out += "\r\n";
+    }
+    return out;
+}
+
+// Short words each with their own SGR: 256-color, truecolor and attributes
+static std::string makeSgr(size_t size) {
+    Random random(2);
+    std::string out;
+    char sgr[64];
+    while (out.size() < size) {
+        for (int word = 0; word < 12; word++) {
+            switch (random.next(4)) {
+                case 0:
+                    snprintf(sgr, sizeof(sgr), "\x1b[38;5;%um", random.next(256));
+                    break;
+                case 1:
+                    snprintf(sgr, sizeof(sgr), "\x1b[38;2;%u;%u;%um", random.next(256), random.next(256), random.next(256));
+                    break;
+                case 2:
+                    snprintf(sgr, sizeof(sgr), "\x1b[1;%u;%um", 30 + random.next(8), 40 + random.next(8));
+                    break;
+                default:
+                    snprintf(sgr, sizeof(sgr), "\x1b[0;4;9%um", random.next(8));
+                    break;
+            }
+            out += sgr;
+            appendWord(out, random);
+            out += ' ';
+        }
+        out += "\x1b[0m\r\n";
+    }
+    return out;
+}
+
+// CJK text mixed with accented Latin, Cyrillic and the odd emoji
+static std::string makeUtf8(size_t size) {
+    Random random(3);
+    std::string out;
+    while (out.size() < size) {
+        for (int i = 0; i < 36; i++) {
+            switch (random.next(5)) {
+                case 0:
+                case 1:
+                    appendUtf8(out, 0x4E00 + random.next(0x5000));   // CJK ideographs
+                    break;
+                case 2:
+                    appendUtf8(out, 0xC0 + random.next(0x40));       // Latin-1 letters
+                    break;
+                case 3:
+                    appendUtf8(out, 0x410 + random.next(0x40));      // Cyrillic
+                    break;
+                default:
+                    appendUtf8(out, 0x1F600 + random.next(0x50));    // Emoji
+                    break;
+            }
+        }
+        out += "\r\n";
+    }
+    return out;
+}
+
+// Full-screen redraws of an 80x24 screen addressed row by row, as vim or
+// htop produce them
+static std::string makeRedraw(size_t size) {
+    Random random(4);
+    std::string out;
+    char move[32];
+    while (out.size() < size) {
+        out += "\x1b[?25l\x1b[H";
+        for (int row = 1; row <= 24; row++) {
+            snprintf(move, sizeof(move), "\x1b[%d;1H", row);
+            out += move;
+            int column = 0;
+            while (column < 70) {
+                snprintf(move, sizeof(move), "\x1b[%u;%um", 30 + random.next(8), 40 + random.next(8));
+                out += move;
+                size_t start = out.size();
+                appendWord(out, random);
+                out += ' ';
+                column += int(out.size() - start);
+            }
+            out += "\x1b[0m\x1b[K";
+        }
+        out += "\x1b[24;1H\x1b[?25h";
+    }
+    return out;
+}
+
+// Many short lines, every one of which scrolls the screen (seq, logs)
+static std::string makeScroll(size_t size) {
+    std::string out;
+    char number[32];
+    for (unsigned i = 0; out.size() < size; i++) {
+        snprintf(number, sizeof(number), "%u\n", i);
+        out += number;
+    }
+    return out;
+}
+
+static bool readFile(const char *path, std::string *out) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    
+    char buffer[kChunkSize];
+    size_t bytesRead;
+    while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        out->append(buffer, bytesRead);
+    }
+    fclose(file);
+    return true;
+}
+
+// The generated workloads, in the order they are run
+struct Workload {
+    const char *name;
+    std::string (*make)(size_t size);
+};
+
+static const Workload kWorkloads[] = {
+    { "ascii", makeAscii },
+    { "sgr-color", makeSgr },
+    { "utf8-cjk", makeUtf8 },
+    { "fullscreen-redraw", makeRedraw },
+    { "scroll-storm", makeScroll },
+};
+
+#endif // KORZETERM_WORKLOADS_H